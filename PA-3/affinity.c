@@ -0,0 +1,145 @@
+/*
+ * File: affinity.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/20
+ * Description:
+ * 	CPU list parsing, pinning and NUMA node helpers for
+ *      multi-threadedDNS.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#include "affinity.h"
+
+int affinity_parse(const char* list, cpu_set_t* set){
+
+    const char* p = list;
+    char* end;
+    long first, last;
+
+    CPU_ZERO(set);
+
+    while(*p){
+	first = strtol(p, &end, 10);
+	if(end == p || first < 0){
+	    return AFFINITY_FAILURE;
+	}
+	last = first;
+	p = end;
+	if(*p == '-'){
+	    p++;
+	    last = strtol(p, &end, 10);
+	    if(end == p || last < first){
+		return AFFINITY_FAILURE;
+	    }
+	    p = end;
+	}
+	if(last >= CPU_SETSIZE){
+	    return AFFINITY_FAILURE;
+	}
+	for(; first <= last; first++){
+	    CPU_SET(first, set);
+	}
+	if(*p == ','){
+	    p++;
+	}
+	else if(*p){
+	    return AFFINITY_FAILURE;
+	}
+    }
+
+    if(CPU_COUNT(set) == 0){
+	return AFFINITY_FAILURE;
+    }
+    return CPU_COUNT(set);
+}
+
+void affinity_slice(const cpu_set_t* set, int part, int nparts,
+		    cpu_set_t* slice){
+
+    int count = CPU_COUNT(set);
+    int lo, hi, i, n;
+
+    /* contiguous run of count/nparts cpus, or one shared cpu */
+    if(count >= nparts){
+	lo = (int)((long)part * count / nparts);
+	hi = (int)((long)(part + 1) * count / nparts);
+    }
+    else{
+	lo = part % count;
+	hi = lo + 1;
+    }
+
+    CPU_ZERO(slice);
+    for(i = 0, n = 0; i < CPU_SETSIZE && n < hi; i++){
+	if(CPU_ISSET(i, set)){
+	    if(n >= lo){
+		CPU_SET(i, slice);
+	    }
+	    n++;
+	}
+    }
+}
+
+int affinity_pin(const cpu_set_t* set){
+    if(sched_setaffinity(0, sizeof(cpu_set_t), set)){
+	perror("Error setting cpu affinity");
+	return AFFINITY_FAILURE;
+    }
+    return AFFINITY_SUCCESS;
+}
+
+#ifdef HAVE_LIBNUMA
+
+int affinity_numa(void){
+    return 1;
+}
+
+int affinity_nodes(const cpu_set_t* set, cpu_set_t* nodes, int max){
+
+    int i, node, n = 0;
+
+    if(numa_available() < 0){
+	return AFFINITY_FAILURE;
+    }
+
+    for(i = 0; i < max; i++){
+	CPU_ZERO(&nodes[i]);
+    }
+    for(i = 0; i < CPU_SETSIZE; i++){
+	if(!CPU_ISSET(i, set)){
+	    continue;
+	}
+	node = numa_node_of_cpu(i);
+	if(node < 0 || node >= max){
+	    continue;
+	}
+	CPU_SET(i, &nodes[node]);
+	if(node >= n){
+	    n = node + 1;
+	}
+    }
+
+    return n;
+}
+
+#else
+
+int affinity_numa(void){
+    return 0;
+}
+
+int affinity_nodes(const cpu_set_t* set, cpu_set_t* nodes, int max){
+    (void)set;
+    (void)nodes;
+    (void)max;
+    return AFFINITY_FAILURE;
+}
+
+#endif
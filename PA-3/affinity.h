@@ -0,0 +1,63 @@
+/*
+ * File: affinity.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/20
+ * Description:
+ * 	CPU list parsing, pinning and NUMA node helpers for
+ *      multi-threadedDNS.
+ *      CPU lists use the kernel's cpulist format, e.g. "0-3,8,10-11".
+ *
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+
+#define AFFINITY_FAILURE -1
+#define AFFINITY_SUCCESS 0
+
+#define AFFINITY_MAX_NODES 64
+
+/* Where the pipeline's threads may run
+ * An empty set leaves that pool unpinned
+ */
+typedef struct placement_s{
+    cpu_set_t readers;
+    cpu_set_t resolvers;
+    int numa;		/* one queue per NUMA node */
+} placement;
+
+/* Function to parse a cpulist string into set
+ * Returns the number of cpus in the set
+ * Returns AFFINITY_FAILURE on a malformed or empty list
+ */
+int affinity_parse(const char* list, cpu_set_t* set);
+
+/* Function to take slice part of nparts out of set
+ * Cpus are split into contiguous runs; when there are fewer
+ * cpus than parts, slices wrap around and share cpus
+ */
+void affinity_slice(const cpu_set_t* set, int part, int nparts,
+		    cpu_set_t* slice);
+
+/* Function to pin the calling process to set
+ * Threads created afterwards inherit the mask
+ * Returns AFFINITY_SUCCESS or AFFINITY_FAILURE
+ */
+int affinity_pin(const cpu_set_t* set);
+
+/* Function to tell whether NUMA support was built in (libnuma)
+ * Returns 1 if it was, 0 if not
+ */
+int affinity_numa(void);
+
+/* Function to split set by NUMA node
+ * nodes[n] gets the cpus of set that sit on node n
+ * Returns the number of entries filled in (highest node + 1)
+ * Returns AFFINITY_FAILURE when NUMA is not available
+ */
+int affinity_nodes(const cpu_set_t* set, cpu_set_t* nodes, int max);
+
+#endif
@@ -0,0 +1,659 @@
+/*
+ * File: dns_engine.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/02
+ * Description:
+ * 	Reentrant batch DNS resolution engine.
+ *      Each engine owns its queues ("lanes": one per NUMA node, or a
+ *      single one), resolver threads, result list and result cache.
+ *      Nothing is global, so engines can be created and destroyed
+ *      independently from any thread.
+ *
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns_engine.h"
+#include "queue.h"
+#include "util.h"
+#include "trace.h"
+#include "hostname.h"
+
+#define DNS_CACHE_TTL 300	/* default seconds */
+#define CACHE_STRIPES 64	/* cache locks */
+#define SUBMIT_CHUNK 64		/* requests pushed per queue lock */
+
+/* one hostname travelling through a queue, normalized by submit */
+typedef struct request_s{
+    long tag;
+    uint64_t hash;		/* hostname_hash of the normalized name */
+    int name_status;		/* HOSTNAME_VALID or why it was refused */
+    char hostname[];
+} request;
+
+/* a queue with the resolvers that serve it */
+typedef struct lane_s{
+    queue q;
+    pthread_cond_t full;
+    pthread_cond_t empty;
+    pthread_mutex_t lock;
+    int size;			/* queue slots */
+    int stopping;		/* set by dns_engine_destroy, under lock */
+    cpu_set_t reader_cpus;	/* where submitters bound to this lane run */
+    cpu_set_t resolver_cpus;	/* empty when resolvers are not pinned */
+    dns_engine* e;
+} lane;
+
+typedef struct cache_entry_s{
+    uint64_t hash;
+    time_t expires;
+    dns_result* res;
+} cache_entry;
+
+struct dns_engine_s{
+    dns_engine_config cfg;
+
+    int nlanes;
+    lane* lanes[AFFINITY_MAX_NODES];
+    signed char cpu_lane[CPU_SETSIZE];	/* submitting cpu -> lane, -1 if none */
+    unsigned next_lane;			/* round robin for unbound submitters */
+
+    int nthreads;
+    pthread_t* threads;
+
+    pthread_mutex_t done_lock;
+    pthread_cond_t ready;		/* a result was queued for poll */
+    pthread_cond_t idle;		/* completed caught up with submitted */
+    long submitted;
+    long completed;
+    dns_result* head;			/* results waiting for poll */
+    dns_result* tail;
+
+    cache_entry* cache;
+    pthread_mutex_t cache_locks[CACHE_STRIPES];
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static time_t engine_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* create a thread, pinned to cpus unless the set is empty */
+static int spawn(pthread_t* thread, const cpu_set_t* cpus, void* (*fn)(void*), void* arg){
+    pthread_attr_t attr;
+    int ret;
+
+    pthread_attr_init(&attr);
+    if(cpus && CPU_COUNT(cpus) > 0){
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+    }
+    ret = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+static dns_result* result_new(const char* hostname, long tag){
+    dns_result* res = calloc(1, sizeof(dns_result));
+    if(!res){
+	return NULL;
+    }
+    res->hostname = strdup(hostname);
+    res->tag = tag;
+    return res;
+}
+
+static dns_result* result_copy(const dns_result* src, long tag){
+    dns_result* res = result_new(src->hostname, tag);
+    if(!res){
+	return NULL;
+    }
+    res->status = src->status;
+    res->naddrs = src->naddrs;
+    for(int i = 0; i < src->naddrs; i++){
+	res->addrs[i] = strdup(src->addrs[i]);
+    }
+    return res;
+}
+
+void dns_result_free(dns_result* res){
+    if(!res){
+	return;
+    }
+    for(int i = 0; i < DNS_MAX_ADDRS; i++){
+	free(res->addrs[i]);
+    }
+    free(res->hostname);
+    free(res);
+}
+
+/* Function to answer hostname from the cache
+ * Returns a new result, or NULL on a miss
+ */
+static dns_result* cache_get(dns_engine* e, const char* hostname, uint64_t hash, long tag){
+    size_t slot = hash % e->cfg.cache_size;
+    pthread_mutex_t* lock = &e->cache_locks[slot % CACHE_STRIPES];
+    cache_entry* c = &e->cache[slot];
+    dns_result* res = NULL;
+
+    pthread_mutex_lock(lock);
+    if(c->res && c->hash == hash && c->expires > engine_now() &&
+       !strcmp(c->res->hostname, hostname)){
+	res = result_copy(c->res, tag);
+    }
+    pthread_mutex_unlock(lock);
+
+    __atomic_fetch_add(res ? &e->hits : &e->misses, 1, __ATOMIC_RELAXED);
+    if(res){
+	res->cached = 1;
+    }
+    return res;
+}
+
+/* Function to remember res, replacing whatever shared its slot */
+static void cache_put(dns_engine* e, const dns_result* res, uint64_t hash){
+    size_t slot = hash % e->cfg.cache_size;
+    pthread_mutex_t* lock = &e->cache_locks[slot % CACHE_STRIPES];
+    cache_entry* c = &e->cache[slot];
+    dns_result* copy = result_copy(res, 0);
+    dns_result* old;
+
+    if(!copy){
+	return;
+    }
+    pthread_mutex_lock(lock);
+    old = c->res;
+    c->res = copy;
+    c->hash = hash;
+    c->expires = engine_now() + e->cfg.cache_ttl;
+    pthread_mutex_unlock(lock);
+    dns_result_free(old);
+}
+
+/* Function to answer hostname from the hosts overlay
+ * Returns a new result, or NULL when the name is not in it
+ */
+static dns_result* overlay_get(dns_engine* e, const char* hostname, long tag){
+    hostmap_result hr;
+    dns_result* res;
+    const char* a;
+
+    if(hostmap_lookup(e->cfg.hosts, hostname, &hr) != HOSTMAP_SUCCESS){
+	return NULL;
+    }
+    res = result_new(hostname, tag);
+    if(!res){
+	return NULL;
+    }
+    res->status = UTIL_SUCCESS;
+    res->overlay = 1;
+    a = hr.addrs;
+    while(res->naddrs < hr.naddrs && res->naddrs < DNS_MAX_ADDRS){
+	res->addrs[res->naddrs++] = strdup(a);
+	a = hostmap_next_addr(a);
+    }
+    return res;
+}
+
+/* hand a finished result to the callback or the poll list
+ * res is NULL when it could not be allocated; it still counts as done
+ */
+static void deliver(dns_engine* e, dns_result* res){
+    if(res && e->cfg.callback){
+	e->cfg.callback(res, e->cfg.callback_arg);
+	dns_result_free(res);
+    }
+
+    pthread_mutex_lock(&e->done_lock);
+    if(res && !e->cfg.callback){
+	res->next = NULL;
+	if(e->tail){
+	    e->tail->next = res;
+	}
+	else{
+	    e->head = res;
+	}
+	e->tail = res;
+    }
+    e->completed++;
+    pthread_cond_broadcast(&e->ready);
+    if(e->completed == e->submitted){
+	pthread_cond_broadcast(&e->idle);
+    }
+    pthread_mutex_unlock(&e->done_lock);
+}
+
+static dns_result* resolve(dns_engine* e, request* req){
+    dns_result* res;
+
+    /* malformed names are answered without a lookup, and not cached */
+    if(req->name_status != HOSTNAME_VALID){
+	res = result_new(req->hostname, req->tag);
+	if(res){
+	    res->status = UTIL_FAILURE;
+	    res->name_status = req->name_status;
+	    res->addrs[res->naddrs++] = strdup("none");
+	}
+	return res;
+    }
+
+    if(e->cfg.hosts){
+	res = overlay_get(e, req->hostname, req->tag);
+	if(res){
+	    return res;
+	}
+    }
+
+    if(e->cache){
+	res = cache_get(e, req->hostname, req->hash, req->tag);
+	if(res){
+	    return res;
+	}
+    }
+
+    res = result_new(req->hostname, req->tag);
+    if(!res){
+	return NULL;
+    }
+
+    TRACE_BEGIN(lookup_start);
+    res->status = dnslookup(req->hostname, res->addrs);
+    TRACE_END(TRACE_LOOKUP, lookup_start);
+
+    while(res->naddrs < DNS_MAX_ADDRS && res->addrs[res->naddrs]){
+	res->naddrs++;
+    }
+    if(res->status == UTIL_FAILURE && res->naddrs < DNS_MAX_ADDRS){
+	res->addrs[res->naddrs++] = strdup("none");
+    }
+
+    if(e->cache){
+	cache_put(e, res, req->hash);
+    }
+    return res;
+}
+
+/* resolver thread: runs until the engine stops and its queue is empty */
+static void* resolver(void* arg){
+    lane* l = arg;
+    dns_engine* e = l->e;
+
+    trace_thread_name("resolver");
+
+    while(1){
+	request* req;
+	dns_result* res;
+
+	pthread_mutex_lock(&l->lock);
+	TRACE_BEGIN(wait_start);
+	while(queue_is_empty(&l->q)){
+	    if(l->stopping){
+		pthread_mutex_unlock(&l->lock);
+		return NULL;
+	    }
+	    pthread_cond_wait(&l->empty, &l->lock);
+	}
+	TRACE_END(TRACE_QUEUE_WAIT, wait_start);
+	req = queue_pop(&l->q);
+	pthread_cond_signal(&l->full);
+	pthread_mutex_unlock(&l->lock);
+
+	res = resolve(e, req);
+	free(req);
+	deliver(e, res);
+    }
+}
+
+/* runs on the lane's own cpus, so the lane and its queue are allocated on its node */
+static void* lane_new(void* arg){
+    lane* tmpl = arg;
+    lane* l = malloc(sizeof(lane));
+
+    if(!l){
+	return NULL;
+    }
+    *l = *tmpl;
+    if(queue_init(&l->q, l->size) == QUEUE_FAILURE){
+	free(l);
+	return NULL;
+    }
+    pthread_cond_init(&l->empty, NULL);
+    pthread_cond_init(&l->full, NULL);
+    pthread_mutex_init(&l->lock, NULL);
+    return l;
+}
+
+static void lane_free(lane* l){
+    request* req;
+    while((req = queue_pop(&l->q))){
+	free(req);
+    }
+    queue_cleanup(&l->q);
+    pthread_cond_destroy(&l->empty);
+    pthread_cond_destroy(&l->full);
+    pthread_mutex_destroy(&l->lock);
+    free(l);
+}
+
+/* restrict want to the cpus this process may use; empty means all of them */
+static void allowed_cpus(const cpu_set_t* want, const cpu_set_t* allowed, cpu_set_t* out){
+    CPU_AND(out, want, allowed);
+    if(CPU_COUNT(out) == 0){
+	*out = *allowed;
+    }
+}
+
+/* lay out one lane per NUMA node, or a single lane, and build them on their cpus */
+static int make_lanes(dns_engine* e){
+    const placement* where = &e->cfg.where;
+    int max = e->cfg.max_lanes > 0 ? e->cfg.max_lanes : AFFINITY_MAX_NODES;
+    cpu_set_t allowed, readers, resolvers;
+    cpu_set_t rnodes[AFFINITY_MAX_NODES], snodes[AFFINITY_MAX_NODES];
+    lane tmpl[AFFINITY_MAX_NODES];
+    int n = 0;
+
+    sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+    allowed_cpus(&where->readers, &allowed, &readers);
+    allowed_cpus(&where->resolvers, &allowed, &resolvers);
+    memset(tmpl, 0, sizeof(tmpl));
+
+    /* a node is only worth a lane if it can run both submitters and resolvers */
+    if(where->numa){
+	int nodes = affinity_nodes(&readers, rnodes, AFFINITY_MAX_NODES);
+	if(nodes < 0 || affinity_nodes(&resolvers, snodes, AFFINITY_MAX_NODES) < 0){
+	    fprintf(stderr, "NUMA is not available, using a single queue\n");
+	    nodes = 0;
+	}
+	for(int i = 0; i < nodes && n < max; i++){
+	    if(CPU_COUNT(&rnodes[i]) && CPU_COUNT(&snodes[i])){
+		tmpl[n].reader_cpus = rnodes[i];
+		tmpl[n].resolver_cpus = snodes[i];
+		n++;
+	    }
+	}
+    }
+    if(n == 0){
+	tmpl[0].reader_cpus = readers;
+	tmpl[0].resolver_cpus = resolvers;
+	n = 1;
+    }
+
+    memset(e->cpu_lane, -1, sizeof(e->cpu_lane));
+    for(int i = 0; i < n; i++){
+	pthread_t t;
+	cpu_set_t lane_cpus;
+
+	tmpl[i].size = e->cfg.queue_size;
+	tmpl[i].e = e;
+	CPU_OR(&lane_cpus, &tmpl[i].reader_cpus, &tmpl[i].resolver_cpus);
+	if(spawn(&t, &lane_cpus, lane_new, &tmpl[i])){
+	    return DNS_ENGINE_FAILURE;
+	}
+	pthread_join(t, (void**) &e->lanes[i]);
+	if(!e->lanes[i]){
+	    return DNS_ENGINE_FAILURE;
+	}
+	e->nlanes++;
+
+	/* unpinned pools float as before */
+	if(!CPU_COUNT(&where->readers) && !where->numa){
+	    CPU_ZERO(&e->lanes[i]->reader_cpus);
+	}
+	if(!CPU_COUNT(&where->resolvers) && !where->numa){
+	    CPU_ZERO(&e->lanes[i]->resolver_cpus);
+	}
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+	    if(CPU_ISSET(cpu, &e->lanes[i]->reader_cpus)){
+		e->cpu_lane[cpu] = i;
+	    }
+	}
+    }
+    return DNS_ENGINE_SUCCESS;
+}
+
+/* the lane serving the calling thread's cpu, else the next in turn */
+static lane* pick_lane(dns_engine* e){
+    int cpu = sched_getcpu();
+    if(cpu >= 0 && cpu < CPU_SETSIZE && e->cpu_lane[cpu] >= 0){
+	return e->lanes[(int)e->cpu_lane[cpu]];
+    }
+    return e->lanes[__atomic_fetch_add(&e->next_lane, 1, __ATOMIC_RELAXED) % e->nlanes];
+}
+
+void dns_engine_config_init(dns_engine_config* cfg){
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->cache_ttl = DNS_CACHE_TTL;
+}
+
+dns_engine* dns_engine_create(const dns_engine_config* cfg){
+    dns_engine* e = calloc(1, sizeof(dns_engine));
+    int i;
+
+    if(!e){
+	return NULL;
+    }
+    e->cfg = *cfg;
+    pthread_mutex_init(&e->done_lock, NULL);
+    pthread_cond_init(&e->ready, NULL);
+    pthread_cond_init(&e->idle, NULL);
+    for(i = 0; i < CACHE_STRIPES; i++){
+	pthread_mutex_init(&e->cache_locks[i], NULL);
+    }
+
+    if(e->cfg.cache_size > 0){
+	e->cache = calloc(e->cfg.cache_size, sizeof(cache_entry));
+	if(!e->cache){
+	    goto fail;
+	}
+    }
+
+    if(make_lanes(e)){
+	goto fail;
+    }
+
+    /* each lane gets its share of resolvers, pinned next to its submitters */
+    e->nthreads = e->cfg.threads > 0 ? e->cfg.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if(e->nthreads < e->nlanes){
+	e->nthreads = e->nlanes;
+    }
+    e->threads = malloc(sizeof(pthread_t) * e->nthreads);
+    if(!e->threads){
+	goto fail;
+    }
+    for(i = 0; i < e->nthreads; i++){
+	lane* l = e->lanes[i % e->nlanes];
+	if(spawn(&e->threads[i], &l->resolver_cpus, resolver, l)){
+	    e->nthreads = i;
+	    dns_engine_destroy(e);
+	    return NULL;
+	}
+    }
+    return e;
+
+ fail:
+    e->nthreads = 0;
+    dns_engine_destroy(e);
+    return NULL;
+}
+
+int dns_engine_submit(dns_engine* e, char** hostnames, const long* tags, int n){
+    lane* l = pick_lane(e);
+    request* chunk[SUBMIT_CHUNK];
+    char* names[SUBMIT_CHUNK];
+    uint64_t hashes[SUBMIT_CHUNK];
+    int status[SUBMIT_CHUNK];
+
+    if(n <= 0){
+	return DNS_ENGINE_SUCCESS;
+    }
+    pthread_mutex_lock(&e->done_lock);
+    e->submitted += n;
+    pthread_mutex_unlock(&e->done_lock);
+
+    /* allocate and normalize outside the queue lock, then push the chunk under one hold */
+    for(int done = 0; done < n; ){
+	int count = n - done < SUBMIT_CHUNK ? n - done : SUBMIT_CHUNK;
+
+	for(int i = 0; i < count; i++){
+	    size_t len = strlen(hostnames[done + i]) + 1;
+	    /* padded for the vector passes' whole-chunk loads */
+	    chunk[i] = malloc(sizeof(request) + len + HOSTNAME_PAD);
+	    if(!chunk[i]){
+		/* give back what this call could not queue */
+		while(i--){
+		    free(chunk[i]);
+		}
+		pthread_mutex_lock(&e->done_lock);
+		e->submitted -= n - done;
+		if(e->completed == e->submitted){
+		    pthread_cond_broadcast(&e->idle);
+		}
+		pthread_mutex_unlock(&e->done_lock);
+		return DNS_ENGINE_FAILURE;
+	    }
+	    chunk[i]->tag = tags ? tags[done + i] : done + i;
+	    memcpy(chunk[i]->hostname, hostnames[done + i], len);
+	    names[i] = chunk[i]->hostname;
+	}
+
+	/* lower case, validate and hash the chunk in one pass */
+	hostname_normalize_batch(names, count, NULL, hashes, status);
+	for(int i = 0; i < count; i++){
+	    chunk[i]->hash = hashes[i];
+	    chunk[i]->name_status = status[i];
+	}
+
+	pthread_mutex_lock(&l->lock);
+	for(int i = 0; i < count; i++){
+	    if(queue_is_full(&l->q)){
+		TRACE_BEGIN(wait_start);
+		pthread_cond_broadcast(&l->empty);
+		while(queue_is_full(&l->q)){
+		    pthread_cond_wait(&l->full, &l->lock);
+		}
+		TRACE_END(TRACE_QUEUE_WAIT, wait_start);
+	    }
+	    queue_push(&l->q, chunk[i]);
+	}
+	if(count > 1){
+	    pthread_cond_broadcast(&l->empty);
+	}
+	else{
+	    pthread_cond_signal(&l->empty);
+	}
+	pthread_mutex_unlock(&l->lock);
+	done += count;
+    }
+    return DNS_ENGINE_SUCCESS;
+}
+
+int dns_engine_poll(dns_engine* e, dns_result** results, int max, int timeout_ms){
+    struct timespec deadline;
+    int n = 0;
+
+    if(e->cfg.callback){
+	return DNS_ENGINE_FAILURE;
+    }
+    if(timeout_ms > 0){
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L){
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000L;
+	}
+    }
+
+    pthread_mutex_lock(&e->done_lock);
+    /* nothing in flight means nothing will arrive, so don't wait for it */
+    while(!e->head && timeout_ms != 0 && e->completed < e->submitted){
+	if(timeout_ms < 0){
+	    pthread_cond_wait(&e->ready, &e->done_lock);
+	}
+	else if(pthread_cond_timedwait(&e->ready, &e->done_lock, &deadline)){
+	    break;
+	}
+    }
+    while(n < max && e->head){
+	results[n++] = e->head;
+	e->head = e->head->next;
+    }
+    if(!e->head){
+	e->tail = NULL;
+    }
+    pthread_mutex_unlock(&e->done_lock);
+
+    for(int i = 0; i < n; i++){
+	results[i]->next = NULL;
+    }
+    return n;
+}
+
+void dns_engine_wait(dns_engine* e){
+    pthread_mutex_lock(&e->done_lock);
+    while(e->completed < e->submitted){
+	pthread_cond_wait(&e->idle, &e->done_lock);
+    }
+    pthread_mutex_unlock(&e->done_lock);
+}
+
+void dns_engine_bind(dns_engine* e, int slot){
+    lane* l = e->lanes[slot % e->nlanes];
+    if(CPU_COUNT(&l->reader_cpus) > 0){
+	affinity_pin(&l->reader_cpus);
+    }
+}
+
+void dns_engine_cache_stats(dns_engine* e, unsigned long* hits, unsigned long* misses){
+    *hits = __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&e->misses, __ATOMIC_RELAXED);
+}
+
+void dns_engine_destroy(dns_engine* e){
+    int i;
+
+    /* resolvers drain their queue before they see stopping */
+    for(i = 0; i < e->nlanes; i++){
+	lane* l = e->lanes[i];
+	pthread_mutex_lock(&l->lock);
+	l->stopping = 1;
+	pthread_cond_broadcast(&l->empty);
+	pthread_mutex_unlock(&l->lock);
+    }
+    for(i = 0; i < e->nthreads; i++){
+	pthread_join(e->threads[i], NULL);
+    }
+    free(e->threads);
+
+    for(i = 0; i < e->nlanes; i++){
+	lane_free(e->lanes[i]);
+    }
+    while(e->head){
+	dns_result* next = e->head->next;
+	dns_result_free(e->head);
+	e->head = next;
+    }
+    if(e->cache){
+	for(i = 0; i < e->cfg.cache_size; i++){
+	    dns_result_free(e->cache[i].res);
+	}
+	free(e->cache);
+    }
+    for(i = 0; i < CACHE_STRIPES; i++){
+	pthread_mutex_destroy(&e->cache_locks[i]);
+    }
+    pthread_cond_destroy(&e->idle);
+    pthread_cond_destroy(&e->ready);
+    pthread_mutex_destroy(&e->done_lock);
+    free(e);
+}
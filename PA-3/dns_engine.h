@@ -0,0 +1,113 @@
+/*
+ * File: dns_engine.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/02
+ * Description:
+ * 	Reentrant batch DNS resolution engine, the core of multi-threadedDNS
+ *      as a library. Hostnames submitted to an engine are resolved by its
+ *      own resolver threads and come back through a completion callback
+ *      or dns_engine_poll(). Engines share no state, so any number of
+ *      them can run in one process.
+ *
+ *      Typical use:
+ *          dns_engine_config cfg;
+ *          dns_engine_config_init(&cfg);
+ *          cfg.cache_size = 4096;
+ *          dns_engine* e = dns_engine_create(&cfg);
+ *          dns_engine_submit(e, hostnames, NULL, n);
+ *          while(got < n) got += dns_engine_poll(e, results, 64, -1);
+ *          dns_engine_destroy(e);
+ *
+ */
+
+#ifndef DNS_ENGINE_H
+#define DNS_ENGINE_H
+
+#include "affinity.h"
+#include "hostmap.h"
+#include "hostname.h"
+
+#define DNS_ENGINE_FAILURE -1
+#define DNS_ENGINE_SUCCESS 0
+
+#define DNS_MAX_ADDRS 30
+
+typedef struct dns_engine_s dns_engine;
+
+/* One resolved hostname
+ * hostname is the submitted name normalized by hostname_normalize():
+ * lower case, without trailing dots
+ * addrs are in the text output format: dotted IPv4, "IPv6-UNHANDLED",
+ * or a single "none" when the lookup failed or the name was invalid
+ */
+typedef struct dns_result_s{
+    char* hostname;
+    long tag;			/* the caller's tag from dns_engine_submit */
+    int status;			/* UTIL_SUCCESS or UTIL_FAILURE */
+    int cached;			/* answered from the result cache */
+    int overlay;		/* answered from the hosts overlay */
+    int name_status;		/* HOSTNAME_VALID, or why no lookup was tried */
+    int naddrs;
+    char* addrs[DNS_MAX_ADDRS];
+    struct dns_result_s* next;	/* internal */
+} dns_result;
+
+/* Completion callback, called on a resolver thread
+ * The engine frees res when the callback returns
+ */
+typedef void (*dns_callback)(dns_result* res, void* arg);
+
+typedef struct dns_engine_config_s{
+    int threads;		/* resolver threads, 0 for one per online cpu */
+    int queue_size;		/* slots per queue, 0 for QUEUEMAXSIZE */
+    int cache_size;		/* cached results, 0 disables the cache */
+    int cache_ttl;		/* seconds a cached result stays valid */
+    int max_lanes;		/* cap on NUMA queues, 0 for one per node */
+    placement where;		/* thread pinning and NUMA queues */
+    const hostmap* hosts;	/* static overlay tried before the cache, may be NULL */
+    dns_callback callback;	/* NULL collects results for dns_engine_poll */
+    void* callback_arg;
+} dns_engine_config;
+
+/* Function to fill cfg with the defaults */
+void dns_engine_config_init(dns_engine_config* cfg);
+
+/* Function to start an engine and its resolver threads
+ * Returns NULL on failure
+ */
+dns_engine* dns_engine_create(const dns_engine_config* cfg);
+
+/* Function to queue n hostnames for resolution
+ * tags (may be NULL) are handed back in each result
+ * Blocks while the queue is full
+ * Returns DNS_ENGINE_SUCCESS or DNS_ENGINE_FAILURE
+ */
+int dns_engine_submit(dns_engine* e, char** hostnames, const long* tags, int n);
+
+/* Function to collect up to max finished results (no callback set)
+ * Waits up to timeout_ms for the first one, forever when negative
+ * Returns the number of results; free each with dns_result_free
+ */
+int dns_engine_poll(dns_engine* e, dns_result** results, int max, int timeout_ms);
+
+/* Function to wait until every submitted hostname has completed */
+void dns_engine_wait(dns_engine* e);
+
+/* Function to pin the calling thread next to queue slot % queues
+ * Later submits from the thread go to that queue's resolvers
+ */
+void dns_engine_bind(dns_engine* e, int slot);
+
+/* Function to report result cache hits and misses */
+void dns_engine_cache_stats(dns_engine* e, unsigned long* hits, unsigned long* misses);
+
+/* Function to free a result from dns_engine_poll */
+void dns_result_free(dns_result* res);
+
+/* Function to finish outstanding work, stop the threads and free e
+ * Results not yet polled are freed
+ */
+void dns_engine_destroy(dns_engine* e);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * File: dnsdb-tool.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/22
+ * Description:
+ * 	Command line front end for multi-threadedDNS results databases:
+ *      host lookups and conversion to and from the text output format.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dnsdb.h"
+
+#define USAGE "Usage: %s lookup <db> <hostname>...\n" \
+              "       %s dump <db> [<outputFilePath>]\n" \
+              "       %s build <inputFilePath> <db>\n"
+
+static int lookup(const char* path, char** hosts, int nhosts){
+    dnsdb db;
+    dnsdb_result res;
+    int ret = EXIT_SUCCESS;
+
+    if(dnsdb_open(&db, path)){
+        return EXIT_FAILURE;
+    }
+    for(int i = 0; i < nhosts; i++){
+        if(dnsdb_lookup(&db, hosts[i], &res) == DNSDB_SUCCESS){
+            dnsdb_print(&res, stdout);
+        }
+        else{
+            fprintf(stderr, "%s: not found\n", hosts[i]);
+            ret = EXIT_FAILURE;
+        }
+    }
+    dnsdb_close(&db);
+    return ret;
+}
+
+static int dump(const char* path, const char* outPath){
+    dnsdb db;
+    dnsdb_result res;
+    FILE* out = stdout;
+    uint64_t i;
+    int ret;
+
+    if(dnsdb_open(&db, path)){
+        return EXIT_FAILURE;
+    }
+    if(outPath && !(out = fopen(outPath, "w"))){
+        perror("Error opening output file");
+        dnsdb_close(&db);
+        return EXIT_FAILURE;
+    }
+    for(i = 0; (ret = dnsdb_get(&db, i, &res)) == DNSDB_SUCCESS; i++){
+        dnsdb_print(&res, out);
+    }
+    if(ret == DNSDB_FAILURE){
+        fprintf(stderr, "%s: record %llu is corrupt\n", path, (unsigned long long)i);
+    }
+    if(out != stdout){
+        fclose(out);
+    }
+    dnsdb_close(&db);
+    return ret == DNSDB_FAILURE ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int build(const char* inPath, const char* path){
+    dnsdb_writer w;
+    FILE* in = fopen(inPath, "r");
+    char* line = NULL;
+    size_t len = 0;
+    int ret = EXIT_SUCCESS;
+
+    if(!in){
+        perror("Error opening input file");
+        return EXIT_FAILURE;
+    }
+    dnsdb_writer_init(&w);
+    while(getline(&line, &len, in) > 0){
+        if(dnsdb_writer_add_line(&w, line)){
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+    if(ret == EXIT_SUCCESS && dnsdb_writer_finish(&w, path)){
+        ret = EXIT_FAILURE;
+    }
+    dnsdb_writer_cleanup(&w);
+    free(line);
+    fclose(in);
+    return ret;
+}
+
+int main(int argc, char* argv[]){
+    if(argc >= 4 && !strcmp(argv[1], "lookup")){
+        return lookup(argv[2], argv + 3, argc - 3);
+    }
+    if((argc == 3 || argc == 4) && !strcmp(argv[1], "dump")){
+        return dump(argv[2], argc == 4 ? argv[3] : NULL);
+    }
+    if(argc == 4 && !strcmp(argv[1], "build")){
+        return build(argv[2], argv[3]);
+    }
+    fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,368 @@
+/*
+ * File: dnsdb.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/22
+ * Description:
+ * 	Queryable binary results database for multi-threadedDNS.
+ *      See dnsdb.h for the file layout.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dnsdb.h"
+
+#define DNSDB_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+uint64_t dnsdb_hash(const char* hostname){
+    uint64_t h = 14695981039346656037ULL;
+    while(*hostname){
+	h ^= (unsigned char)*hostname++;
+	h *= 1099511628211ULL;
+    }
+    /* never 0, that marks an empty slot */
+    return h | (1ULL << 63);
+}
+
+/* whether count entries of elsize bytes at off lie within size bytes */
+static int dnsdb_fits(uint64_t off, uint64_t count, uint64_t elsize, uint64_t size){
+    return off <= size && count <= (size - off) / elsize;
+}
+
+/* check every section of the header lies within the mapping, so lookups
+ * never read outside it */
+static int dnsdb_check(const dnsdb_header* hdr, uint64_t size){
+    return hdr->nbuckets > 0 && (hdr->nbuckets & (hdr->nbuckets - 1)) == 0 &&
+	hdr->nbuckets > hdr->nrecords &&
+	hdr->index_off % 8 == 0 && hdr->records_off % 8 == 0 &&
+	hdr->index_off >= sizeof(dnsdb_header) &&
+	dnsdb_fits(hdr->index_off, hdr->nbuckets, sizeof(dnsdb_slot), size) &&
+	dnsdb_fits(hdr->records_off, hdr->nrecords, sizeof(dnsdb_rec), size) &&
+	hdr->names_off <= hdr->addrs_off && hdr->addrs_off <= size;
+}
+
+int dnsdb_open(dnsdb* db, const char* path){
+
+    struct stat st;
+    const dnsdb_header* hdr;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+	perror("Error opening results database");
+	return DNSDB_FAILURE;
+    }
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(dnsdb_header)){
+	fprintf(stderr, "%s: not a results database\n", path);
+	close(fd);
+	return DNSDB_FAILURE;
+    }
+
+    db->size = st.st_size;
+    db->map = mmap(NULL, db->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(db->map == MAP_FAILED){
+	perror("Error mapping results database");
+	return DNSDB_FAILURE;
+    }
+
+    hdr = (const dnsdb_header*)db->map;
+    if(memcmp(hdr->magic, DNSDB_MAGIC, sizeof(hdr->magic)) ||
+       hdr->version != DNSDB_VERSION || hdr->size != db->size ||
+       !dnsdb_check(hdr, db->size)){
+	fprintf(stderr, "%s: not a results database\n", path);
+	munmap((void*)db->map, db->size);
+	return DNSDB_FAILURE;
+    }
+    db->hdr = hdr;
+
+    return DNSDB_SUCCESS;
+}
+
+int dnsdb_get(const dnsdb* db, uint64_t i, dnsdb_result* res){
+
+    const dnsdb_rec* rec;
+    const unsigned char* addrs;
+    uint64_t names_size = db->hdr->addrs_off - db->hdr->names_off;
+    uint64_t addrs_size = db->size - db->hdr->addrs_off;
+
+    if(i >= db->hdr->nrecords){
+	return DNSDB_NOTFOUND;
+    }
+
+    rec = (const dnsdb_rec*)(db->map + db->hdr->records_off) + i;
+    /* the name must end inside the names, the addresses inside the addrs */
+    if(rec->name >= names_size ||
+       !memchr(db->map + db->hdr->names_off + rec->name, '\0', names_size - rec->name) ||
+       rec->addrs >= addrs_size ||
+       !dnsdb_fits(rec->addrs + 1, db->map[db->hdr->addrs_off + rec->addrs],
+		   DNSDB_ADDR_SIZE, addrs_size)){
+	return DNSDB_FAILURE;
+    }
+    addrs = db->map + db->hdr->addrs_off + rec->addrs;
+
+    res->hostname = (const char*)(db->map + db->hdr->names_off + rec->name);
+    res->naddrs = addrs[0];
+    res->addrs = addrs + 1;
+
+    return DNSDB_SUCCESS;
+}
+
+int dnsdb_lookup(const dnsdb* db, const char* hostname, dnsdb_result* res){
+
+    const dnsdb_slot* index = (const dnsdb_slot*)(db->map + db->hdr->index_off);
+    uint64_t mask = db->hdr->nbuckets - 1;
+    uint64_t h = dnsdb_hash(hostname);
+    uint64_t i, n;
+
+    /* linear probe until an empty slot, or every slot for a corrupt index */
+    for(i = h & mask, n = 0; index[i].hash && n < db->hdr->nbuckets;
+	i = (i + 1) & mask, n++){
+	if(index[i].hash == h &&
+	   dnsdb_get(db, index[i].record, res) == DNSDB_SUCCESS &&
+	   !strcmp(res->hostname, hostname)){
+	    return DNSDB_SUCCESS;
+	}
+    }
+
+    return DNSDB_NOTFOUND;
+}
+
+char* dnsdb_addr_str(const dnsdb_result* res, int i, char* str){
+
+    const unsigned char* a = res->addrs + i * DNSDB_ADDR_SIZE;
+
+    switch(a[0]){
+    case DNSDB_ADDR_IPV4:
+	inet_ntop(AF_INET, a + 1, str, DNSDB_ADDRSTRLEN);
+	break;
+    case DNSDB_ADDR_IPV6:
+	strcpy(str, "IPv6-UNHANDLED");
+	break;
+    case DNSDB_ADDR_UNKNOWN:
+	strcpy(str, "Unknown-UNHANDLED");
+	break;
+    default:
+	strcpy(str, "none");
+	break;
+    }
+
+    return str;
+}
+
+void dnsdb_print(const dnsdb_result* res, FILE* out){
+
+    char str[DNSDB_ADDRSTRLEN];
+    int i;
+
+    fprintf(out, "%s", res->hostname);
+    for(i = 0; i < res->naddrs; i++){
+	fprintf(out, ",%s", dnsdb_addr_str(res, i, str));
+    }
+    fprintf(out, "\n");
+}
+
+void dnsdb_close(dnsdb* db){
+    munmap((void*)db->map, db->size);
+    db->map = NULL;
+    db->hdr = NULL;
+}
+
+void dnsdb_writer_init(dnsdb_writer* w){
+    memset(w, 0, sizeof(*w));
+}
+
+/* grow *buf so it can hold need bytes */
+static int dnsdb_reserve(void** buf, uint64_t* cap, uint64_t need){
+
+    uint64_t ncap = *cap ? *cap : 4096;
+    void* nbuf;
+
+    if(need <= *cap){
+	return DNSDB_SUCCESS;
+    }
+    while(ncap < need){
+	ncap *= 2;
+    }
+    nbuf = realloc(*buf, ncap);
+    if(!nbuf){
+	perror("Error on results database Malloc");
+	return DNSDB_FAILURE;
+    }
+    *buf = nbuf;
+    *cap = ncap;
+
+    return DNSDB_SUCCESS;
+}
+
+/* parse one address from the text output format */
+static int dnsdb_parse_addr(const char* str, unsigned char* a){
+
+    memset(a, 0, DNSDB_ADDR_SIZE);
+
+    if(inet_pton(AF_INET, str, a + 1) == 1){
+	a[0] = DNSDB_ADDR_IPV4;
+    }
+    else if(!strcmp(str, "IPv6-UNHANDLED")){
+	a[0] = DNSDB_ADDR_IPV6;
+    }
+    else if(!strcmp(str, "Unknown-UNHANDLED")){
+	a[0] = DNSDB_ADDR_UNKNOWN;
+    }
+    else if(!strcmp(str, "none")){
+	a[0] = DNSDB_ADDR_NONE;
+    }
+    else{
+	return DNSDB_FAILURE;
+    }
+
+    return DNSDB_SUCCESS;
+}
+
+int dnsdb_writer_add(dnsdb_writer* w, const char* hostname,
+		     char** addrs, int naddrs){
+
+    uint64_t len = strlen(hostname) + 1;
+    uint64_t asize;
+    unsigned char* a;
+    int i;
+
+    if(naddrs > DNSDB_MAX_ADDRS){
+	naddrs = DNSDB_MAX_ADDRS;
+    }
+    asize = 1 + (uint64_t)naddrs * DNSDB_ADDR_SIZE;
+    if(dnsdb_reserve((void**)&w->records, &w->rcap,
+		     (w->nrecords + 1) * sizeof(dnsdb_rec)) ||
+       dnsdb_reserve((void**)&w->names, &w->ncap, w->nsize + len) ||
+       dnsdb_reserve((void**)&w->addrs, &w->acap, w->asize + asize)){
+	return DNSDB_FAILURE;
+    }
+
+    a = w->addrs + w->asize;
+    a[0] = naddrs;
+    for(i = 0; i < naddrs; i++){
+	if(dnsdb_parse_addr(addrs[i], a + 1 + i * DNSDB_ADDR_SIZE)){
+	    fprintf(stderr, "Unknown address for %s: %s\n", hostname, addrs[i]);
+	    return DNSDB_FAILURE;
+	}
+    }
+
+    memcpy(w->names + w->nsize, hostname, len);
+    w->records[w->nrecords].name = w->nsize;
+    w->records[w->nrecords].addrs = w->asize;
+
+    w->nrecords++;
+    w->nsize += len;
+    w->asize += asize;
+    w->naddrs += naddrs;
+
+    return DNSDB_SUCCESS;
+}
+
+int dnsdb_writer_add_line(dnsdb_writer* w, char* line){
+
+    char* fields[DNSDB_MAX_ADDRS + 1];
+    char* save = NULL;
+    char* tok;
+    int n = 0;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    for(tok = strtok_r(line, ",", &save); tok && n <= DNSDB_MAX_ADDRS;
+	tok = strtok_r(NULL, ",", &save)){
+	fields[n++] = tok;
+    }
+    if(n == 0){
+	return DNSDB_SUCCESS;	/* blank line */
+    }
+
+    return dnsdb_writer_add(w, fields[0], fields + 1, n - 1);
+}
+
+int dnsdb_writer_finish(dnsdb_writer* w, const char* path){
+
+    dnsdb_header hdr;
+    dnsdb_slot* index;
+    char tmp[strlen(path) + 5];
+    uint64_t i, j, mask;
+    FILE* out;
+    int ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DNSDB_MAGIC, sizeof(hdr.magic));
+    hdr.version = DNSDB_VERSION;
+    hdr.nrecords = w->nrecords;
+    hdr.naddrs = w->naddrs;
+
+    /* power of two buckets, at most half full */
+    hdr.nbuckets = 1;
+    while(hdr.nbuckets < 2 * w->nrecords){
+	hdr.nbuckets *= 2;
+    }
+    mask = hdr.nbuckets - 1;
+
+    index = calloc(hdr.nbuckets, sizeof(dnsdb_slot));
+    if(!index){
+	perror("Error on results database Malloc");
+	return DNSDB_FAILURE;
+    }
+    for(i = 0; i < w->nrecords; i++){
+	const char* name = w->names + w->records[i].name;
+	uint64_t h = dnsdb_hash(name);
+	for(j = h & mask; index[j].hash; j = (j + 1) & mask){
+	    /* only the first result for a hostname is indexed */
+	    if(index[j].hash == h &&
+	       !strcmp(w->names + w->records[index[j].record].name, name)){
+		break;
+	    }
+	}
+	if(!index[j].hash){
+	    index[j].hash = h;
+	    index[j].record = i;
+	}
+    }
+
+    hdr.index_off = sizeof(hdr);
+    hdr.records_off = hdr.index_off + hdr.nbuckets * sizeof(dnsdb_slot);
+    hdr.names_off = hdr.records_off + w->nrecords * sizeof(dnsdb_rec);
+    hdr.addrs_off = DNSDB_ALIGN(hdr.names_off + w->nsize);
+    hdr.size = hdr.addrs_off + w->asize;
+
+    sprintf(tmp, "%s.tmp", path);
+    out = fopen(tmp, "w");
+    if(!out){
+	perror("Error opening results database");
+	free(index);
+	return DNSDB_FAILURE;
+    }
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+	fwrite(index, sizeof(dnsdb_slot), hdr.nbuckets, out) == hdr.nbuckets &&
+	fwrite(w->records, sizeof(dnsdb_rec), w->nrecords, out) == w->nrecords &&
+	fwrite(w->names, 1, w->nsize, out) == w->nsize &&
+	fseeko(out, hdr.addrs_off, SEEK_SET) == 0 &&
+	fwrite(w->addrs, 1, w->asize, out) == w->asize;
+    ok = (fclose(out) == 0) && ok;
+    free(index);
+
+    if(!ok || rename(tmp, path)){
+	perror("Error writing results database");
+	unlink(tmp);
+	return DNSDB_FAILURE;
+    }
+
+    return DNSDB_SUCCESS;
+}
+
+void dnsdb_writer_cleanup(dnsdb_writer* w){
+    free(w->records);
+    free(w->names);
+    free(w->addrs);
+    dnsdb_writer_init(w);
+}
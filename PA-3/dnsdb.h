@@ -0,0 +1,152 @@
+/*
+ * File: dnsdb.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/22
+ * Description:
+ * 	Queryable binary results database for multi-threadedDNS.
+ *
+ *      File layout (host byte order):
+ *          dnsdb_header
+ *          index    nbuckets x dnsdb_slot, open addressing on the
+ *                   hostname hash, load factor <= 1/2
+ *          records  nrecords x dnsdb_rec, in output order
+ *          names    NUL terminated hostnames
+ *          addrs    per record: one count byte, then count
+ *                   entries of DNSDB_ADDR_SIZE bytes (type, IPv4)
+ *      A lookup is one hash, usually one slot probe and one record read,
+ *      all straight out of the mmap'd file.
+ *
+ */
+
+#ifndef DNSDB_H
+#define DNSDB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define DNSDB_MAGIC "DNSDB\0\0\0"
+#define DNSDB_VERSION 1
+
+#define DNSDB_FAILURE -1
+#define DNSDB_SUCCESS 0
+#define DNSDB_NOTFOUND 1
+
+/* address entry types; the text form is in brackets */
+#define DNSDB_ADDR_NONE 0	/* failed lookup [none] */
+#define DNSDB_ADDR_IPV4 1	/* [a.b.c.d] */
+#define DNSDB_ADDR_IPV6 2	/* [IPv6-UNHANDLED] */
+#define DNSDB_ADDR_UNKNOWN 3	/* [Unknown-UNHANDLED] */
+
+#define DNSDB_ADDR_SIZE 5
+#define DNSDB_MAX_ADDRS 255
+#define DNSDB_ADDRSTRLEN 32
+
+typedef struct dnsdb_header_s{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t nbuckets;
+    uint64_t nrecords;
+    uint64_t naddrs;
+    uint64_t index_off;
+    uint64_t records_off;
+    uint64_t names_off;
+    uint64_t addrs_off;
+    uint64_t size;
+} dnsdb_header;
+
+typedef struct dnsdb_slot_s{
+    uint64_t hash;	/* 0 marks an empty slot */
+    uint64_t record;
+} dnsdb_slot;
+
+typedef struct dnsdb_rec_s{
+    uint64_t name;	/* offset into names */
+    uint64_t addrs;	/* offset into addrs */
+} dnsdb_rec;
+
+/* Read side: an open, mmap'd database */
+typedef struct dnsdb_s{
+    const unsigned char* map;
+    size_t size;
+    const dnsdb_header* hdr;
+} dnsdb;
+
+/* One result, pointing into the mapping */
+typedef struct dnsdb_result_s{
+    const char* hostname;
+    int naddrs;
+    const unsigned char* addrs;
+} dnsdb_result;
+
+/* Write side: results collected in memory until dnsdb_writer_finish */
+typedef struct dnsdb_writer_s{
+    dnsdb_rec* records;
+    uint64_t nrecords;
+    uint64_t rcap;
+    char* names;
+    uint64_t nsize;
+    uint64_t ncap;
+    unsigned char* addrs;
+    uint64_t asize;
+    uint64_t acap;
+    uint64_t naddrs;
+} dnsdb_writer;
+
+/* Function to hash a hostname for the index */
+uint64_t dnsdb_hash(const char* hostname);
+
+/* Function to map the database at path, checking its sections lie
+ * within the file
+ * Returns DNSDB_SUCCESS or DNSDB_FAILURE
+ */
+int dnsdb_open(dnsdb* db, const char* path);
+
+/* Function to find the first result for hostname
+ * Returns DNSDB_SUCCESS, or DNSDB_NOTFOUND
+ */
+int dnsdb_lookup(const dnsdb* db, const char* hostname, dnsdb_result* res);
+
+/* Function to fetch result i in output order
+ * Returns DNSDB_SUCCESS, DNSDB_NOTFOUND past the end, or DNSDB_FAILURE
+ * if the record points outside the database
+ */
+int dnsdb_get(const dnsdb* db, uint64_t i, dnsdb_result* res);
+
+/* Function to render address i of res in the text output format
+ * str must hold DNSDB_ADDRSTRLEN bytes; returns str
+ */
+char* dnsdb_addr_str(const dnsdb_result* res, int i, char* str);
+
+/* Function to write res as one line of the text output format */
+void dnsdb_print(const dnsdb_result* res, FILE* out);
+
+/* Function to unmap the database */
+void dnsdb_close(dnsdb* db);
+
+/* Function to initialize an empty writer */
+void dnsdb_writer_init(dnsdb_writer* w);
+
+/* Function to add one result, addresses given in text form
+ * Returns DNSDB_SUCCESS, or DNSDB_FAILURE on an unparsable address
+ */
+int dnsdb_writer_add(dnsdb_writer* w, const char* hostname,
+		     char** addrs, int naddrs);
+
+/* Function to add one line of the text output format
+ * Returns DNSDB_SUCCESS or DNSDB_FAILURE
+ */
+int dnsdb_writer_add_line(dnsdb_writer* w, char* line);
+
+/* Function to build the index and write the database to path
+ * Writes to a temporary file and renames it into place
+ * Returns DNSDB_SUCCESS or DNSDB_FAILURE
+ */
+int dnsdb_writer_finish(dnsdb_writer* w, const char* path);
+
+/* Function to free writer memory */
+void dnsdb_writer_cleanup(dnsdb_writer* w);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * File: gzout.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/24
+ * Description:
+ * 	Compressed streaming output for multi-threadedDNS.
+ *
+ */
+
+#include <string.h>
+
+#include "gzout.h"
+
+/* windowBits + 16 asks zlib for a gzip wrapper */
+#define GZOUT_WINDOW (15 + 16)
+
+static double gzout_elapsed(const struct timespec* since){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* run the buffered text through deflate and write what comes out */
+static int gzout_deflate(gzout* g, int flush){
+
+    struct timespec start;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    g->zs.next_in = g->in;
+    g->zs.avail_in = g->pending;
+    do{
+	g->zs.next_out = g->out;
+	g->zs.avail_out = sizeof(g->out);
+	ret = deflate(&g->zs, flush);
+	if(ret == Z_STREAM_ERROR){
+	    fprintf(stderr, "Error compressing output\n");
+	    return GZOUT_FAILURE;
+	}
+	size_t have = sizeof(g->out) - g->zs.avail_out;
+	if(fwrite(g->out, 1, have, g->fp) != have){
+	    perror("Error writing compressed output");
+	    return GZOUT_FAILURE;
+	}
+	g->bytes_out += have;
+    } while(g->zs.avail_out == 0);
+
+    g->bytes_in += g->pending;
+    g->pending = 0;
+    g->seconds += gzout_elapsed(&start);
+
+    return GZOUT_SUCCESS;
+}
+
+/* close the current frame; called with g->lock held */
+static int gzout_flush_locked(gzout* g){
+
+    if(!g->in_frame){
+	return GZOUT_SUCCESS;
+    }
+    if(gzout_deflate(g, Z_FINISH)){
+	return GZOUT_FAILURE;
+    }
+    /* the next frame gets a fresh gzip header */
+    deflateReset(&g->zs);
+    g->in_frame = 0;
+    g->frames++;
+
+    return fflush(g->fp) ? GZOUT_FAILURE : GZOUT_SUCCESS;
+}
+
+/* append text; called with g->lock held */
+static int gzout_write_locked(gzout* g, const void* data, size_t len){
+
+    const unsigned char* p = data;
+
+    if(!g->in_frame){
+	g->in_frame = 1;
+	g->frame_bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &g->frame_start);
+	pthread_cond_signal(&g->wake);
+    }
+
+    while(len > 0){
+	size_t n = sizeof(g->in) - g->pending;
+	if(n > len){
+	    n = len;
+	}
+	memcpy(g->in + g->pending, p, n);
+	g->pending += n;
+	g->frame_bytes += n;
+	p += n;
+	len -= n;
+	if(g->pending == sizeof(g->in) && gzout_deflate(g, Z_NO_FLUSH)){
+	    return GZOUT_FAILURE;
+	}
+    }
+
+    if(g->frame_bytes >= GZOUT_FRAMESIZE ||
+       gzout_elapsed(&g->frame_start) * 1000 >= g->flush_ms){
+	return gzout_flush_locked(g);
+    }
+
+    return GZOUT_SUCCESS;
+}
+
+/* close a frame once it is flush_ms old, even if no more text comes */
+static void* gzout_timer(void* arg){
+
+    gzout* g = arg;
+
+    pthread_mutex_lock(&g->lock);
+    while(!g->stop){
+	struct timespec deadline;
+
+	if(!g->in_frame){
+	    pthread_cond_wait(&g->wake, &g->lock);
+	    continue;
+	}
+	deadline = g->frame_start;
+	deadline.tv_sec += g->flush_ms / 1000;
+	deadline.tv_nsec += g->flush_ms % 1000 * 1000000;
+	if(deadline.tv_nsec >= 1000000000){
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&g->wake, &g->lock, &deadline);
+	if(!g->stop && g->in_frame &&
+	   gzout_elapsed(&g->frame_start) * 1000 >= g->flush_ms &&
+	   gzout_flush_locked(g)){
+	    g->failed = 1;
+	}
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    return NULL;
+}
+
+int gzout_open(gzout* g, FILE* fp, int level, long flush_ms){
+
+    pthread_condattr_t attr;
+
+    memset(g, 0, sizeof(*g));
+    g->fp = fp;
+    g->flush_ms = flush_ms > 0 ? flush_ms : GZOUT_FLUSH_MS;
+
+    if(deflateInit2(&g->zs, level, Z_DEFLATED, GZOUT_WINDOW, 8,
+		    Z_DEFAULT_STRATEGY) != Z_OK){
+	fprintf(stderr, "Error initializing compressor\n");
+	return GZOUT_FAILURE;
+    }
+
+    /* frame_start is CLOCK_MONOTONIC, so the timer waits on it too */
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return GZOUT_SUCCESS;
+}
+
+int gzout_start(gzout* g){
+
+    if(pthread_create(&g->timer, NULL, gzout_timer, g)){
+	fprintf(stderr, "Error starting the output flush timer\n");
+	return GZOUT_FAILURE;
+    }
+    g->started = 1;
+
+    return GZOUT_SUCCESS;
+}
+
+int gzout_flush(gzout* g){
+
+    int ret;
+
+    pthread_mutex_lock(&g->lock);
+    ret = gzout_flush_locked(g);
+    pthread_mutex_unlock(&g->lock);
+
+    return ret;
+}
+
+int gzout_write(gzout* g, const void* data, size_t len){
+
+    int ret;
+
+    pthread_mutex_lock(&g->lock);
+    ret = gzout_write_locked(g, data, len);
+    if(g->failed){
+	ret = GZOUT_FAILURE;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    return ret;
+}
+
+int gzout_close(gzout* g){
+
+    int ret;
+
+    pthread_mutex_lock(&g->lock);
+    g->stop = 1;
+    pthread_cond_signal(&g->wake);
+    pthread_mutex_unlock(&g->lock);
+    if(g->started){
+	pthread_join(g->timer, NULL);
+    }
+
+    ret = gzout_flush_locked(g);
+    if(g->failed){
+	ret = GZOUT_FAILURE;
+    }
+    deflateEnd(&g->zs);
+    pthread_cond_destroy(&g->wake);
+    pthread_mutex_destroy(&g->lock);
+    return ret;
+}
+
+void gzout_stats(gzout* g, FILE* out){
+    fprintf(out, "compressed output: %llu bytes in, %llu bytes written in %llu frames"
+	    " (%.1f%%), %.1f MB/s compression throughput\n",
+	    (unsigned long long)g->bytes_in, (unsigned long long)g->bytes_out,
+	    (unsigned long long)g->frames,
+	    g->bytes_in ? 100.0 * g->bytes_out / g->bytes_in : 0.0,
+	    g->seconds > 0 ? g->bytes_in / g->seconds / 1e6 : 0.0);
+}
@@ -0,0 +1,89 @@
+/*
+ * File: gzout.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/24
+ * Description:
+ * 	Compressed streaming output for multi-threadedDNS.
+ *      Output is written as a series of complete gzip members (frames).
+ *      A frame is closed every flush interval or GZOUT_FRAMESIZE bytes of
+ *      text, so a partial file decompresses up to its last whole frame
+ *      with plain gzip/zcat, and a whole file is an ordinary .gz.
+ *      A timer thread, started by gzout_start, closes a frame that
+ *      reaches the flush interval without another write, so results
+ *      written just before output stalls are readable too; the functions
+ *      below may be called from any thread.
+ *
+ */
+
+#ifndef GZOUT_H
+#define GZOUT_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+
+#define GZOUT_FAILURE -1
+#define GZOUT_SUCCESS 0
+
+#define GZOUT_BUFSIZE (64 * 1024)
+#define GZOUT_FRAMESIZE (4 * 1024 * 1024)
+#define GZOUT_FLUSH_MS 1000
+
+typedef struct gzout_s{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;	/* a frame started, or closing */
+    pthread_t timer;
+    int started;	/* the timer is running */
+    int stop;
+    int failed;		/* the timer failed to flush */
+    FILE* fp;
+    z_stream zs;
+    long flush_ms;
+    int in_frame;
+    struct timespec frame_start;
+    size_t frame_bytes;
+    size_t pending;
+    unsigned char in[GZOUT_BUFSIZE];
+    unsigned char out[GZOUT_BUFSIZE];
+    /* run stats */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t frames;
+    double seconds;	/* time spent compressing */
+} gzout;
+
+/* Function to start compressing into fp at level (1-9)
+ * A new frame is started at least every flush_ms milliseconds
+ * Returns GZOUT_SUCCESS or GZOUT_FAILURE
+ */
+int gzout_open(gzout* g, FILE* fp, int level, long flush_ms);
+
+/* Function to start the timer thread that closes idle frames
+ * Until then frames are only closed by writes; call it after any fork(),
+ * so a child does not inherit fp or the lock held by the timer
+ * Returns GZOUT_SUCCESS or GZOUT_FAILURE
+ */
+int gzout_start(gzout* g);
+
+/* Function to append len bytes of text
+ * Returns GZOUT_SUCCESS or GZOUT_FAILURE
+ */
+int gzout_write(gzout* g, const void* data, size_t len);
+
+/* Function to close the current frame and flush it to fp
+ * Returns GZOUT_SUCCESS or GZOUT_FAILURE
+ */
+int gzout_flush(gzout* g);
+
+/* Function to flush and free the compressor; fp is left open
+ * Returns GZOUT_SUCCESS or GZOUT_FAILURE
+ */
+int gzout_close(gzout* g);
+
+/* Function to print bytes written and compression throughput */
+void gzout_stats(gzout* g, FILE* out);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * File: hostmap-tool.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/05
+ * Description:
+ * 	Command line front end for multi-threadedDNS hosts overlays:
+ *      compiling a hosts-style list and looking names up in the result.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hostmap.h"
+
+#define USAGE "Usage: %s build <hostsFilePath> <overlay>\n" \
+              "       %s lookup <overlay> <hostname>...\n"
+
+static int build(const char* inPath, const char* path){
+    FILE* in = strcmp(inPath, "-") ? fopen(inPath, "r") : stdin;
+    int ret;
+
+    if(!in){
+        perror("Error opening hosts file");
+        return EXIT_FAILURE;
+    }
+    ret = hostmap_build(in, path) ? EXIT_FAILURE : EXIT_SUCCESS;
+    if(in != stdin){
+        fclose(in);
+    }
+    return ret;
+}
+
+static int lookup(const char* path, char** hosts, int nhosts){
+    hostmap m;
+    hostmap_result res;
+    int ret = EXIT_SUCCESS;
+
+    if(hostmap_open(&m, path)){
+        return EXIT_FAILURE;
+    }
+    for(int i = 0; i < nhosts; i++){
+        if(hostmap_lookup(&m, hosts[i], &res) == HOSTMAP_SUCCESS){
+            hostmap_print(&res, stdout);
+        }
+        else{
+            fprintf(stderr, "%s: not found\n", hosts[i]);
+            ret = EXIT_FAILURE;
+        }
+    }
+    hostmap_close(&m);
+    return ret;
+}
+
+int main(int argc, char* argv[]){
+    if(argc == 4 && !strcmp(argv[1], "build")){
+        return build(argv[2], argv[3]);
+    }
+    if(argc >= 4 && !strcmp(argv[1], "lookup")){
+        return lookup(argv[2], argv + 3, argc - 3);
+    }
+    fprintf(stderr, USAGE, argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,545 @@
+/*
+ * File: hostmap.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/05
+ * Description:
+ * 	Static hosts overlay for multi-threadedDNS.
+ *      See hostmap.h for the file layout. The table is built with
+ *      hash-and-displace: keys are hashed into buckets, buckets are
+ *      placed largest first by searching for a displacement that sends
+ *      all their keys to free slots, and single-key buckets take the
+ *      slots left over directly.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hostmap.h"
+
+#define HOSTMAP_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+#define HOSTMAP_ADDRSTRLEN 16
+#define HOSTMAP_MAX_DISP (1 << 24)	/* give up on a seed after this many tries */
+#define HOSTMAP_MAX_SEEDS 64
+#define HOSTMAP_MAX_BUCKET 32		/* keys in one bucket before a seed is rejected */
+#define HOSTMAP_GOLDEN 0x9E3779B97F4A7C15ULL
+
+/* one "<address> <name>" pair from the hosts file */
+typedef struct hostmap_pair_s{
+    uint64_t name;	/* offset into the name buffer */
+    uint64_t order;	/* position in the file */
+    char addr[HOSTMAP_ADDRSTRLEN];
+} hostmap_pair;
+
+/* one distinct name while building */
+typedef struct hostmap_key_s{
+    uint64_t entry;
+    uint32_t naddrs;
+    uint64_t h1;
+    uint64_t h2;
+} hostmap_key;
+
+/* murmur3 finalizer */
+static uint64_t hostmap_mix(uint64_t h){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* FNV-1a over the lower cased name, split into the bucket and slot hashes */
+static void hostmap_hash(const char* name, uint64_t seed, uint64_t* h1, uint64_t* h2){
+    uint64_t h = 14695981039346656037ULL;
+    while(*name){
+	h ^= (unsigned char)tolower((unsigned char)*name++);
+	h *= 1099511628211ULL;
+    }
+    *h1 = hostmap_mix(h ^ seed);
+    *h2 = hostmap_mix(*h1 ^ HOSTMAP_GOLDEN);
+}
+
+static uint64_t hostmap_slot_of(uint64_t h2, uint64_t d, uint64_t nkeys){
+    return hostmap_mix(h2 + d * HOSTMAP_GOLDEN) % nkeys;
+}
+
+/* whether count entries of elsize bytes at off lie within size bytes */
+static int hostmap_fits(uint64_t off, uint64_t count, uint64_t elsize, uint64_t size){
+    return off <= size && count <= (size - off) / elsize;
+}
+
+/* check every section of the header lies within the mapping, so lookups
+ * never read outside it */
+static int hostmap_check(const hostmap_header* hdr, uint64_t size){
+    return (hdr->nkeys == 0 || hdr->nbuckets > 0) &&
+	hdr->disp_off % sizeof(int32_t) == 0 && hdr->slots_off % 8 == 0 &&
+	hdr->disp_off >= sizeof(hostmap_header) &&
+	hostmap_fits(hdr->disp_off, hdr->nbuckets, sizeof(int32_t), size) &&
+	hostmap_fits(hdr->slots_off, hdr->nkeys, sizeof(hostmap_slot), size) &&
+	hdr->entries_off <= size;
+}
+
+int hostmap_open(hostmap* m, const char* path){
+
+    struct stat st;
+    const hostmap_header* hdr;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+	perror("Error opening hosts overlay");
+	return HOSTMAP_FAILURE;
+    }
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(hostmap_header)){
+	fprintf(stderr, "%s: not a hosts overlay\n", path);
+	close(fd);
+	return HOSTMAP_FAILURE;
+    }
+
+    /* nothing is read up front; pages come in as lookups touch them */
+    m->size = st.st_size;
+    m->map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m->map == MAP_FAILED){
+	perror("Error mapping hosts overlay");
+	return HOSTMAP_FAILURE;
+    }
+    madvise((void*)m->map, m->size, MADV_RANDOM);
+
+    hdr = (const hostmap_header*)m->map;
+    if(memcmp(hdr->magic, HOSTMAP_MAGIC, sizeof(hdr->magic)) ||
+       hdr->version != HOSTMAP_VERSION || hdr->size != m->size ||
+       !hostmap_check(hdr, m->size)){
+	fprintf(stderr, "%s: not a hosts overlay\n", path);
+	munmap((void*)m->map, m->size);
+	return HOSTMAP_FAILURE;
+    }
+    m->hdr = hdr;
+
+    return HOSTMAP_SUCCESS;
+}
+
+int hostmap_lookup(const hostmap* m, const char* hostname, hostmap_result* res){
+
+    const hostmap_header* hdr = m->hdr;
+    const int32_t* disp = (const int32_t*)(m->map + hdr->disp_off);
+    const hostmap_slot* s;
+    const char* end = (const char*)m->map + m->size;
+    const char* a;
+    uint64_t h1, h2, slot;
+    int32_t d;
+    uint32_t i;
+
+    if(hdr->nkeys == 0){
+	return HOSTMAP_NOTFOUND;
+    }
+
+    hostmap_hash(hostname, hdr->seed, &h1, &h2);
+    d = disp[h1 % hdr->nbuckets];
+    slot = d < 0 ? (uint64_t)(-1 - (int64_t)d) : hostmap_slot_of(h2, d, hdr->nkeys);
+    if(slot >= hdr->nkeys){
+	return HOSTMAP_FAILURE;
+    }
+    s = (const hostmap_slot*)(m->map + hdr->slots_off) + slot;
+
+    /* the fingerprint rejects most absent names without touching entries */
+    if(s->fp != (uint32_t)(h2 >> 32)){
+	return HOSTMAP_NOTFOUND;
+    }
+    /* the name and each address must end inside the file */
+    if(s->naddrs > HOSTMAP_MAX_ADDRS || s->entry >= m->size - hdr->entries_off){
+	return HOSTMAP_FAILURE;
+    }
+    a = (const char*)(m->map + hdr->entries_off + s->entry);
+    for(i = 0; i <= s->naddrs; i++){
+	if(a >= end || !(a = memchr(a, '\0', end - a))){
+	    return HOSTMAP_FAILURE;
+	}
+	a++;
+    }
+    res->hostname = (const char*)(m->map + hdr->entries_off + s->entry);
+    if(strcasecmp(res->hostname, hostname)){
+	return HOSTMAP_NOTFOUND;
+    }
+    res->naddrs = s->naddrs;
+    res->addrs = hostmap_next_addr(res->hostname);
+
+    return HOSTMAP_SUCCESS;
+}
+
+const char* hostmap_next_addr(const char* addr){
+    return addr + strlen(addr) + 1;
+}
+
+void hostmap_print(const hostmap_result* res, FILE* out){
+
+    const char* a = res->addrs;
+    int i;
+
+    fprintf(out, "%s", res->hostname);
+    for(i = 0; i < res->naddrs; i++, a = hostmap_next_addr(a)){
+	fprintf(out, ",%s", a);
+    }
+    fprintf(out, "\n");
+}
+
+void hostmap_close(hostmap* m){
+    munmap((void*)m->map, m->size);
+    m->map = NULL;
+    m->hdr = NULL;
+}
+
+/* grow *buf so it can hold need bytes */
+static int hostmap_reserve(void** buf, uint64_t* cap, uint64_t need){
+
+    uint64_t ncap = *cap ? *cap : 4096;
+    void* nbuf;
+
+    if(need <= *cap){
+	return HOSTMAP_SUCCESS;
+    }
+    while(ncap < need){
+	ncap *= 2;
+    }
+    nbuf = realloc(*buf, ncap);
+    if(!nbuf){
+	perror("Error on hosts overlay Malloc");
+	return HOSTMAP_FAILURE;
+    }
+    *buf = nbuf;
+    *cap = ncap;
+
+    return HOSTMAP_SUCCESS;
+}
+
+/* name buffer for the pair comparator */
+static const char* hostmap_sort_names;
+
+static int hostmap_pair_cmp(const void* a, const void* b){
+    const hostmap_pair* pa = a;
+    const hostmap_pair* pb = b;
+    int c = strcmp(hostmap_sort_names + pa->name, hostmap_sort_names + pb->name);
+    if(c){
+	return c;
+    }
+    return pa->order < pb->order ? -1 : pa->order > pb->order;
+}
+
+/* parse the hosts file into pairs with lower cased names */
+static int hostmap_parse(FILE* hosts, hostmap_pair** pairs, uint64_t* npairs,
+			 char** names, uint64_t* nsize){
+
+    uint64_t pcap = 0, ncap = 0;
+    char* line = NULL;
+    size_t len = 0;
+    long lineno = 0;
+    int ret = HOSTMAP_SUCCESS;
+
+    while(getline(&line, &len, hosts) > 0){
+	char addr[HOSTMAP_ADDRSTRLEN];
+	unsigned char bin[sizeof(struct in6_addr)];
+	char* save = NULL;
+	char* tok;
+
+	lineno++;
+	line[strcspn(line, "#")] = '\0';
+	tok = strtok_r(line, " \t\r\n", &save);
+	if(!tok){
+	    continue;	/* blank or comment */
+	}
+
+	/* addresses are stored as the resolver would print them */
+	if(inet_pton(AF_INET, tok, bin) == 1){
+	    inet_ntop(AF_INET, bin, addr, sizeof(addr));
+	}
+	else if(inet_pton(AF_INET6, tok, bin) == 1){
+	    strcpy(addr, "IPv6-UNHANDLED");
+	}
+	else{
+	    fprintf(stderr, "line %ld: bad address %s\n", lineno, tok);
+	    ret = HOSTMAP_FAILURE;
+	    break;
+	}
+
+	while((tok = strtok_r(NULL, " \t\r\n", &save))){
+	    uint64_t nlen = strlen(tok) + 1;
+	    hostmap_pair* p;
+
+	    if(hostmap_reserve((void**)pairs, &pcap, (*npairs + 1) * sizeof(hostmap_pair)) ||
+	       hostmap_reserve((void**)names, &ncap, *nsize + nlen)){
+		ret = HOSTMAP_FAILURE;
+		break;
+	    }
+	    p = &(*pairs)[*npairs];
+	    p->name = *nsize;
+	    p->order = *npairs;
+	    strcpy(p->addr, addr);
+	    for(uint64_t i = 0; i < nlen; i++){
+		(*names)[*nsize + i] = tolower((unsigned char)tok[i]);
+	    }
+	    *nsize += nlen;
+	    (*npairs)++;
+	}
+	if(ret != HOSTMAP_SUCCESS){
+	    break;
+	}
+    }
+
+    free(line);
+    return ret;
+}
+
+/* Function to merge sorted pairs into one entry per name
+ * entries: name NUL, then each distinct address NUL
+ */
+static int hostmap_group(const hostmap_pair* pairs, uint64_t npairs, const char* names,
+			 hostmap_key** keys, uint64_t* nkeys,
+			 char** entries, uint64_t* esize){
+
+    uint64_t kcap = 0, ecap = 0;
+    uint64_t i = 0;
+
+    while(i < npairs){
+	const char* name = names + pairs[i].name;
+	uint64_t nlen = strlen(name) + 1;
+	hostmap_key* k;
+	uint64_t j;
+
+	if(hostmap_reserve((void**)keys, &kcap, (*nkeys + 1) * sizeof(hostmap_key)) ||
+	   hostmap_reserve((void**)entries, &ecap,
+			   *esize + nlen + HOSTMAP_MAX_ADDRS * HOSTMAP_ADDRSTRLEN)){
+	    return HOSTMAP_FAILURE;
+	}
+	k = &(*keys)[(*nkeys)++];
+	k->entry = *esize;
+	k->naddrs = 0;
+	memcpy(*entries + *esize, name, nlen);
+	*esize += nlen;
+
+	for(j = i; j < npairs && !strcmp(names + pairs[j].name, name); j++){
+	    const char* a = *entries + k->entry + nlen;
+	    uint32_t n;
+
+	    for(n = 0; n < k->naddrs && strcmp(a, pairs[j].addr); n++){
+		a = hostmap_next_addr(a);
+	    }
+	    if(n == k->naddrs && k->naddrs < HOSTMAP_MAX_ADDRS){
+		uint64_t alen = strlen(pairs[j].addr) + 1;
+		memcpy(*entries + *esize, pairs[j].addr, alen);
+		*esize += alen;
+		k->naddrs++;
+	    }
+	}
+	i = j;
+    }
+
+    return HOSTMAP_SUCCESS;
+}
+
+/* Function to lay keys out in a minimal perfect hash with this seed
+ * Returns HOSTMAP_SUCCESS, or HOSTMAP_FAILURE when a bucket would not fit
+ */
+static int hostmap_place(hostmap_key* keys, uint64_t nkeys, const char* entries,
+			 uint64_t seed, int32_t* disp, hostmap_slot* slots){
+
+    uint64_t nbuckets = nkeys;
+    uint64_t* start = calloc(nbuckets + 2, sizeof(uint64_t));
+    uint64_t* members = malloc(nkeys * sizeof(uint64_t));
+    uint64_t* order = malloc(nbuckets * sizeof(uint64_t));
+    unsigned char* taken = calloc(nkeys, 1);
+    uint64_t tried[HOSTMAP_MAX_BUCKET];
+    uint64_t maxsize = 0;
+    uint64_t i, b, n, free_slot;
+    int ret = HOSTMAP_FAILURE;
+
+    if(!start || !members || !order || !taken){
+	perror("Error on hosts overlay Malloc");
+	goto out;
+    }
+
+    /* bucket the keys (counting sort) */
+    for(i = 0; i < nkeys; i++){
+	hostmap_hash(entries + keys[i].entry, seed, &keys[i].h1, &keys[i].h2);
+	start[keys[i].h1 % nbuckets + 2]++;
+    }
+    for(b = 0; b < nbuckets; b++){
+	if(start[b + 2] > maxsize){
+	    maxsize = start[b + 2];
+	}
+	start[b + 2] += start[b + 1];
+    }
+    for(i = 0; i < nkeys; i++){
+	members[start[keys[i].h1 % nbuckets + 1]++] = i;
+    }
+    /* start[b]..start[b + 1] are now bucket b's members */
+
+    /* a bucket this crowded means a bad seed */
+    if(maxsize > HOSTMAP_MAX_BUCKET){
+	goto out;
+    }
+
+    /* largest buckets first, while the table is still empty */
+    n = 0;
+    for(uint64_t size = maxsize; size > 1; size--){
+	for(b = 0; b < nbuckets; b++){
+	    if(start[b + 1] - start[b] == size){
+		order[n++] = b;
+	    }
+	}
+    }
+    memset(disp, 0, nbuckets * sizeof(int32_t));
+
+    for(uint64_t o = 0; o < n; o++){
+	uint64_t size;
+	int32_t d;
+
+	b = order[o];
+	size = start[b + 1] - start[b];
+	for(d = 0; d < HOSTMAP_MAX_DISP; d++){
+	    uint64_t k;
+	    for(k = 0; k < size; k++){
+		tried[k] = hostmap_slot_of(keys[members[start[b] + k]].h2, d, nkeys);
+		if(taken[tried[k]]){
+		    break;
+		}
+		taken[tried[k]] = 1;
+	    }
+	    if(k == size){
+		break;
+	    }
+	    while(k--){
+		taken[tried[k]] = 0;
+	    }
+	}
+	if(d == HOSTMAP_MAX_DISP){
+	    goto out;
+	}
+	disp[b] = d;
+	for(uint64_t k = 0; k < size; k++){
+	    hostmap_key* key = &keys[members[start[b] + k]];
+	    slots[tried[k]].fp = key->h2 >> 32;
+	    slots[tried[k]].naddrs = key->naddrs;
+	    slots[tried[k]].entry = key->entry;
+	}
+    }
+
+    /* single key buckets point straight at the slots nobody took */
+    free_slot = 0;
+    for(b = 0; b < nbuckets; b++){
+	hostmap_key* key;
+	if(start[b + 1] - start[b] != 1){
+	    continue;
+	}
+	while(taken[free_slot]){
+	    free_slot++;
+	}
+	taken[free_slot] = 1;
+	key = &keys[members[start[b]]];
+	disp[b] = -1 - (int32_t)free_slot;
+	slots[free_slot].fp = key->h2 >> 32;
+	slots[free_slot].naddrs = key->naddrs;
+	slots[free_slot].entry = key->entry;
+    }
+    ret = HOSTMAP_SUCCESS;
+
+ out:
+    free(start);
+    free(members);
+    free(order);
+    free(taken);
+    return ret;
+}
+
+int hostmap_build(FILE* hosts, const char* path){
+
+    hostmap_header hdr;
+    hostmap_pair* pairs = NULL;
+    hostmap_key* keys = NULL;
+    char* names = NULL;
+    char* entries = NULL;
+    int32_t* disp = NULL;
+    hostmap_slot* slots = NULL;
+    uint64_t npairs = 0, nsize = 0, nkeys = 0, esize = 0;
+    char tmp[strlen(path) + 5];
+    FILE* out;
+    int ok = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HOSTMAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = HOSTMAP_VERSION;
+
+    if(hostmap_parse(hosts, &pairs, &npairs, &names, &nsize)){
+	goto out;
+    }
+    hostmap_sort_names = names;
+    qsort(pairs, npairs, sizeof(hostmap_pair), hostmap_pair_cmp);
+    if(hostmap_group(pairs, npairs, names, &keys, &nkeys, &entries, &esize)){
+	goto out;
+    }
+    if(nkeys > INT32_MAX){
+	fprintf(stderr, "Too many hostnames for a hosts overlay\n");
+	goto out;
+    }
+
+    hdr.nkeys = nkeys;
+    hdr.nbuckets = nkeys;
+    disp = malloc(nkeys * sizeof(int32_t) + 1);
+    slots = calloc(nkeys + 1, sizeof(hostmap_slot));
+    if(!disp || !slots){
+	perror("Error on hosts overlay Malloc");
+	goto out;
+    }
+    if(nkeys){
+	for(hdr.seed = 1; hdr.seed <= HOSTMAP_MAX_SEEDS; hdr.seed++){
+	    if(hostmap_place(keys, nkeys, entries, hdr.seed, disp, slots) == HOSTMAP_SUCCESS){
+		break;
+	    }
+	}
+	if(hdr.seed > HOSTMAP_MAX_SEEDS){
+	    fprintf(stderr, "Could not build a perfect hash for %s\n", path);
+	    goto out;
+	}
+    }
+
+    hdr.disp_off = sizeof(hdr);
+    hdr.slots_off = HOSTMAP_ALIGN(hdr.disp_off + nkeys * sizeof(int32_t));
+    hdr.entries_off = hdr.slots_off + nkeys * sizeof(hostmap_slot);
+    hdr.size = hdr.entries_off + esize;
+
+    sprintf(tmp, "%s.tmp", path);
+    out = fopen(tmp, "w");
+    if(!out){
+	perror("Error opening hosts overlay");
+	goto out;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+	fwrite(disp, sizeof(int32_t), nkeys, out) == nkeys &&
+	fseeko(out, hdr.slots_off, SEEK_SET) == 0 &&
+	fwrite(slots, sizeof(hostmap_slot), nkeys, out) == nkeys &&
+	fwrite(entries, 1, esize, out) == esize;
+    ok = (fclose(out) == 0) && ok;
+
+    if(!ok || rename(tmp, path)){
+	perror("Error writing hosts overlay");
+	unlink(tmp);
+	ok = 0;
+    }
+
+ out:
+    free(pairs);
+    free(names);
+    free(keys);
+    free(entries);
+    free(disp);
+    free(slots);
+    return ok ? HOSTMAP_SUCCESS : HOSTMAP_FAILURE;
+}
@@ -0,0 +1,104 @@
+/*
+ * File: hostmap.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/05
+ * Description:
+ * 	Static hosts overlay for multi-threadedDNS: a hosts-style list
+ *      compiled into a minimal perfect hash table and mmap'd read only.
+ *      Every hostname in the list owns exactly one slot, so a lookup is
+ *      one displacement read, one slot read and, when the slot's
+ *      fingerprint matches, one read of the stored name (to verify the
+ *      key) and its addresses. Names not in the list land on some slot
+ *      and are rejected by the fingerprint or the name compare.
+ *
+ *      File layout (host byte order):
+ *          hostmap_header
+ *          disp     nbuckets x int32: >= 0 is the bucket's displacement,
+ *                   < 0 is -1 - slot for a bucket holding a single name
+ *          slots    nkeys x hostmap_slot
+ *          entries  per name: hostname NUL, then naddrs addresses in the
+ *                   text output format, each NUL terminated
+ *      Hostnames are stored and matched in lower case.
+ *
+ */
+
+#ifndef HOSTMAP_H
+#define HOSTMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define HOSTMAP_MAGIC "HOSTMAP\0"
+#define HOSTMAP_VERSION 1
+
+#define HOSTMAP_FAILURE -1
+#define HOSTMAP_SUCCESS 0
+#define HOSTMAP_NOTFOUND 1
+
+#define HOSTMAP_MAX_ADDRS 30
+
+typedef struct hostmap_header_s{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t seed;
+    uint64_t nkeys;
+    uint64_t nbuckets;
+    uint64_t disp_off;
+    uint64_t slots_off;
+    uint64_t entries_off;
+    uint64_t size;
+} hostmap_header;
+
+typedef struct hostmap_slot_s{
+    uint32_t fp;	/* high half of the second key hash */
+    uint32_t naddrs;
+    uint64_t entry;	/* offset into entries */
+} hostmap_slot;
+
+/* An open, mmap'd overlay */
+typedef struct hostmap_s{
+    const unsigned char* map;
+    size_t size;
+    const hostmap_header* hdr;
+} hostmap;
+
+/* One entry, pointing into the mapping */
+typedef struct hostmap_result_s{
+    const char* hostname;
+    int naddrs;
+    const char* addrs;	/* naddrs NUL terminated strings, back to back */
+} hostmap_result;
+
+/* Function to map the overlay at path, checking that every section
+ * lies within the file
+ * Returns HOSTMAP_SUCCESS or HOSTMAP_FAILURE
+ */
+int hostmap_open(hostmap* m, const char* path);
+
+/* Function to find hostname (any case)
+ * Returns HOSTMAP_SUCCESS, HOSTMAP_NOTFOUND, or HOSTMAP_FAILURE if its slot
+ * points outside the file
+ */
+int hostmap_lookup(const hostmap* m, const char* hostname, hostmap_result* res);
+
+/* Function to step to the address after addr in a result */
+const char* hostmap_next_addr(const char* addr);
+
+/* Function to write res as one line of the text output format */
+void hostmap_print(const hostmap_result* res, FILE* out);
+
+/* Function to unmap the overlay */
+void hostmap_close(hostmap* m);
+
+/* Function to compile a hosts-style file ("<address> <name> [<alias>...]"
+ * lines, # comments) into an overlay at path
+ * A name on several lines gets every address, in file order
+ * Writes to a temporary file and renames it into place
+ * Returns HOSTMAP_SUCCESS or HOSTMAP_FAILURE
+ */
+int hostmap_build(FILE* hosts, const char* path);
+
+#endif
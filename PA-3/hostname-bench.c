@@ -0,0 +1,189 @@
+/*
+ * File: hostname-bench.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/08
+ * Description:
+ * 	Throughput benchmark for hostname.c.
+ *      Normalizes a batch of generated hostnames (mixed case, some with
+ *      trailing dots, some invalid) with each implementation the cpu
+ *      supports, and reports GB/s of names and ns per name. Every
+ *      implementation's names, statuses and hashes are checked against
+ *      the scalar pass.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hostname.h"
+
+#define USAGE "Usage: %s [-i <impl>] [-n <names>] [-r <rounds>] [-l <avg length>]\n"
+
+#define BENCH_BATCH 64		/* names per call, as dns_engine_submit uses */
+
+static const char* bench_impls[] = {"scalar", "sse2", "avx2"};
+#define BENCH_NIMPLS (int)(sizeof(bench_impls) / sizeof(bench_impls[0]))
+
+static uint64_t bench_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Function to write n hostnames of about avg bytes into buf, NUL separated
+ * Returns the bytes used
+ */
+static size_t generate(char* buf, size_t* offs, long n, int avg){
+    static const char alpha[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-";
+    static const char* tlds[] = {"com", "net", "org", "io", "edu"};
+    size_t used = 0;
+
+    for(long i = 0; i < n; i++){
+	int target = avg / 2 + rand() % (avg + 1);
+	char* p = buf + used;
+	int len = 0;
+
+	offs[i] = used;
+	while(len < target){
+	    int label = 1 + rand() % 12;
+	    for(int k = 0; k < label; k++){
+		/* no '-' at label ends */
+		int range = (k == 0 || k == label - 1) ? 62 : 63;
+		p[len++] = alpha[rand() % range];
+	    }
+	    p[len++] = '.';
+	}
+	len += sprintf(p + len, "%s", tlds[rand() % 5]);
+	if(rand() % 10 == 0){
+	    p[len++] = '.';		/* trailing dot */
+	}
+	if(rand() % 50 == 0){
+	    p[rand() % len] = '!';	/* invalid */
+	}
+	p[len++] = '\0';
+	used += len;
+    }
+    return used;
+}
+
+int main(int argc, char* argv[]){
+    const char* impl_name = NULL;
+    long n = 1000000;
+    int rounds = 10;
+    int avg = 24;
+    int opt;
+
+    while((opt = getopt(argc, argv, "i:n:r:l:")) != -1){
+	switch(opt){
+	    case 'i':
+		impl_name = optarg;
+		break;
+	    case 'n':
+		n = atol(optarg);
+		break;
+	    case 'r':
+		rounds = atoi(optarg);
+		break;
+	    case 'l':
+		avg = atoi(optarg);
+		break;
+	    default:
+		fprintf(stderr, USAGE, argv[0]);
+		return EXIT_FAILURE;
+	}
+    }
+    if(n < 1 || rounds < 1 || avg < 4 || avg > 160){
+	fprintf(stderr, USAGE, argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    size_t* offs = malloc(n * sizeof(size_t));
+    /* the last name needs HOSTNAME_PAD bytes after it too */
+    char* pristine = malloc(n * (size_t)(2 * avg + 32) + HOSTNAME_PAD);
+    char* work = malloc(n * (size_t)(2 * avg + 32) + HOSTNAME_PAD);
+    char** names = malloc(n * sizeof(char*));
+    uint64_t* hashes = malloc(n * sizeof(uint64_t));
+    uint64_t* want_hashes = malloc(n * sizeof(uint64_t));
+    int* status = malloc(n * sizeof(int));
+    int* want_status = malloc(n * sizeof(int));
+    if(!offs || !pristine || !work || !names || !hashes || !want_hashes || !status || !want_status){
+	perror("Error on benchmark Malloc");
+	return EXIT_FAILURE;
+    }
+
+    srand(3753);
+    size_t bytes = generate(pristine, offs, n, avg);
+    for(long i = 0; i < n; i++){
+	names[i] = work + offs[i];
+    }
+
+    /* the scalar pass is the reference */
+    memcpy(work, pristine, bytes);
+    hostname_use("scalar");
+    hostname_normalize_batch(names, n, NULL, want_hashes, want_status);
+    char* want_names = malloc(bytes);
+    memcpy(want_names, work, bytes);
+
+    long invalid = 0;
+    for(long i = 0; i < n; i++){
+	invalid += want_status[i] != HOSTNAME_VALID;
+    }
+    printf("%ld names, %.1f MB, %ld invalid, %d rounds, batches of %d\n",
+	   n, bytes / 1e6, invalid, rounds, BENCH_BATCH);
+    printf("%-8s %10s %12s %10s\n", "impl", "GB/s", "ns/name", "check");
+
+    int found = 0;
+    for(int k = 0; k < BENCH_NIMPLS; k++){
+	if(impl_name && strcmp(impl_name, bench_impls[k])){
+	    continue;
+	}
+	found = 1;
+	if(hostname_use(bench_impls[k])){
+	    printf("%-8s %10s\n", bench_impls[k], "unsupported");
+	    continue;
+	}
+
+	uint64_t best = UINT64_MAX;
+	for(int r = 0; r < rounds; r++){
+	    memcpy(work, pristine, bytes);
+	    uint64_t start = bench_now();
+	    for(long i = 0; i < n; i += BENCH_BATCH){
+		int count = n - i < BENCH_BATCH ? n - i : BENCH_BATCH;
+		hostname_normalize_batch(names + i, count, NULL, hashes + i, status + i);
+	    }
+	    uint64_t t = bench_now() - start;
+	    if(t < best){
+		best = t;
+	    }
+	}
+
+	int ok = !memcmp(work, want_names, bytes) &&
+	    !memcmp(hashes, want_hashes, n * sizeof(uint64_t)) &&
+	    !memcmp(status, want_status, n * sizeof(int));
+	printf("%-8s %10.2f %12.2f %10s\n", bench_impls[k],
+	       (double)bytes / best, (double)best / n, ok ? "ok" : "MISMATCH");
+	if(!ok){
+	    found = -1;
+	}
+    }
+    if(!found){
+	fprintf(stderr, "Unknown implementation: %s\n", impl_name);
+	return EXIT_FAILURE;
+    }
+
+    free(offs);
+    free(pristine);
+    free(work);
+    free(want_names);
+    free(names);
+    free(hashes);
+    free(want_hashes);
+    free(status);
+    free(want_status);
+    return found < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+/*
+ * File: hostname.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/08
+ * Description:
+ * 	Hostname validation and normalization. See hostname.h.
+ *
+ *      The vector passes lower case a chunk with one compare-and-or,
+ *      classify every byte with a handful of compares, and keep two
+ *      bitmasks per chunk: bytes that are not allowed and dots. Labels
+ *      are checked afterwards from the dot masks, one step per dot.
+ *      The hash mixes the normalized name 8 bytes at a time (zero
+ *      padded), so each chunk feeds it straight from the vector lanes.
+ *      The last chunk of a name is loaded whole from the caller's
+ *      HOSTNAME_PAD bytes of padding and masked to the name; nothing
+ *      past the name is ever written.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HOSTNAME_X86 1
+#endif
+
+#include "hostname.h"
+
+#define HOSTNAME_K 0x9E3779B97F4A7C15ULL
+
+/* 32 bytes of 0xff then 32 of 0: loading at 32 - n gives a mask of n live bytes */
+static const unsigned char hostname_live[64] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+typedef int (*hostname_fn)(char* name, size_t len, uint64_t* hash);
+
+typedef struct hostname_row_s{
+    const char* name;
+    hostname_fn normalize;
+    int (*usable)(void);
+} hostname_row;
+
+static inline uint64_t hostname_step(uint64_t h, uint64_t w){
+    h = (h ^ w) * HOSTNAME_K;
+    return h ^ (h >> 29);
+}
+
+/* murmur3 finalizer over the length-salted state */
+static inline uint64_t hostname_final(uint64_t h, size_t len){
+    h ^= len;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t hostname_hash(const char* name, size_t len){
+    uint64_t h = 0;
+    for(size_t i = 0; i < len; i += 8){
+	uint64_t w = 0;
+	memcpy(&w, name + i, len - i < 8 ? len - i : 8);
+	h = hostname_step(h, w);
+    }
+    return hostname_final(h, len);
+}
+
+/* the label between the dots (or ends) at last and end */
+static inline int hostname_label_ok(const char* name, long last, long end){
+    long n = end - last - 1;
+    return n >= 1 && n <= HOSTNAME_MAX_LABEL &&
+	name[last + 1] != '-' && name[end - 1] != '-';
+}
+
+/* Function to check every label from per-chunk dot bitmasks */
+static int hostname_labels(const char* name, size_t len, const uint32_t* dots,
+			   size_t chunks, int width){
+    long last = -1;
+
+    for(size_t c = 0; c < chunks; c++){
+	uint32_t m = dots[c];
+	while(m){
+	    long pos = c * width + __builtin_ctz(m);
+	    m &= m - 1;
+	    if(!hostname_label_ok(name, last, pos)){
+		return HOSTNAME_BAD_LABEL;
+	    }
+	    last = pos;
+	}
+    }
+    return hostname_label_ok(name, last, len) ? HOSTNAME_VALID : HOSTNAME_BAD_LABEL;
+}
+
+static int hostname_scalar(char* name, size_t len, uint64_t* hash){
+    uint64_t h = 0, w = 0;
+    long last = -1;
+    int bad_char = 0, bad_label = 0;
+
+    for(size_t i = 0; i < len; i++){
+	unsigned char c = name[i];
+	if(c >= 'A' && c <= 'Z'){
+	    c |= 0x20;
+	    name[i] = c;
+	}
+	if(c == '.'){
+	    bad_label |= !hostname_label_ok(name, last, i);
+	    last = i;
+	}
+	else if(!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_')){
+	    bad_char = 1;
+	}
+	w |= (uint64_t)c << (8 * (i & 7));
+	if((i & 7) == 7){
+	    h = hostname_step(h, w);
+	    w = 0;
+	}
+    }
+    if(len & 7){
+	h = hostname_step(h, w);
+    }
+    bad_label |= !hostname_label_ok(name, last, len);
+
+    *hash = hostname_final(h, len);
+    return bad_char ? HOSTNAME_BAD_CHAR : bad_label ? HOSTNAME_BAD_LABEL : HOSTNAME_VALID;
+}
+
+static int hostname_always(void){
+    return 1;
+}
+
+#ifdef HOSTNAME_X86
+
+__attribute__((target("sse2")))
+static int hostname_sse2(char* name, size_t len, uint64_t* hash){
+    const __m128i A1 = _mm_set1_epi8('A' - 1), Z1 = _mm_set1_epi8('Z' + 1);
+    const __m128i a1 = _mm_set1_epi8('a' - 1), z1 = _mm_set1_epi8('z' + 1);
+    const __m128i d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+    const __m128i hy = _mm_set1_epi8('-'), us = _mm_set1_epi8('_');
+    const __m128i dot = _mm_set1_epi8('.'), x20 = _mm_set1_epi8(0x20);
+    uint32_t dots[HOSTNAME_MAX_LEN / 16 + 1];
+    size_t nwords = (len + 7) / 8;
+    size_t c = 0;
+    uint32_t bad = 0;
+    uint64_t h = 0;
+
+    for(size_t i = 0; i < len; i += 16, c++){
+	size_t left = len - i;
+	const char* p = name + i;
+	char tail[16];
+	uint32_t live = 0xFFFF;
+	__m128i v, up, ok;
+
+	/* the last chunk runs past the terminator into the padding */
+	if(left < 16){
+	    live = (1u << left) - 1;
+	    v = _mm_and_si128(_mm_loadu_si128((const __m128i*)p),
+			      _mm_loadu_si128((const __m128i*)(hostname_live + 32 - left)));
+	}
+	else{
+	    v = _mm_loadu_si128((const __m128i*)p);
+	}
+	up = _mm_and_si128(_mm_cmpgt_epi8(v, A1), _mm_cmpgt_epi8(Z1, v));
+	v = _mm_or_si128(v, _mm_and_si128(up, x20));
+
+	/* bytes >= 0x80 compare as negative and fail every range */
+	ok = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, a1), _mm_cmpgt_epi8(z1, v)),
+			  _mm_and_si128(_mm_cmpgt_epi8(v, d0), _mm_cmpgt_epi8(d9, v)));
+	ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(v, hy), _mm_cmpeq_epi8(v, us)));
+	ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, dot));
+	bad |= ~(uint32_t)_mm_movemask_epi8(ok) & live;
+	dots[c] = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot)) & live;
+
+	/* most names are already lower case; only write chunks that changed */
+	if(_mm_movemask_epi8(up)){
+	    if(left < 16){
+		_mm_storeu_si128((__m128i*)tail, v);
+		memcpy(name + i, tail, left);
+	    }
+	    else{
+		_mm_storeu_si128((__m128i*)(name + i), v);
+	    }
+	}
+
+	h = hostname_step(h, (uint64_t)_mm_cvtsi128_si64(v));
+	if(2 * c + 1 < nwords){
+	    h = hostname_step(h, (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+	}
+    }
+
+    *hash = hostname_final(h, len);
+    return bad ? HOSTNAME_BAD_CHAR : hostname_labels(name, len, dots, c, 16);
+}
+
+__attribute__((target("avx2")))
+static int hostname_avx2(char* name, size_t len, uint64_t* hash){
+    const __m256i A1 = _mm256_set1_epi8('A' - 1), Z1 = _mm256_set1_epi8('Z' + 1);
+    const __m256i a1 = _mm256_set1_epi8('a' - 1), z1 = _mm256_set1_epi8('z' + 1);
+    const __m256i d0 = _mm256_set1_epi8('0' - 1), d9 = _mm256_set1_epi8('9' + 1);
+    const __m256i hy = _mm256_set1_epi8('-'), us = _mm256_set1_epi8('_');
+    const __m256i dot = _mm256_set1_epi8('.'), x20 = _mm256_set1_epi8(0x20);
+    uint32_t dots[HOSTNAME_MAX_LEN / 32 + 1];
+    size_t nwords = (len + 7) / 8;
+    size_t c = 0;
+    uint32_t bad = 0;
+    uint64_t h = 0;
+
+    for(size_t i = 0; i < len; i += 32, c++){
+	size_t left = len - i;
+	const char* p = name + i;
+	char tail[32];
+	uint32_t live = 0xFFFFFFFF;
+	__m256i v, up, ok;
+	__m128i half;
+	uint64_t w[4];
+
+	if(left < 32){
+	    live = (1u << left) - 1;
+	    v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)p),
+				 _mm256_loadu_si256((const __m256i*)(hostname_live + 32 - left)));
+	}
+	else{
+	    v = _mm256_loadu_si256((const __m256i*)p);
+	}
+	up = _mm256_and_si256(_mm256_cmpgt_epi8(v, A1), _mm256_cmpgt_epi8(Z1, v));
+	v = _mm256_or_si256(v, _mm256_and_si256(up, x20));
+
+	ok = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi8(v, a1), _mm256_cmpgt_epi8(z1, v)),
+			     _mm256_and_si256(_mm256_cmpgt_epi8(v, d0), _mm256_cmpgt_epi8(d9, v)));
+	ok = _mm256_or_si256(ok, _mm256_or_si256(_mm256_cmpeq_epi8(v, hy), _mm256_cmpeq_epi8(v, us)));
+	ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, dot));
+	bad |= ~(uint32_t)_mm256_movemask_epi8(ok) & live;
+	dots[c] = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dot)) & live;
+
+	if(_mm256_movemask_epi8(up)){
+	    if(left < 32){
+		_mm256_storeu_si256((__m256i*)tail, v);
+		memcpy(name + i, tail, left);
+	    }
+	    else{
+		_mm256_storeu_si256((__m256i*)(name + i), v);
+	    }
+	}
+
+	half = _mm256_castsi256_si128(v);
+	w[0] = _mm_cvtsi128_si64(half);
+	w[1] = _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+	half = _mm256_extracti128_si256(v, 1);
+	w[2] = _mm_cvtsi128_si64(half);
+	w[3] = _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+	for(size_t k = 0; k < 4 && 4 * c + k < nwords; k++){
+	    h = hostname_step(h, w[k]);
+	}
+    }
+
+    *hash = hostname_final(h, len);
+    return bad ? HOSTNAME_BAD_CHAR : hostname_labels(name, len, dots, c, 32);
+}
+
+static int hostname_has_sse2(void){
+    return __builtin_cpu_supports("sse2");
+}
+
+static int hostname_has_avx2(void){
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/* fastest first */
+static const hostname_row hostname_rows[] = {
+#ifdef HOSTNAME_X86
+    {"avx2", hostname_avx2, hostname_has_avx2},
+    {"sse2", hostname_sse2, hostname_has_sse2},
+#endif
+    {"scalar", hostname_scalar, hostname_always},
+};
+#define HOSTNAME_NROWS (int)(sizeof(hostname_rows) / sizeof(hostname_rows[0]))
+
+static const hostname_row* hostname_current;
+
+static const hostname_row* hostname_pick(void){
+    const hostname_row* row = __atomic_load_n(&hostname_current, __ATOMIC_ACQUIRE);
+    if(!row){
+	for(row = hostname_rows; !row->usable(); row++){
+	}
+	__atomic_store_n(&hostname_current, row, __ATOMIC_RELEASE);
+    }
+    return row;
+}
+
+/* strip trailing dots, but leave names the pass need not look at alone */
+static int hostname_prepare(char* name, size_t* len){
+    size_t n = strlen(name);
+    *len = n;
+    while(n && name[n - 1] == '.'){
+	n--;
+    }
+    if(n == 0){
+	return HOSTNAME_EMPTY;
+    }
+    if(n > HOSTNAME_MAX_LEN){
+	return HOSTNAME_TOO_LONG;
+    }
+    name[n] = '\0';
+    *len = n;
+    return HOSTNAME_VALID;
+}
+
+int hostname_normalize(char* name, size_t* len, uint64_t* hash){
+    int status = hostname_prepare(name, len);
+    *hash = 0;
+    if(status != HOSTNAME_VALID){
+	return status;
+    }
+    return hostname_pick()->normalize(name, *len, hash);
+}
+
+void hostname_normalize_batch(char** names, int n, size_t* lens,
+			      uint64_t* hashes, int* status){
+    hostname_fn normalize = hostname_pick()->normalize;
+
+    for(int i = 0; i < n; i++){
+	size_t len;
+	uint64_t hash = 0;
+	int s = hostname_prepare(names[i], &len);
+	if(s == HOSTNAME_VALID){
+	    s = normalize(names[i], len, &hash);
+	}
+	if(lens){
+	    lens[i] = len;
+	}
+	if(hashes){
+	    hashes[i] = hash;
+	}
+	status[i] = s;
+    }
+}
+
+const char* hostname_strerror(int status){
+    switch(status){
+    case HOSTNAME_VALID:
+	return "valid";
+    case HOSTNAME_EMPTY:
+	return "empty hostname";
+    case HOSTNAME_TOO_LONG:
+	return "hostname too long";
+    case HOSTNAME_BAD_CHAR:
+	return "invalid character";
+    case HOSTNAME_BAD_LABEL:
+	return "invalid label";
+    default:
+	return "unknown status";
+    }
+}
+
+int hostname_use(const char* impl){
+    for(int i = 0; i < HOSTNAME_NROWS; i++){
+	if(!strcmp(hostname_rows[i].name, impl) && hostname_rows[i].usable()){
+	    __atomic_store_n(&hostname_current, &hostname_rows[i], __ATOMIC_RELEASE);
+	    return HOSTNAME_SUCCESS;
+	}
+    }
+    return HOSTNAME_FAILURE;
+}
+
+const char* hostname_impl(void){
+    return hostname_pick()->name;
+}
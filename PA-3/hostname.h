@@ -0,0 +1,70 @@
+/*
+ * File: hostname.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/04/08
+ * Description:
+ * 	Hostname validation and normalization, done before a name is
+ *      queued so malformed names never cost a lookup. One pass over each
+ *      name lower cases it, checks its characters and label lengths and
+ *      computes the hash the result cache and shard routing use.
+ *      Trailing dots are stripped first.
+ *
+ *      The pass runs 32 bytes at a time with AVX2, 16 with SSE2, or a
+ *      byte at a time, picked at the first call from what the cpu
+ *      supports. All three give the same names, statuses and hashes.
+ *      Names are read in whole chunks, so every buffer passed in is
+ *      allocated HOSTNAME_PAD bytes longer than the name.
+ *
+ */
+
+#ifndef HOSTNAME_H
+#define HOSTNAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HOSTNAME_FAILURE -1
+#define HOSTNAME_SUCCESS 0
+
+#define HOSTNAME_MAX_LEN 253	/* without the trailing dot */
+#define HOSTNAME_MAX_LABEL 63
+#define HOSTNAME_PAD 32		/* readable bytes needed after a name's terminator */
+
+/* hostname_normalize statuses */
+#define HOSTNAME_VALID 0
+#define HOSTNAME_EMPTY 1	/* nothing left after stripping dots */
+#define HOSTNAME_TOO_LONG 2	/* over HOSTNAME_MAX_LEN */
+#define HOSTNAME_BAD_CHAR 3	/* not a letter, digit, '-', '_' or '.' */
+#define HOSTNAME_BAD_LABEL 4	/* empty, over HOSTNAME_MAX_LABEL, or a '-' at either end */
+
+/* Function to normalize name in place
+ * name must be followed by HOSTNAME_PAD readable bytes after its NUL: the
+ * vector passes load the last chunk whole and mask it
+ * Sets *len to the normalized length and *hash to its hash
+ * An empty or over-long name is left untouched, with *hash 0
+ * Returns HOSTNAME_VALID or the reason the name is invalid
+ */
+int hostname_normalize(char* name, size_t* len, uint64_t* hash);
+
+/* Function to normalize n names, as hostname_normalize on each
+ * lens and hashes may be NULL
+ */
+void hostname_normalize_batch(char** names, int n, size_t* lens,
+			      uint64_t* hashes, int* status);
+
+/* Function to hash an already normalized name of len bytes */
+uint64_t hostname_hash(const char* name, size_t len);
+
+/* Function to describe a hostname_normalize status */
+const char* hostname_strerror(int status);
+
+/* Function to force an implementation: "avx2", "sse2" or "scalar"
+ * Returns HOSTNAME_FAILURE if it is unknown or the cpu lacks it
+ */
+int hostname_use(const char* impl);
+
+/* Function to name the implementation in use */
+const char* hostname_impl(void);
+
+#endif
@@ -6,208 +6,379 @@
 //  Copyright © 2017 Dylan Schneider. All rights reserved.
 //
 #include "multi-threadedDNS.h"
+#include "affinity.h"
+#include "shard.h"
+#include "trace.h"
 
-int FILES_FINISHED;
-int NUM_INPUT_FILES;
-char* OUT_FILE;
-int THREAD_MAX;
+#define USAGE "Usage: %s [-s <shards>] [-c <cpulist>] [-r <cpulist>] [-R <cpulist>] [-T <threads>] [-Q <slots>] [-C <entries>] [-H <overlay>] [-N] [-O] [-b | -z <level> [-F <ms>]] [-t <trace.json>] <inputFilePath> <inputFilePath> ... <outputFilePath>\n"
 
-queue q;
-pthread_cond_t full;
-pthread_cond_t empty;
+output* OUT;
 
-pthread_mutex_t queue_lock;
-pthread_mutex_t FF_lock;
 pthread_mutex_t out_lock;
 
 
-void* readerPool(char** inFiles){
+void* readerPool(FILE** inFiles, int numFiles, dns_engine* e){
     //create number of reader threads same number as number of input files
-    pthread_t reader_threads[NUM_INPUT_FILES];
-    for (int i=0; i < NUM_INPUT_FILES; i++){
-        pthread_create(&reader_threads[i], NULL, (void*) Read, (void*)inFiles[i]);
+    //reader i submits to the engine's queue i (round robin over NUMA nodes)
+    pthread_t reader_threads[numFiles];
+    reader readers[numFiles];
+    for (int i=0; i < numFiles; i++){
+        readers[i].input = inFiles[i];
+        readers[i].e = e;
+        readers[i].slot = i;
+        pthread_create(&reader_threads[i], NULL, (void*) Read, &readers[i]);
+    }
+    for (int i=0; i < numFiles; i++){
         pthread_join(reader_threads[i], NULL);
     }
     return NULL;
 }
 
-void* Read(char* fileName){
+void* Read(reader* r){
     //read file line by line
-    //put each line (domain) in the queue.
-    FILE* input = fopen(fileName, "r");
-    
-    if(!input){
-        perror("Error opening input file.\n");
-        return NULL;
-    }
-    char domain[DOMAIN_SIZE];
-    while(fscanf(input, INPUTFS, domain) > 0){
-        
-        pthread_mutex_lock(&queue_lock);
-        
-        while(queue_is_full(&q)){
-            pthread_cond_wait(&full, &queue_lock);
+    //hand the domains to the engine READ_BATCH at a time
+    FILE* input = r->input;
+    char domains[READ_BATCH][DOMAIN_SIZE + 1];
+    char* batch[READ_BATCH];
+    long seqs[READ_BATCH];
+    int n = 0;
+
+    trace_thread_name("reader");
+    dns_engine_bind(r->e, r->slot);
+
+    while(1){
+        TRACE_BEGIN(read_start);
+        //shard workers get "<seq> <hostname>" lines from the coordinator
+        seqs[n] = -1;
+        if(OUT->tagged ? fscanf(input, SHARDFS, &seqs[n], domains[n]) != 2
+                       : fscanf(input, INPUTFS, domains[n]) <= 0){
+            break;
         }
-        
-        // Increment counter to count how many hostnames we are pushing to the queue
-        queue_push(&q, strdup(domain));
-        
-        pthread_cond_signal(&empty);
-        pthread_mutex_unlock(&queue_lock);
-    }
-    
-    pthread_mutex_lock(&FF_lock);
-    FILES_FINISHED++;
-    pthread_mutex_unlock(&FF_lock);
-    
+        batch[n] = domains[n];
+        n++;
+        TRACE_END(TRACE_READ, read_start);
+
+        if(n == READ_BATCH){
+            dns_engine_submit(r->e, batch, seqs, n);
+            n = 0;
+        }
+    }
+    dns_engine_submit(r->e, batch, seqs, n);
+
     fclose(input);
     return NULL;
 }
 
+int openOutput(output* out, char* path, int db, int zlevel, long flushMs){
+    memset(out, 0, sizeof(*out));
 
+    //the database is built in memory and written by closeOutput
+    if(db){
+        out->db = malloc(sizeof(dnsdb_writer));
+        dnsdb_writer_init(out->db);
+        return EXIT_SUCCESS;
+    }
 
+    out->fp = fopen(path, "a");
+    if(!out->fp){
+        perror("Error opening output file");
+        return EXIT_FAILURE;
+    }
 
-void* resolverPool(){
-    //create number of resolver threads same number as number of cores on system
-    pthread_t consumer_threads[THREAD_MAX];
-    for (int i=0; i < THREAD_MAX; i++){
-        pthread_create(&consumer_threads[i], NULL, (void*) Resolve, NULL);
-        pthread_join(consumer_threads[i], NULL);
+    //gzip members can be appended to an existing .gz
+    if(zlevel > 0){
+        out->gz = malloc(sizeof(gzout));
+        if(!out->gz || gzout_open(out->gz, out->fp, zlevel, flushMs)){
+            free(out->gz);
+            fclose(out->fp);
+            return EXIT_FAILURE;
+        }
     }
-    return NULL;
+    return EXIT_SUCCESS;
 }
 
-void* Resolve(){
-    //open shared out file
-    FILE* output_file = fopen(OUT_FILE, "a");
-    if(!output_file){
-        perror("Error opening output file");
-        return NULL;
+//start out's background thread, once this process is done forking
+int startOutput(output* out){
+    if(out->gz && gzout_start(out->gz)){
+        return EXIT_FAILURE;
     }
-    //Loops infinitely to support unlimited files
-    //Breaks when files finished is equal to total number of text files
-    while(1){
-        
-        pthread_mutex_lock(&queue_lock);
-
-        // Check if all files done
-        while(queue_is_empty(&q)){
-            //check if we're done
-            pthread_mutex_lock(&FF_lock); //critical section
-            int done = 0;
-            if(FILES_FINISHED == NUM_INPUT_FILES){
-                done = 1;
-            }
-            pthread_mutex_unlock(&FF_lock);
-            if (done){
-                //while loop and function finish here only
-                pthread_mutex_unlock(&queue_lock);
-                fclose(output_file);
-                return NULL;
-            }
-            //if not done, wait until something is enqueued
-            pthread_cond_wait(&empty, &queue_lock); //wait on empty, but release the queue while we wait
+    return EXIT_SUCCESS;
+}
+
+//write one line of the text format (newline included) to out
+void outputLine(output* out, char* line, size_t len){
+    if(out->db){
+        dnsdb_writer_add_line(out->db, line);
+    }
+    else if(out->gz){
+        gzout_write(out->gz, line, len);
+    }
+    else{
+        fwrite(line, 1, len, out->fp);
+    }
+}
+
+int closeOutput(output* out, char* path, int ok){
+    int ret = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if(out->db){
+        if(ok && dnsdb_writer_finish(out->db, path)){
+            ret = EXIT_FAILURE;
         }
-        //queue pop
-        char* single_hostname = (char*) queue_pop(&q);
-        
-        pthread_cond_signal(&full); //after popping, we will never be full
-        
-        pthread_mutex_unlock(&queue_lock);
-        
-        char* IPs[30]; //all IPs of each domain stored here
-        for(int i = 0; i < 30; i++){
-            IPs[i] = NULL;
+        dnsdb_writer_cleanup(out->db);
+        free(out->db);
+        return ret;
+    }
+
+    if(out->gz){
+        if(gzout_close(out->gz)){
+            ret = EXIT_FAILURE;
         }
-        
-        //DNS resolution
-        if(dnslookup(single_hostname, IPs) == UTIL_FAILURE){
-            //on a bogus domain, copy "none" to IP list
-            fprintf(stderr, "dns lookup error hostname: %s\n", single_hostname);
-            for(int i = 0; i < 30; i++){
-                if(IPs[i] == NULL){
-                    char none[4] = "none";
-                    IPs[i] = (char*) malloc(sizeof(none));
-                    strncpy(IPs[i], none, sizeof(none));
-                    break;
-                }
-            }
-        };
-        
-        pthread_mutex_lock(&out_lock); //critical section
-        
-        fprintf(output_file, "%s,", single_hostname); //write the domain name to file
-        for(int i = 0; i < 30; i++){ //write each IP to the same line as hostname
-            if(IPs[i+1] == NULL){
-                fprintf(output_file, "%s\n", IPs[i]);
-                break;
-            }
-            else{
-                fprintf(output_file, "%s,", IPs[i]);
-            }
+        gzout_stats(out->gz, stderr);
+        free(out->gz);
+    }
+    if(fclose(out->fp)){
+        ret = EXIT_FAILURE;
+    }
+    return ret;
+}
+
+//engine completion callback: write one result to the output
+void writeResult(dns_result* res, void* arg){
+    output* out = arg;
+    char line[LINE_SIZE];
+    int len = 0;
+
+    if(res->name_status != HOSTNAME_VALID){
+        fprintf(stderr, "invalid hostname: %s (%s)\n", res->hostname, hostname_strerror(res->name_status));
+    }
+    else if(res->status == UTIL_FAILURE && !res->cached){
+        fprintf(stderr, "dns lookup error hostname: %s\n", res->hostname);
+    }
+
+    //format outside the lock
+    if(!out->db){
+        if(out->tagged){
+            len += sprintf(line, "%ld\t", res->tag); //tag the line for the coordinator's merge
         }
-        
-        pthread_mutex_unlock(&out_lock);
-        
-        //free mallocs
-        free(single_hostname);
-        for(int i = 0; i < 30; i++){
-            free(IPs[i]);
+        len += sprintf(line + len, "%s", res->hostname); //write the domain name to file
+        for(int i = 0; i < res->naddrs; i++){ //write each IP to the same line as hostname
+            len += sprintf(line + len, ",%s", res->addrs[i]);
         }
+        line[len++] = '\n';
     }
-}
 
+    TRACE_BEGIN(out_start);
+    pthread_mutex_lock(&out_lock); //critical section
+    TRACE_END(TRACE_OUT_WAIT, out_start);
 
+    TRACE_BEGIN(write_start);
+    if(out->db){
+        dnsdb_writer_add(out->db, res->hostname, res->addrs, res->naddrs);
+    }
+    else{
+        outputLine(out, line, len);
+    }
+    TRACE_END(TRACE_WRITE, write_start);
 
+    pthread_mutex_unlock(&out_lock);
+}
+
+int runPipeline(FILE** inFiles, int numFiles, output* out, const dns_engine_config* base){
+    dns_engine_config cfg = *base;
+    OUT = out;
+
+    //no point in more NUMA queues than there are files to feed them
+    if(cfg.max_lanes <= 0 || cfg.max_lanes > numFiles){
+        cfg.max_lanes = numFiles > 0 ? numFiles : 1;
+    }
+    cfg.callback = writeResult;
+    cfg.callback_arg = out;
 
-int main(int argc, char * argv[]) {
-    //create pthread pools
-    FILES_FINISHED = 0;
-    NUM_INPUT_FILES = argc-2;
-    OUT_FILE = argv[argc-1];
-    THREAD_MAX = sysconf(_SC_NPROCESSORS_ONLN);
-    
-    //initialize queue and locks
-    queue_init(&q, 0); //invoke MAX_QUEUE_SIZE for the queue
-    
-    pthread_cond_init(&empty, NULL);
-    pthread_cond_init(&full, NULL);
-    pthread_mutex_init(&queue_lock, NULL);
-    pthread_mutex_init(&FF_lock, NULL);
     pthread_mutex_init(&out_lock, NULL);
-    
-    //incorrect usage
-    if(argc < MINARGS){
-        fprintf(stderr, "Not enough arguments: %d, must have at least 2 (one input file, and one output file).\n", (argc - 1));
-        fprintf(stderr, "Usage: %s <inputFilePath> <inputFilePath> ... <outputFilePath>\n", argv[0]);
+    dns_engine* e = dns_engine_create(&cfg);
+    if(!e){
+        fprintf(stderr, "Error creating resolver engine.\n");
+        pthread_mutex_destroy(&out_lock);
         return EXIT_FAILURE;
     }
-    
-    //list of input files
-    char* in_files[NUM_INPUT_FILES];
-    for (int i=0; i < NUM_INPUT_FILES; i++){
-        in_files[i] = argv[i+1];
-    }
-    
-    //thread pools
-    pthread_t producer, consumer;
-    int createProducer = pthread_create(&producer, NULL, (void*) readerPool, in_files);
-    int createConsumer = pthread_create(&consumer, NULL, (void*) resolverPool, NULL);
-    
-    if(createProducer || createConsumer)
-        fprintf(stderr, "Error creating initial threads.");
-    
-    pthread_join(producer, NULL);
-    pthread_join(consumer, NULL);
-    
-    //free queue and locks
-    queue_cleanup(&q);
-    
-    pthread_cond_destroy(&empty);
-    pthread_cond_destroy(&full);
-    pthread_mutex_destroy(&queue_lock);
-    pthread_mutex_destroy(&FF_lock);
+
+    readerPool(inFiles, numFiles, e);
+
+    //destroy resolves whatever is still queued before stopping the resolvers
+    dns_engine_wait(e);
+    if(cfg.cache_size > 0){
+        unsigned long hits, misses;
+        dns_engine_cache_stats(e, &hits, &misses);
+        fprintf(stderr, "cache: %lu hits, %lu misses\n", hits, misses);
+    }
+    dns_engine_destroy(e);
     pthread_mutex_destroy(&out_lock);
-    
+
     return EXIT_SUCCESS;
 }
+
+
+int main(int argc, char * argv[]) {
+    int shards = 1;
+    int ordered = 0;
+    int db = 0;
+    int zlevel = 0;
+    long flush_ms = GZOUT_FLUSH_MS;
+    char* cpu_list = NULL;
+    char* hosts_file = NULL;
+    hostmap hosts;
+    dns_engine_config cfg;
+    placement* where = &cfg.where;
+    int opt;
+
+    dns_engine_config_init(&cfg);
+
+    while((opt = getopt(argc, argv, "s:c:r:R:NObz:F:t:T:Q:C:H:")) != -1){
+        switch(opt){
+            case 's':
+                shards = atoi(optarg);
+                break;
+            case 'c':
+                cpu_list = optarg;
+                break;
+            case 'r':
+            case 'R':
+                if(affinity_parse(optarg, opt == 'r' ? &where->readers : &where->resolvers) < 0){
+                    fprintf(stderr, "Invalid cpu list: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N':
+                if(!affinity_numa()){
+                    fprintf(stderr, "-N needs NUMA support; rebuild with libnuma installed\n");
+                    return EXIT_FAILURE;
+                }
+                where->numa = 1;
+                break;
+            case 'O':
+                ordered = 1;
+                break;
+            case 'b':
+                db = 1;
+                break;
+            case 'z':
+                zlevel = atoi(optarg);
+                break;
+            case 'F':
+                flush_ms = atol(optarg);
+                break;
+            case 't':
+                if(trace_start(optarg)){
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                cfg.threads = atoi(optarg);
+                break;
+            case 'Q':
+                cfg.queue_size = atoi(optarg);
+                break;
+            case 'C':
+                cfg.cache_size = atoi(optarg);
+                break;
+            case 'H':
+                hosts_file = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    //incorrect usage
+    if(argc - optind < MINARGS - 1){
+        fprintf(stderr, "Not enough arguments: %d, must have at least 2 (one input file, and one output file).\n", (argc - optind));
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(shards < 1){
+        fprintf(stderr, "Invalid -s %d: must have at least 1 shard\n", shards);
+        return EXIT_FAILURE;
+    }
+    if(zlevel < 0 || zlevel > 9){
+        fprintf(stderr, "Invalid -z %d: compression level must be 1-9, or 0 for none\n", zlevel);
+        return EXIT_FAILURE;
+    }
+    if(db && zlevel){
+        fprintf(stderr, "-b and -z cannot be used together: a results database is not compressed\n");
+        return EXIT_FAILURE;
+    }
+    if(cfg.threads < 0){
+        fprintf(stderr, "Invalid -T %d: resolver threads must not be negative\n", cfg.threads);
+        return EXIT_FAILURE;
+    }
+    if(cfg.queue_size < 0){
+        fprintf(stderr, "Invalid -Q %d: queue slots must not be negative\n", cfg.queue_size);
+        return EXIT_FAILURE;
+    }
+    if(cfg.cache_size < 0){
+        fprintf(stderr, "Invalid -C %d: cache entries must not be negative\n", cfg.cache_size);
+        return EXIT_FAILURE;
+    }
+
+    int num_files = argc - optind - 1;
+    char** in_names = &argv[optind];
+    char* out_file = argv[argc-1];
+
+    //sharded runs split the list between the workers instead
+    if(cpu_list && shards == 1){
+        cpu_set_t cpus;
+        if(affinity_parse(cpu_list, &cpus) < 0 || affinity_pin(&cpus) < 0){
+            fprintf(stderr, "Invalid cpu list: %s\n", cpu_list);
+            return EXIT_FAILURE;
+        }
+    }
+
+    //map the hosts overlay once; shard workers inherit the mapping
+    if(hosts_file){
+        if(hostmap_open(&hosts, hosts_file)){
+            return EXIT_FAILURE;
+        }
+        cfg.hosts = &hosts;
+    }
+
+    //open shared out file, or collect results for the database
+    output out;
+    if(openOutput(&out, out_file, db, zlevel, flush_ms)){
+        return EXIT_FAILURE;
+    }
+
+    int ret;
+    if(shards > 1){
+        //hand the whole run to the shard coordinator
+        ret = shard_coordinator(in_names, num_files, &out, shards, cpu_list, ordered, &cfg);
+        trace_finish();
+    }
+    else{
+        //list of input files, skipping the ones we can't open
+        FILE* in_files[num_files];
+        int opened = 0;
+        for (int i=0; i < num_files; i++){
+            in_files[opened] = fopen(in_names[i], "r");
+            if(!in_files[opened]){
+                perror("Error opening input file.\n");
+                continue;
+            }
+            opened++;
+        }
+
+        ret = startOutput(&out);
+        if(ret == EXIT_SUCCESS){
+            ret = runPipeline(in_files, opened, &out, &cfg);
+        }
+        if(trace_finish()){
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if(hosts_file){
+        hostmap_close(&hosts);
+    }
+    return closeOutput(&out, out_file, ret == EXIT_SUCCESS);
+}
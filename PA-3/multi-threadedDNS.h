@@ -18,18 +18,44 @@
 
 #include "queue.h"
 #include "util.h"
+#include "dnsdb.h"
+#include "gzout.h"
+#include "affinity.h"
+#include "dns_engine.h"
 
 #define MINARGS 3
 #define DOMAIN_SIZE 1024
 #define MAX_NAME_LIMIT 225
 #define INPUTFS "%1024s"
+#define SHARDFS "%ld %1024s"
 #define QUEUE_SIZE 50
-
-
-void* readerPool(char** inFiles);
-void* Read(char* fileName);
-
-void* resolverPool();
-void* Resolve();
+#define READ_BATCH 32
+#define LINE_SIZE (DOMAIN_SIZE + 30 * (INET6_ADDRSTRLEN + 1) + 32)
+
+//where writeResult() writes the engine's results
+typedef struct output_s{
+    FILE* fp;           //text output file
+    dnsdb_writer* db;   //results database being built, instead of fp
+    gzout* gz;          //compressor in front of fp
+    int tagged;         //prefix lines with the request seq (shard workers)
+} output;
+
+typedef struct reader_s{
+    FILE* input;
+    dns_engine* e;
+    int slot;           //engine queue this reader binds to
+} reader;
+
+void* readerPool(FILE** inFiles, int numFiles, dns_engine* e);
+void* Read(reader* r);
+
+void writeResult(dns_result* res, void* arg);
+
+int openOutput(output* out, char* path, int db, int zlevel, long flushMs);
+int startOutput(output* out);
+void outputLine(output* out, char* line, size_t len);
+int closeOutput(output* out, char* path, int ok);
+
+int runPipeline(FILE** inFiles, int numFiles, output* out, const dns_engine_config* cfg);
 
 #endif /* multi_threadedDNS_h */
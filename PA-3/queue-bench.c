@@ -0,0 +1,388 @@
+/*
+ * File: queue-bench.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/29
+ * Description:
+ * 	Microbenchmark and contention harness for queue.c.
+ *      P producers push and C consumers pop through a bounded queue for
+ *      each ring size asked for. Reports throughput, push/pop latency
+ *      percentiles and hardware cache misses (perf_event_open, when the
+ *      kernel lets us).
+ *
+ *      Queue implementations are rows in bench_impls[]. To judge a new
+ *      queue, add a row with blocking push/pop and run both with -i.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "queue.h"
+
+#define USAGE "Usage: %s [-i <impl>] [-p <producers>] [-c <consumers>] [-s <size>,<size>...]\n" \
+              "          [-n <ops>] [-w ptr|alloc|touch]\n"
+
+#define BENCH_SAMPLE_EVERY 16	/* latency sample rate, per thread */
+#define BENCH_PAYLOAD 32	/* bytes in an alloc/touch payload, about a hostname */
+
+/* a blocking bounded queue under test */
+typedef struct bench_impl_s{
+    const char* name;
+    void* (*create)(int size);
+    void (*push)(void* q, void* payload);	/* waits while full */
+    void* (*pop)(void* q);			/* waits while empty */
+    void (*destroy)(void* q);
+} bench_impl;
+
+/* mutex + condvar around queue.c, one payload per lock hold
+ * The pop is the engine's resolver loop; dns_engine_submit() instead
+ * pushes a chunk of up to SUBMIT_CHUNK names per lock hold and broadcasts
+ * empty once for the chunk, so this push is the engine's worst case,
+ * a submit of one name at a time.
+ */
+typedef struct locked_queue_s{
+    queue q;
+    pthread_mutex_t lock;
+    pthread_cond_t full;
+    pthread_cond_t empty;
+} locked_queue;
+
+static void* locked_create(int size){
+    locked_queue* lq = malloc(sizeof(locked_queue));
+    queue_init(&lq->q, size);
+    pthread_mutex_init(&lq->lock, NULL);
+    pthread_cond_init(&lq->full, NULL);
+    pthread_cond_init(&lq->empty, NULL);
+    return lq;
+}
+
+static void locked_push(void* arg, void* payload){
+    locked_queue* lq = arg;
+    pthread_mutex_lock(&lq->lock);
+    while(queue_is_full(&lq->q)){
+        pthread_cond_wait(&lq->full, &lq->lock);
+    }
+    queue_push(&lq->q, payload);
+    pthread_cond_signal(&lq->empty);
+    pthread_mutex_unlock(&lq->lock);
+}
+
+static void* locked_pop(void* arg){
+    locked_queue* lq = arg;
+    pthread_mutex_lock(&lq->lock);
+    while(queue_is_empty(&lq->q)){
+        pthread_cond_wait(&lq->empty, &lq->lock);
+    }
+    void* payload = queue_pop(&lq->q);
+    pthread_cond_signal(&lq->full);
+    pthread_mutex_unlock(&lq->lock);
+    return payload;
+}
+
+static void locked_destroy(void* arg){
+    locked_queue* lq = arg;
+    queue_cleanup(&lq->q);
+    pthread_mutex_destroy(&lq->lock);
+    pthread_cond_destroy(&lq->full);
+    pthread_cond_destroy(&lq->empty);
+    free(lq);
+}
+
+static const bench_impl bench_impls[] = {
+    {"mutex-condvar", locked_create, locked_push, locked_pop, locked_destroy},
+};
+#define BENCH_NIMPLS (int)(sizeof(bench_impls) / sizeof(bench_impls[0]))
+
+/* payload patterns */
+#define PATTERN_PTR 0		/* a constant pointer: queue cost only */
+#define PATTERN_ALLOC 1		/* malloc in the producer, free in the consumer */
+#define PATTERN_TOUCH 2		/* alloc, plus the consumer reads every byte */
+
+typedef struct bench_run_s{
+    const bench_impl* impl;
+    void* q;
+    int pattern;
+    long ops_per_producer;
+    long remaining;		/* pops left, claimed atomically by consumers */
+    pthread_barrier_t start;
+} bench_run;
+
+typedef struct bench_thread_s{
+    bench_run* run;
+    uint64_t* samples;
+    long nsamples;
+    uint64_t checksum;
+} bench_thread;
+
+static uint64_t bench_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* producer(void* arg){
+    bench_thread* t = arg;
+    bench_run* r = t->run;
+    static char constant[BENCH_PAYLOAD];
+
+    pthread_barrier_wait(&r->start);
+    for(long i = 0; i < r->ops_per_producer; i++){
+        void* payload = constant;
+        if(r->pattern != PATTERN_PTR){
+            payload = malloc(BENCH_PAYLOAD);
+            memset(payload, (int)i, BENCH_PAYLOAD);
+        }
+        if(i % BENCH_SAMPLE_EVERY == 0){
+            uint64_t start = bench_now();
+            r->impl->push(r->q, payload);
+            t->samples[t->nsamples++] = bench_now() - start;
+        }
+        else{
+            r->impl->push(r->q, payload);
+        }
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg){
+    bench_thread* t = arg;
+    bench_run* r = t->run;
+    long i = 0;
+
+    pthread_barrier_wait(&r->start);
+    while(__atomic_sub_fetch(&r->remaining, 1, __ATOMIC_RELAXED) >= 0){
+        unsigned char* payload;
+        if(i++ % BENCH_SAMPLE_EVERY == 0){
+            uint64_t start = bench_now();
+            payload = r->impl->pop(r->q);
+            t->samples[t->nsamples++] = bench_now() - start;
+        }
+        else{
+            payload = r->impl->pop(r->q);
+        }
+        if(r->pattern == PATTERN_TOUCH){
+            for(int b = 0; b < BENCH_PAYLOAD; b++){
+                t->checksum += payload[b];
+            }
+        }
+        if(r->pattern != PATTERN_PTR){
+            free(payload);
+        }
+    }
+    return NULL;
+}
+
+/* perf counter for the whole process, children threads included */
+static int perf_open(uint32_t type, uint64_t config){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = type == PERF_TYPE_HARDWARE;	/* switches happen in the kernel */
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int cmp_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* gather the threads' samples and print p50/p99/p99.9 in ns */
+static void percentiles(bench_thread* t, int n, char* out, size_t size){
+    long total = 0, k = 0;
+    for(int i = 0; i < n; i++){
+        total += t[i].nsamples;
+    }
+    if(total == 0){
+        snprintf(out, size, "%8s %8s %8s", "-", "-", "-");
+        return;
+    }
+    uint64_t* all = malloc(sizeof(uint64_t) * total);
+    for(int i = 0; i < n; i++){
+        memcpy(all + k, t[i].samples, sizeof(uint64_t) * t[i].nsamples);
+        k += t[i].nsamples;
+    }
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+    snprintf(out, size, "%8llu %8llu %8llu",
+             (unsigned long long)all[total * 50 / 100],
+             (unsigned long long)all[total * 99 / 100],
+             (unsigned long long)all[total * 999 / 1000]);
+    free(all);
+}
+
+static void bench(const bench_impl* impl, int size, int producers, int consumers,
+                  long ops, int pattern, int misses_fd, int cs_fd){
+    bench_run r;
+    pthread_t threads[producers + consumers];
+    bench_thread t[producers + consumers];
+    long per_sample = ops / BENCH_SAMPLE_EVERY + 2;
+    uint64_t misses = 0, switches = 0;
+    char push_lat[64], pop_lat[64];
+
+    r.impl = impl;
+    r.q = impl->create(size);
+    r.pattern = pattern;
+    r.ops_per_producer = ops / producers;
+    r.remaining = r.ops_per_producer * producers;
+    pthread_barrier_init(&r.start, NULL, producers + consumers + 1);
+
+    for(int i = 0; i < producers + consumers; i++){
+        t[i].run = &r;
+        t[i].samples = malloc(sizeof(uint64_t) * per_sample);
+        t[i].nsamples = 0;
+        t[i].checksum = 0;
+        pthread_create(&threads[i], NULL, i < producers ? producer : consumer, &t[i]);
+    }
+
+    if(misses_fd >= 0){
+        ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if(cs_fd >= 0){
+        ioctl(cs_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cs_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    pthread_barrier_wait(&r.start);
+    uint64_t start = bench_now();
+    for(int i = 0; i < producers + consumers; i++){
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = bench_now() - start;
+    if(misses_fd >= 0){
+        ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(misses_fd, &misses, sizeof(misses)) != sizeof(misses)){
+            misses = 0;
+        }
+    }
+    if(cs_fd >= 0){
+        ioctl(cs_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(cs_fd, &switches, sizeof(switches)) != sizeof(switches)){
+            switches = 0;
+        }
+    }
+
+    long done = r.ops_per_producer * producers;
+    percentiles(t, producers, push_lat, sizeof(push_lat));
+    percentiles(t + producers, consumers, pop_lat, sizeof(pop_lat));
+
+    printf("%-16s %6d %12.0f %s   %s", impl->name, size, done / (elapsed / 1e9), push_lat, pop_lat);
+    if(misses_fd >= 0){
+        printf(" %10.2f", (double)misses / done);
+    }
+    else{
+        printf(" %10s", "n/a");
+    }
+    if(cs_fd >= 0){
+        printf(" %10.3f\n", (double)switches / done);
+    }
+    else{
+        printf(" %10s\n", "n/a");
+    }
+
+    for(int i = 0; i < producers + consumers; i++){
+        free(t[i].samples);
+    }
+    pthread_barrier_destroy(&r.start);
+    impl->destroy(r.q);
+}
+
+int main(int argc, char* argv[]){
+    const char* impl_name = NULL;
+    const char* sizes = "1,8,50,1024";
+    int producers = 1, consumers = 1, pattern = PATTERN_ALLOC;
+    long ops = 1000000;
+    int opt;
+
+    while((opt = getopt(argc, argv, "i:p:c:s:n:w:")) != -1){
+        switch(opt){
+            case 'i':
+                impl_name = optarg;
+                break;
+            case 'p':
+                producers = atoi(optarg);
+                break;
+            case 'c':
+                consumers = atoi(optarg);
+                break;
+            case 's':
+                sizes = optarg;
+                break;
+            case 'n':
+                ops = atol(optarg);
+                break;
+            case 'w':
+                if(!strcmp(optarg, "ptr")){
+                    pattern = PATTERN_PTR;
+                }
+                else if(!strcmp(optarg, "alloc")){
+                    pattern = PATTERN_ALLOC;
+                }
+                else if(!strcmp(optarg, "touch")){
+                    pattern = PATTERN_TOUCH;
+                }
+                else{
+                    fprintf(stderr, USAGE, argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(producers < 1 || consumers < 1 || ops < producers){
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int misses_fd = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int cs_fd = perf_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+
+    printf("%d producers, %d consumers, %ld ops; latencies in ns (p50 p99 p99.9)\n",
+           producers, consumers, ops);
+    printf("%-16s %6s %12s %26s   %26s %10s %10s\n", "impl", "size", "ops/s",
+           "push", "pop", "miss/op", "cswitch/op");
+
+    int found = 0;
+    for(int i = 0; i < BENCH_NIMPLS; i++){
+        if(impl_name && strcmp(impl_name, bench_impls[i].name)){
+            continue;
+        }
+        found = 1;
+        for(const char* p = sizes; *p; ){
+            char* end;
+            int size = strtol(p, &end, 10);
+            if(end == p || size < 1){
+                fprintf(stderr, "Invalid size list: %s\n", sizes);
+                return EXIT_FAILURE;
+            }
+            bench(&bench_impls[i], size, producers, consumers, ops, pattern, misses_fd, cs_fd);
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    if(!found){
+        fprintf(stderr, "Unknown queue implementation: %s\n", impl_name);
+        return EXIT_FAILURE;
+    }
+
+    if(misses_fd >= 0){
+        close(misses_fd);
+    }
+    if(cs_fd >= 0){
+        close(cs_fd);
+    }
+    return EXIT_SUCCESS;
+}
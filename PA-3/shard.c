@@ -0,0 +1,276 @@
+/*
+ * File: shard.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/20
+ * Description:
+ * 	Multi-process sharded mode for multi-threadedDNS.
+ *      See shard.h for the protocol spoken between coordinator and workers.
+ *
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "multi-threadedDNS.h"
+#include "affinity.h"
+#include "shard.h"
+#include "trace.h"
+#include "hostname.h"
+
+typedef struct merge_s{
+    pthread_mutex_t lock;
+    output* out;
+    int ordered;
+    char** pending;	/* ordered mode: lines for seq next .. next + cap - 1,
+			   seq in slot seq % cap */
+    long cap;
+    long next;		/* next seq to write in ordered mode */
+    int failed;		/* out of memory for pending; later lines are dropped */
+} merge;
+
+typedef struct shard_s{
+    pid_t pid;
+    int sock;
+    FILE* to_worker;
+    pthread_t merger;
+    merge* m;
+} shard;
+
+/* write out every line that is next in sequence */
+static void merge_drain(merge* m){
+    while(m->cap && m->pending[m->next % m->cap]){
+	char** slot = &m->pending[m->next % m->cap];
+	outputLine(m->out, *slot, strlen(*slot));
+	free(*slot);
+	*slot = NULL;
+	m->next++;
+    }
+}
+
+/* hold line until every earlier seq is written; the window only spans the
+ * oldest missing line to the newest arrived one, not the whole input
+ * returns 0, or -1 out of memory (line is freed)
+ */
+static int merge_place(merge* m, long seq, char* line){
+    if(!line){
+	return -1;
+    }
+    if(seq < m->next){
+	/* a duplicate of a line already written */
+	free(line);
+	return 0;
+    }
+    if(seq - m->next >= m->cap){
+	long cap = m->cap ? m->cap : 1024;
+	char** pending;
+	while(cap <= seq - m->next){
+	    cap *= 2;
+	}
+	pending = calloc(cap, sizeof(char*));
+	if(!pending){
+	    free(line);
+	    return -1;
+	}
+	for(long k = m->next; k < m->next + m->cap; k++){
+	    pending[k % cap] = m->pending[k % m->cap];
+	}
+	free(m->pending);
+	m->pending = pending;
+	m->cap = cap;
+    }
+    m->pending[seq % m->cap] = line;
+    merge_drain(m);
+    return 0;
+}
+
+/* reads one worker's results and merges them into the output */
+static void* merge_shard(void* arg){
+    shard* s = arg;
+    merge* m = s->m;
+    FILE* in = fdopen(dup(s->sock), "r");
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t n;
+
+    if(!in){
+	perror("Error opening shard socket");
+	return NULL;
+    }
+    trace_thread_name("merge");
+
+    while((n = getline(&line, &len, in)) > 0){
+	char* end;
+	long seq = strtol(line, &end, 10);
+	if(end == line || *end != '\t' || seq < 0){
+	    fprintf(stderr, "Malformed line from shard %d\n", (int)s->pid);
+	    continue;
+	}
+	TRACE_BEGIN(out_start);
+	pthread_mutex_lock(&m->lock);
+	TRACE_END(TRACE_OUT_WAIT, out_start);
+	TRACE_BEGIN(write_start);
+	if(m->ordered){
+	    if(!m->failed && merge_place(m, seq, strdup(end + 1))){
+		fprintf(stderr, "Out of memory ordering results; dropping the rest\n");
+		m->failed = 1;
+	    }
+	}
+	else{
+	    outputLine(m->out, end + 1, n - (end + 1 - line));
+	}
+	TRACE_END(TRACE_WRITE, write_start);
+	pthread_mutex_unlock(&m->lock);
+    }
+
+    free(line);
+    fclose(in);
+    return NULL;
+}
+
+/* stream every hostname in inFiles to its shard, tagged with its position
+ * Invalid names all go to shard 0, whose engine answers them without a lookup
+ */
+static void distribute(char** inFiles, int numFiles, shard* shards, int n){
+    char domain[DOMAIN_SIZE + 1];
+    long seq = 0;
+
+    for(int i = 0; i < numFiles; i++){
+	FILE* input = fopen(inFiles[i], "r");
+	if(!input){
+	    perror("Error opening input file.\n");
+	    continue;
+	}
+	while(fscanf(input, INPUTFS, domain) > 0){
+	    /* hash the normalized name, so every spelling lands on the same shard */
+	    char key[DOMAIN_SIZE + 1 + HOSTNAME_PAD];
+	    size_t len;
+	    uint64_t hash;
+	    memcpy(key, domain, strlen(domain) + 1);
+	    if(hostname_normalize(key, &len, &hash) != HOSTNAME_VALID){
+		hash = 0;
+	    }
+	    shard* s = &shards[hash % n];
+	    fprintf(s->to_worker, "%ld %s\n", seq++, domain);
+	}
+	fclose(input);
+    }
+
+    for(int i = 0; i < n; i++){
+	fflush(shards[i].to_worker);
+	shutdown(shards[i].sock, SHUT_WR);
+	fclose(shards[i].to_worker);
+    }
+}
+
+int shard_worker(int sock, const dns_engine_config* cfg){
+    FILE* in = fdopen(sock, "r");
+    output out = {.fp = fdopen(dup(sock), "w"), .tagged = 1};
+    int ret;
+
+    if(!in || !out.fp){
+	perror("Error opening shard socket");
+	return EXIT_FAILURE;
+    }
+
+    ret = runPipeline(&in, 1, &out, cfg);	/* closes in */
+    fclose(out.fp);
+    return ret;
+}
+
+int shard_coordinator(char** inFiles, int numFiles, output* out,
+		      int shards, const char* cpuList, int ordered,
+		      const dns_engine_config* cfg){
+
+    shard s[shards];
+    merge m;
+    cpu_set_t cpus, slice;
+    int ret = EXIT_SUCCESS;
+    int i, j, status;
+
+    if(cpuList && affinity_parse(cpuList, &cpus) < 0){
+	fprintf(stderr, "Invalid cpu list: %s\n", cpuList);
+	return EXIT_FAILURE;
+    }
+
+    memset(&m, 0, sizeof(m));
+    m.out = out;
+    m.ordered = ordered;
+    pthread_mutex_init(&m.lock, NULL);
+
+    /* a dead worker must not kill us with SIGPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* fork every worker before this process starts any threads */
+    fflush(NULL);
+    for(i = 0; i < shards; i++){
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)){
+	    perror("Error creating shard socket");
+	    exit(EXIT_FAILURE);
+	}
+	s[i].pid = fork();
+	if(s[i].pid < 0){
+	    perror("Error forking shard worker");
+	    exit(EXIT_FAILURE);
+	}
+	if(s[i].pid == 0){
+	    close(sv[0]);
+	    for(j = 0; j < i; j++){
+		close(s[j].sock);
+	    }
+	    if(out->fp){
+		fclose(out->fp);
+	    }
+	    if(cpuList){
+		affinity_slice(&cpus, i, shards, &slice);
+		affinity_pin(&slice);
+	    }
+	    trace_child(i);
+	    status = shard_worker(sv[1], cfg);
+	    exit(trace_finish() ? EXIT_FAILURE : status);
+	}
+	close(sv[1]);
+	s[i].sock = sv[0];
+	s[i].m = &m;
+	s[i].to_worker = fdopen(dup(sv[0]), "w");
+    }
+
+    /* the workers are forked; now this process may start threads */
+    if(startOutput(out)){
+	ret = EXIT_FAILURE;
+    }
+    for(i = 0; i < shards; i++){
+	pthread_create(&s[i].merger, NULL, merge_shard, &s[i]);
+    }
+
+    distribute(inFiles, numFiles, s, shards);
+
+    for(i = 0; i < shards; i++){
+	pthread_join(s[i].merger, NULL);
+	close(s[i].sock);
+	if(waitpid(s[i].pid, &status, 0) < 0 ||
+	   !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS){
+	    fprintf(stderr, "Shard worker %d failed\n", i);
+	    ret = EXIT_FAILURE;
+	}
+    }
+
+    /* a failed worker leaves holes; keep whatever arrived, in order */
+    for(long k = m.next; k < m.next + m.cap; k++){
+	char* line = m.pending[k % m.cap];
+	if(line){
+	    outputLine(out, line, strlen(line));
+	    free(line);
+	}
+    }
+    free(m.pending);
+    if(m.failed){
+	ret = EXIT_FAILURE;
+    }
+
+    pthread_mutex_destroy(&m.lock);
+    return ret;
+}
@@ -0,0 +1,44 @@
+/*
+ * File: shard.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/20
+ * Description:
+ * 	Multi-process sharded mode for multi-threadedDNS. A coordinator
+ *      hashes hostnames into N shards and streams each shard to a forked
+ *      worker process running the normal reader/resolver pipeline. The
+ *      workers' results are merged into the output file, optionally in
+ *      input order.
+ *
+ *      Shard protocol, over one connected stream socket per worker:
+ *          coordinator -> worker: "<seq> <hostname>\n" ..., then SHUT_WR
+ *          worker -> coordinator: "<seq>\t<output line>\n" ..., then close
+ *      Nothing in it depends on the socket being a socketpair, so a worker
+ *      can equally be handed an accepted unix or tcp socket.
+ *
+ */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "multi-threadedDNS.h"
+
+/* Function to resolve inFiles with shards worker processes
+ * and merge their results into out
+ * cpuList (may be NULL) is split between the workers
+ * ordered keeps output lines in input order
+ * cfg configures each worker's engine; its threads stay within
+ * the worker's slice of cpuList
+ * Returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int shard_coordinator(char** inFiles, int numFiles, output* out,
+		      int shards, const char* cpuList, int ordered,
+		      const dns_engine_config* cfg);
+
+/* Function to run the pipeline as a shard worker on sock
+ * Reads requests until the peer shuts down its write side
+ * Returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int shard_worker(int sock, const dns_engine_config* cfg);
+
+#endif
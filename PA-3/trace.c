@@ -0,0 +1,174 @@
+/*
+ * File: trace.c
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/27
+ * Description:
+ * 	Timeline tracing for multi-threadedDNS.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+typedef struct trace_span_s{
+    uint64_t start;
+    uint32_t dur;	/* ns, saturates at ~4s */
+    uint32_t event;
+} trace_span;
+
+typedef struct trace_buf_s{
+    pid_t tid;
+    char name[16];
+    uint64_t head;	/* spans ever recorded; the ring keeps the last ones */
+    trace_span ring[TRACE_RING_SIZE];
+} trace_buf;
+
+static const char* trace_names[TRACE_EVENTS] = {
+    "read", "queue wait", "dnslookup", "output lock", "write"
+};
+
+int trace_enabled = 0;
+
+static char* trace_path = NULL;
+static trace_buf* trace_bufs[TRACE_MAX_THREADS];
+static int trace_nbufs = 0;
+static __thread trace_buf* trace_mine = NULL;
+
+/* first record from a thread: grab a slot for its buffer */
+static trace_buf* trace_buffer(void){
+
+    int slot;
+
+    if(trace_mine){
+	return trace_mine;
+    }
+
+    slot = __atomic_fetch_add(&trace_nbufs, 1, __ATOMIC_RELAXED);
+    if(slot >= TRACE_MAX_THREADS){
+	return NULL;
+    }
+    trace_mine = calloc(1, sizeof(trace_buf));
+    if(!trace_mine){
+	return NULL;
+    }
+    trace_mine->tid = syscall(SYS_gettid);
+    __atomic_store_n(&trace_bufs[slot], trace_mine, __ATOMIC_RELEASE);
+
+    return trace_mine;
+}
+
+void trace_record(int event, uint64_t start){
+
+    trace_buf* b = trace_buffer();
+    trace_span* s;
+    uint64_t dur;
+
+    if(!b){
+	return;
+    }
+    dur = trace_now() - start;
+    s = &b->ring[b->head % TRACE_RING_SIZE];
+    s->start = start;
+    s->dur = dur > UINT32_MAX ? UINT32_MAX : dur;
+    s->event = event;
+    b->head++;
+}
+
+int trace_start(const char* path){
+    trace_path = strdup(path);
+    if(!trace_path){
+	return TRACE_FAILURE;
+    }
+    trace_enabled = 1;
+    return TRACE_SUCCESS;
+}
+
+void trace_thread_name(const char* name){
+
+    trace_buf* b;
+
+    if(!trace_enabled || !(b = trace_buffer())){
+	return;
+    }
+    strncpy(b->name, name, sizeof(b->name) - 1);
+}
+
+void trace_child(int shard){
+
+    char* path;
+
+    if(!trace_enabled){
+	return;
+    }
+    path = malloc(strlen(trace_path) + 16);
+    sprintf(path, "%s.%d", trace_path, shard);
+    free(trace_path);
+    trace_path = path;
+}
+
+int trace_finish(void){
+
+    FILE* out;
+    pid_t pid = getpid();
+    const char* sep = "";
+    int i, n, ret = TRACE_SUCCESS;
+    uint64_t j;
+
+    if(!trace_enabled){
+	return TRACE_SUCCESS;
+    }
+    trace_enabled = 0;
+
+    out = fopen(trace_path, "w");
+    if(!out){
+	perror("Error opening trace file");
+	ret = TRACE_FAILURE;
+    }
+
+    n = trace_nbufs < TRACE_MAX_THREADS ? trace_nbufs : TRACE_MAX_THREADS;
+    if(out){
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    }
+    for(i = 0; i < n; i++){
+	trace_buf* b = trace_bufs[i];
+	if(!b){
+	    continue;
+	}
+	if(out){
+	    if(b->name[0]){
+		fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			sep, (int)pid, (int)b->tid, b->name);
+		sep = ",";
+	    }
+	    j = b->head > TRACE_RING_SIZE ? b->head - TRACE_RING_SIZE : 0;
+	    for(; j < b->head; j++){
+		trace_span* s = &b->ring[j % TRACE_RING_SIZE];
+		fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f}",
+			sep, trace_names[s->event], (int)pid, (int)b->tid,
+			s->start / 1000.0, s->dur / 1000.0);
+		sep = ",";
+	    }
+	}
+	free(b);
+	trace_bufs[i] = NULL;
+    }
+    if(out){
+	fprintf(out, "\n]}\n");
+	if(fclose(out)){
+	    ret = TRACE_FAILURE;
+	}
+    }
+
+    trace_nbufs = 0;
+    free(trace_path);
+    trace_path = NULL;
+    return ret;
+}
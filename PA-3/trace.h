@@ -0,0 +1,70 @@
+/*
+ * File: trace.h
+ * Author: Dylan Schneider
+ * Project: CSCI 3753 Programming Assignment 3
+ * Create Date: 2017/03/27
+ * Description:
+ * 	Timeline tracing for multi-threadedDNS.
+ *      Each thread records spans into its own ring buffer (no locks, only
+ *      an atomic slot grab the first time a thread records). At exit the
+ *      buffers are written as Chrome trace-event JSON, which loads in
+ *      chrome://tracing and Perfetto.
+ *      With tracing off, each TRACE_BEGIN/TRACE_END is one load and one
+ *      well-predicted branch.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_FAILURE -1
+#define TRACE_SUCCESS 0
+
+#define TRACE_MAX_THREADS 1024
+#define TRACE_RING_SIZE (64 * 1024)	/* spans kept per thread */
+
+/* span names, see trace_names in trace.c */
+#define TRACE_READ 0		/* Read(): parse one input line */
+#define TRACE_QUEUE_WAIT 1	/* blocked on a full or empty queue */
+#define TRACE_LOOKUP 2		/* dnslookup() */
+#define TRACE_OUT_WAIT 3	/* waiting for the output lock */
+#define TRACE_WRITE 4		/* writing one result */
+#define TRACE_EVENTS 5
+
+extern int trace_enabled;
+
+static inline uint64_t trace_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Function to record a span that started at start (from trace_now) */
+void trace_record(int event, uint64_t start);
+
+#define TRACE_BEGIN(var) \
+    uint64_t var = __builtin_expect(trace_enabled, 0) ? trace_now() : 0
+#define TRACE_END(event, var) \
+    do{ if(__builtin_expect(trace_enabled, 0)) trace_record(event, var); }while(0)
+
+/* Function to turn tracing on; the trace is written to path
+ * Returns TRACE_SUCCESS or TRACE_FAILURE
+ */
+int trace_start(const char* path);
+
+/* Function to name the calling thread in the trace */
+void trace_thread_name(const char* name);
+
+/* Function for a forked shard worker to trace into path.<shard> */
+void trace_child(int shard);
+
+/* Function to write the trace and free the buffers
+ * Call once every traced thread has been joined
+ * Returns TRACE_SUCCESS or TRACE_FAILURE
+ */
+int trace_finish(void);
+
+#endif
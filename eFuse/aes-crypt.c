@@ -1,5 +1,6 @@
 /* aes-crypt.c
  * High level function interface for performing AES encryption on FILE pointers
+ * and memory buffers
  * Uses OpenSSL libcrypto EVP API
  *
  * By Andy Sayler (www.andysayler.com)
@@ -17,10 +18,177 @@
 
 #include "aes-crypt.h"
 
+#include <pthread.h>
+
 #define BLOCKSIZE 1024
 #define FAILURE 0
 #define SUCCESS 1
 
+/* Cipher contexts of one thread, one per action, and the keys they hold */
+struct thread_ctx{
+    EVP_CIPHER_CTX* ctx[2];
+    struct aes_xts_key key[2];
+};
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+static void thread_ctx_free(void* data){
+    struct thread_ctx* t = data;
+
+    EVP_CIPHER_CTX_free(t->ctx[0]);
+    EVP_CIPHER_CTX_free(t->ctx[1]);
+    free(t);
+}
+
+static void thread_key_create(void){
+    pthread_key_create(&thread_key, thread_ctx_free);
+}
+
+/* The calling thread's context for action, keyed with key */
+static EVP_CIPHER_CTX* thread_ctx_get(const struct aes_xts_key* key, int action){
+    struct thread_ctx* t;
+
+    pthread_once(&thread_once, thread_key_create);
+    t = pthread_getspecific(thread_key);
+    if(!t){
+	t = calloc(1, sizeof(*t));
+	if(!t){
+	    return NULL;
+	}
+	if(pthread_setspecific(thread_key, t)){
+	    free(t);
+	    return NULL;
+	}
+    }
+
+    if(t->ctx[action] && !memcmp(&t->key[action], key, sizeof(*key))){
+	return t->ctx[action];
+    }
+    if(!t->ctx[action]){
+	t->ctx[action] = EVP_CIPHER_CTX_new();
+	if(!t->ctx[action]){
+	    return NULL;
+	}
+    }
+    if(!EVP_CipherInit_ex(t->ctx[action], EVP_aes_256_xts(), NULL, key->bytes, NULL, action)){
+	/* key it again next time */
+	EVP_CIPHER_CTX_free(t->ctx[action]);
+	t->ctx[action] = NULL;
+	return NULL;
+    }
+    t->key[action] = *key;
+    return t->ctx[action];
+}
+
+extern int aes_xts_key_derive(struct aes_xts_key* key, const char* key_str,
+			      const unsigned char* salt, size_t salt_len, int rounds){
+    if(!key_str){
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+    if(!PKCS5_PBKDF2_HMAC(key_str, strlen(key_str),
+			  salt, salt_len, rounds,
+			  EVP_sha256(), sizeof(key->bytes), key->bytes)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern int aes_cbc_key_derive(struct aes_cbc_key* key, const char* key_str){
+    int nrounds = 5;
+    int i;
+
+    if(!key_str){
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+    i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+		       (const unsigned char*)key_str, strlen(key_str), nrounds,
+		       key->key, key->iv);
+    if (i != 32) {
+	fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern int aes_xts_crypt(const struct aes_xts_key* key, const unsigned char* tweak,
+			 uint64_t unit, size_t unit_size, size_t count,
+			 const unsigned char* in, unsigned char* out, int action){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char iv[AES_XTS_TWEAK_SIZE];
+    uint64_t n;
+    int outlen;
+
+    if(action != 0 && action != 1){
+	return FAILURE;
+    }
+    ctx = thread_ctx_get(key, action);
+    if(!ctx){
+	return FAILURE;
+    }
+
+    /* Each unit only sets its tweak on the keyed context */
+    for(size_t i = 0; i < count; i++){
+	memcpy(iv, tweak, sizeof(iv));
+	memcpy(&n, iv, sizeof(n));
+	n ^= unit + i;
+	memcpy(iv, &n, sizeof(n));
+	if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, action) ||
+	   !EVP_CipherUpdate(ctx, out + i * unit_size, &outlen,
+			     in + i * unit_size, unit_size)){
+	    return FAILURE;
+	}
+    }
+    return SUCCESS;
+}
+
+extern int aes_stream_init(struct aes_stream* s, const struct aes_cbc_key* key,
+			   int action){
+    s->ctx = NULL;
+    if(action < 0){
+	return SUCCESS;
+    }
+
+    s->ctx = EVP_CIPHER_CTX_new();
+    if(!s->ctx){
+	return FAILURE;
+    }
+    if(!EVP_CipherInit_ex(s->ctx, EVP_aes_256_cbc(), NULL, key->key, key->iv, action)){
+	aes_stream_free(s);
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern int aes_stream_update(struct aes_stream* s, const unsigned char* in,
+			     int inlen, unsigned char* out, int* outlen){
+    /* If in pass-through mode. copy block as is */
+    if(!s->ctx){
+	memmove(out, in, inlen);
+	*outlen = inlen;
+	return SUCCESS;
+    }
+    return EVP_CipherUpdate(s->ctx, out, outlen, in, inlen) ? SUCCESS : FAILURE;
+}
+
+extern int aes_stream_final(struct aes_stream* s, unsigned char* out, int* outlen){
+    int ret = SUCCESS;
+
+    *outlen = 0;
+    if(s->ctx && !EVP_CipherFinal_ex(s->ctx, out, outlen)){
+	ret = FAILURE;
+    }
+    aes_stream_free(s);
+    return ret;
+}
+
+extern void aes_stream_free(struct aes_stream* s){
+    EVP_CIPHER_CTX_free(s->ctx);
+    s->ctx = NULL;
+}
+
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     /* Local Vars */
 
@@ -32,34 +200,19 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     int outlen;
     int writelen;
 
-    /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
-    unsigned char key[32];
-    unsigned char iv[32];
-    int nrounds = 5;
-    
-    /* tmp vars */
-    int i;
+    /* Cipher stream */
+    struct aes_cbc_key key;
+    struct aes_stream stream;
 
     /* Setup Encryption Key and Cipher Engine if in cipher mode */
-    if(action >= 0){
-	if(!key_str){
-	    /* Error */
-	    fprintf(stderr, "Key_str must not be NULL\n");
-	    return 0;
-	}
-	/* Build Key from String */
-	i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
-			   (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
-	if (i != 32) {
-	    /* Error */
-	    fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
-	    return 0;
-	}
-	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
-    }    
+    if(action >= 0 && !aes_cbc_key_derive(&key, key_str)){
+	/* Error */
+	return 0;
+    }
+    if(!aes_stream_init(&stream, &key, action)){
+	/* Error */
+	return 0;
+    }
 
     /* Loop through Input File*/
     for(;;){
@@ -69,20 +222,12 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	    /* EOF -> Break Loop */
 	    break;
 	}
-	
-	/* If in cipher mode, perform cipher transform on block */
-	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
-		{
-		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
-		    return 0;
-		}
-	}
-	/* If in pass-through mode. copy block as is */
-	else{
-	    memcpy(outbuf, inbuf, inlen);
-	    outlen = inlen;
+
+	/* Perform cipher transform on block, or copy it in pass-through mode */
+	if(!aes_stream_update(&stream, inbuf, inlen, outbuf, &outlen)){
+	    /* Error */
+	    aes_stream_free(&stream);
+	    return 0;
 	}
 
 	/* Write Block */
@@ -90,25 +235,19 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
+	    aes_stream_free(&stream);
 	    return 0;
 	}
     }
-    
-    /* If in cipher mode, handle necessary padding */
-    if(action >= 0){
-	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
-	    {
-		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
-	    }
-	/* Write remainign cipher block + padding*/
-	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
-    }
-    
+
+    /* Handle remaining cipher block + padding */
+    if(!aes_stream_final(&stream, outbuf, &outlen)){
+	/* Error */
+	return 0;
+    }
+    /* Write remainign cipher block + padding*/
+    fwrite(outbuf, sizeof(*inbuf), outlen, out);
+
     /* Success */
     return 1;
 }
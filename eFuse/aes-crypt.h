@@ -1,5 +1,6 @@
 /* aes-crypt.h
  * High level function interface for performing AES encryption on FILE pointers
+ * and memory buffers
  * Uses OpenSSL libcrypto EVP API
  *
  * By Andy Sayler (www.andysayler.com)
@@ -13,6 +14,9 @@
  * http://saju.net.in/blog/?p=36
  * http://saju.net.in/code/misc/openssl_aes.c.txt
  *
+ * Keys are derived from a passphrase once, into an aes_*_key, and then
+ * passed to every call. The buffer functions never touch files.
+ *
  */
 
 #ifndef AES_CRYPT_H
@@ -21,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <openssl/evp.h>
 #include <openssl/aes.h>
@@ -29,6 +34,84 @@
 #define FAILURE 0
 #define SUCCESS 1
 
+#define AES_XTS_KEY_SIZE 64	/* two AES-256 keys */
+#define AES_XTS_TWEAK_SIZE 16
+
+/* Key for aes_xts_crypt() */
+struct aes_xts_key{
+    unsigned char bytes[AES_XTS_KEY_SIZE];
+};
+
+/* Key and IV of the whole-stream AES-256-CBC cipher do_crypt() uses */
+struct aes_cbc_key{
+    unsigned char key[32];
+    unsigned char iv[32];
+};
+
+/* int aes_xts_key_derive(struct aes_xts_key* key, const char* key_str,
+ *                        const unsigned char* salt, size_t salt_len,
+ *                        int rounds)
+ * Purpose: Derive an XTS key from a passphrase with PBKDF2-HMAC-SHA256
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_xts_key_derive(struct aes_xts_key* key, const char* key_str,
+			      const unsigned char* salt, size_t salt_len, int rounds);
+
+/* int aes_cbc_key_derive(struct aes_cbc_key* key, const char* key_str)
+ * Purpose: Derive the key and IV do_crypt() derives from key_str
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_cbc_key_derive(struct aes_cbc_key* key, const char* key_str);
+
+/* int aes_xts_crypt(const struct aes_xts_key* key, const unsigned char* tweak,
+ *                   uint64_t unit, size_t unit_size, size_t count,
+ *                   const unsigned char* in, unsigned char* out, int action)
+ * Purpose: Perform AES-256-XTS on count data units of unit_size bytes from in,
+ *          placing the result in out, which may be in. The units are units
+ *          unit, unit + 1, ... of a larger buffer: each is ciphered with
+ *          tweak, its unit number xored into the first 8 bytes, so any run
+ *          of units can be ciphered on its own.
+ *          Uses a cipher context of the calling thread that is keyed only
+ *          when key or action changes.
+ * Args: int action : Cipher action (1=encrypt, 0=decrypt)
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_xts_crypt(const struct aes_xts_key* key, const unsigned char* tweak,
+			 uint64_t unit, size_t unit_size, size_t count,
+			 const unsigned char* in, unsigned char* out, int action);
+
+/* A do_crypt() style CBC stream over buffers */
+struct aes_stream{
+    EVP_CIPHER_CTX* ctx;	/* NULL in pass-through mode */
+};
+
+/* int aes_stream_init(struct aes_stream* s, const struct aes_cbc_key* key,
+ *                     int action)
+ * Purpose: Start a stream; action is as for do_crypt()
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_stream_init(struct aes_stream* s, const struct aes_cbc_key* key,
+			   int action);
+
+/* int aes_stream_update(struct aes_stream* s, const unsigned char* in,
+ *                       int inlen, unsigned char* out, int* outlen)
+ * Purpose: Cipher the next inlen bytes of the stream into out, which must
+ *          have room for inlen + EVP_MAX_BLOCK_LENGTH bytes
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_stream_update(struct aes_stream* s, const unsigned char* in,
+			     int inlen, unsigned char* out, int* outlen);
+
+/* int aes_stream_final(struct aes_stream* s, unsigned char* out, int* outlen)
+ * Purpose: Place the last block and padding in out, which must have room for
+ *          EVP_MAX_BLOCK_LENGTH bytes, and end the stream
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int aes_stream_final(struct aes_stream* s, unsigned char* out, int* outlen);
+
+/* End a stream without finishing it */
+extern void aes_stream_free(struct aes_stream* s);
+
 /* int do_crypt(FILE* in, FILE* out, int action, char* key_str)
  * Purpose: Perform cipher on in File* and place result in out File*
  * Args: FILE* in      : Input File Pointer
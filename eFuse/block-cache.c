@@ -0,0 +1,269 @@
+/* block-cache.c
+ * Process wide cache of decrypted blocks for eFUSE
+ *
+ * See block-cache.h. Each shard is a CLOCK ring of slots with a chained
+ * hash index over it; a slot's data lives in one array per shard.
+ *
+ */
+
+#include "block-cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONE -1
+
+struct slot{
+    struct blockcache_file f;
+    uint64_t n;
+    int32_t next;		/* hash chain */
+    unsigned char used;
+    unsigned char referenced;	/* CLOCK bit */
+};
+
+struct shard{
+    pthread_mutex_t lock;
+    struct slot* slots;
+    unsigned char* data;
+    int32_t* buckets;
+    size_t nslots;
+    size_t mask;		/* buckets - 1 */
+    size_t hand;
+    size_t used;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+static struct shard shards[BLOCKCACHE_SHARDS];
+static size_t shard_slots;	/* 0 when the cache is off */
+
+static uint64_t mix(uint64_t h){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t block_hash(const struct blockcache_file* f, uint64_t n){
+    return mix(((uint64_t)f->dev * 0x9e3779b97f4a7c15ULL) ^ f->ino ^
+	       mix(f->gen + n));
+}
+
+static int same_file(const struct blockcache_file* a, const struct blockcache_file* b){
+    return a->ino == b->ino && a->gen == b->gen && a->dev == b->dev;
+}
+
+extern int blockcache_init(size_t bytes){
+    size_t nslots = bytes / BLOCKFILE_BLOCK_SIZE / BLOCKCACHE_SHARDS;
+    size_t nbuckets = 1;
+
+    if(nslots == 0){
+	shard_slots = 0;
+	return 0;
+    }
+    while(nbuckets < nslots){
+	nbuckets <<= 1;
+    }
+
+    for(int i = 0; i < BLOCKCACHE_SHARDS; i++){
+	struct shard* s = &shards[i];
+
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->lock, NULL);
+	s->slots = calloc(nslots, sizeof(*s->slots));
+	s->data = malloc(nslots * BLOCKFILE_BLOCK_SIZE);
+	s->buckets = malloc(nbuckets * sizeof(*s->buckets));
+	if(!s->slots || !s->data || !s->buckets){
+	    return -ENOMEM;
+	}
+	memset(s->buckets, 0xff, nbuckets * sizeof(*s->buckets));	/* NONE */
+	s->nslots = nslots;
+	s->mask = nbuckets - 1;
+    }
+    shard_slots = nslots;
+    return 0;
+}
+
+extern void blockcache_file_init(struct blockcache_file* f, dev_t dev, ino_t ino,
+				 const struct blockfile_header* h){
+    f->dev = dev;
+    f->ino = ino;
+    memcpy(&f->gen, h->nonce, sizeof(f->gen));
+}
+
+static struct shard* shard_of(uint64_t hash){
+    return &shards[hash % BLOCKCACHE_SHARDS];
+}
+
+/* Index of the slot holding block n of f, or NONE; pprev gets the link to it */
+static int32_t find(struct shard* s, uint64_t hash, const struct blockcache_file* f,
+		    uint64_t n, int32_t** pprev){
+    int32_t* prev = &s->buckets[(hash / BLOCKCACHE_SHARDS) & s->mask];
+
+    while(*prev != NONE){
+	struct slot* sl = &s->slots[*prev];
+	if(sl->n == n && same_file(&sl->f, f)){
+	    break;
+	}
+	prev = &sl->next;
+    }
+    if(pprev){
+	*pprev = prev;
+    }
+    return *prev;
+}
+
+static void unlink_slot(struct shard* s, int32_t i){
+    struct slot* sl = &s->slots[i];
+    int32_t* prev;
+
+    find(s, block_hash(&sl->f, sl->n), &sl->f, sl->n, &prev);
+    *prev = sl->next;
+    sl->used = 0;
+    s->used--;
+}
+
+extern int blockcache_get(const struct blockcache_file* f, uint64_t n,
+			  unsigned char* plain){
+    uint64_t hash;
+    struct shard* s;
+    int32_t i;
+
+    if(shard_slots == 0){
+	return 0;
+    }
+    hash = block_hash(f, n);
+    s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    i = find(s, hash, f, n, NULL);
+    if(i != NONE){
+	s->slots[i].referenced = 1;
+	memcpy(plain, s->data + (size_t)i * BLOCKFILE_BLOCK_SIZE, BLOCKFILE_BLOCK_SIZE);
+	s->hits++;
+    }
+    else{
+	s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return i != NONE;
+}
+
+extern int blockcache_contains(const struct blockcache_file* f, uint64_t n){
+    uint64_t hash;
+    struct shard* s;
+    int32_t i;
+
+    if(shard_slots == 0){
+	return 0;
+    }
+    hash = block_hash(f, n);
+    s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    i = find(s, hash, f, n, NULL);
+    pthread_mutex_unlock(&s->lock);
+    return i != NONE;
+}
+
+extern void blockcache_put(const struct blockcache_file* f, uint64_t n,
+			   const unsigned char* plain){
+    uint64_t hash;
+    struct shard* s;
+    int32_t* prev;
+    int32_t i;
+
+    if(shard_slots == 0){
+	return;
+    }
+    hash = block_hash(f, n);
+    s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    i = find(s, hash, f, n, &prev);
+    if(i == NONE){
+	/* CLOCK: skip slots referenced since the hand last passed them */
+	while(s->slots[s->hand].used && s->slots[s->hand].referenced){
+	    s->slots[s->hand].referenced = 0;
+	    s->hand = (s->hand + 1) % s->nslots;
+	}
+	i = s->hand;
+	s->hand = (s->hand + 1) % s->nslots;
+	if(s->slots[i].used){
+	    unlink_slot(s, i);
+	    s->evictions++;
+	    /* the chain may have changed under prev */
+	    find(s, hash, f, n, &prev);
+	}
+	s->slots[i].f = *f;
+	s->slots[i].n = n;
+	s->slots[i].used = 1;
+	s->slots[i].next = *prev;
+	*prev = i;
+	s->used++;
+    }
+    /* a new block starts unreferenced, so one pass of the hand can evict
+     * blocks that were only read once */
+    s->slots[i].referenced = 0;
+    memcpy(s->data + (size_t)i * BLOCKFILE_BLOCK_SIZE, plain, BLOCKFILE_BLOCK_SIZE);
+    pthread_mutex_unlock(&s->lock);
+}
+
+extern void blockcache_invalidate(const struct blockcache_file* f, uint64_t n){
+    uint64_t hash;
+    struct shard* s;
+    int32_t i;
+
+    if(shard_slots == 0){
+	return;
+    }
+    hash = block_hash(f, n);
+    s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    i = find(s, hash, f, n, NULL);
+    if(i != NONE){
+	unlink_slot(s, i);
+	s->invalidations++;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+extern void blockcache_invalidate_from(const struct blockcache_file* f,
+				       uint64_t first){
+    for(int k = 0; k < BLOCKCACHE_SHARDS && shard_slots; k++){
+	struct shard* s = &shards[k];
+
+	pthread_mutex_lock(&s->lock);
+	for(size_t i = 0; i < s->nslots; i++){
+	    struct slot* sl = &s->slots[i];
+	    if(sl->used && sl->n >= first && same_file(&sl->f, f)){
+		unlink_slot(s, i);
+		s->invalidations++;
+	    }
+	}
+	pthread_mutex_unlock(&s->lock);
+    }
+}
+
+extern void blockcache_get_stats(struct blockcache_stats* stats){
+    memset(stats, 0, sizeof(*stats));
+    for(int k = 0; k < BLOCKCACHE_SHARDS && shard_slots; k++){
+	struct shard* s = &shards[k];
+
+	pthread_mutex_lock(&s->lock);
+	stats->hits += s->hits;
+	stats->misses += s->misses;
+	stats->evictions += s->evictions;
+	stats->invalidations += s->invalidations;
+	stats->used += s->used;
+	stats->capacity += s->nslots;
+	pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,78 @@
+/* block-cache.h
+ * Process wide cache of decrypted blocks for eFUSE
+ *
+ * Holds plaintext blocks of encrypted files, keyed by the file and the block
+ * number, so rereading a file does not decrypt it again. A file is its mirror
+ * inode plus a generation taken from its header nonce, so a new file that
+ * reuses an inode number never sees the old file's blocks.
+ *
+ * The cache is split into BLOCKCACHE_SHARDS shards, each with its own lock,
+ * and a block's shard comes from its hash, so readers of different blocks
+ * rarely contend. Each shard evicts with CLOCK. Callers invalidate blocks
+ * they change; the cache never reads or writes the mirror itself.
+ *
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "block-file.h"
+
+#define BLOCKCACHE_SHARDS 16
+#define BLOCKCACHE_DEFAULT_MB 64
+
+struct blockcache_file{
+    dev_t dev;
+    ino_t ino;
+    uint64_t gen;
+};
+
+struct blockcache_stats{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    size_t used;		/* blocks held */
+    size_t capacity;		/* blocks */
+};
+
+/* int blockcache_init(size_t bytes)
+ * Purpose: Size the cache to hold bytes of blocks; 0 turns it off
+ * Return: 0, or -ENOMEM
+ */
+extern int blockcache_init(size_t bytes);
+
+/* Fill f's key from its mirror inode and header */
+extern void blockcache_file_init(struct blockcache_file* f, dev_t dev, ino_t ino,
+				 const struct blockfile_header* h);
+
+/* int blockcache_get(const struct blockcache_file* f, uint64_t n,
+ *                    unsigned char* plain)
+ * Purpose: Copy block n of f into plain if it is cached
+ * Return: 1 on a hit, 0 on a miss
+ */
+extern int blockcache_get(const struct blockcache_file* f, uint64_t n,
+			  unsigned char* plain);
+
+/* Whether block n of f is cached, without counting a hit or miss or
+ * keeping it from eviction */
+extern int blockcache_contains(const struct blockcache_file* f, uint64_t n);
+
+/* Cache plain as block n of f, replacing any older copy */
+extern void blockcache_put(const struct blockcache_file* f, uint64_t n,
+			   const unsigned char* plain);
+
+/* Drop block n of f */
+extern void blockcache_invalidate(const struct blockcache_file* f, uint64_t n);
+
+/* Drop every block of f from block first on; scans the whole cache */
+extern void blockcache_invalidate_from(const struct blockcache_file* f,
+				       uint64_t first);
+
+extern void blockcache_get_stats(struct blockcache_stats* stats);
+
+#endif
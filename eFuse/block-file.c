@@ -0,0 +1,1010 @@
+/* block-file.c
+ * Random access encrypted file format for eFUSE
+ *
+ * See block-file.h for the layout.
+ *
+ */
+
+#define _GNU_SOURCE	/* fallocate() */
+
+#include "block-file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+
+#include "aes-crypt.h"
+#include "crypt-pool.h"
+
+#define ENCRYPT 1
+#define DECRYPT 0
+
+#define KEY_SALT_V1 "eFUSE block key"	/* the salt of version 1 files */
+#define KEY_ROUNDS 100000
+#define KEY_CHECK "eFUSE key check"	/* prefixed to the nonce for the check value */
+
+#define MIGRATE_SUFFIX ".efuse-migrate"
+#define MIGRATE_BLOCKS 64	/* blocks decrypted per pread() when migrating */
+#define WRITE_BLOCKS 256	/* blocks encrypted per pwrite() */
+
+/* One migration at a time, so two lookups of a file do not both convert it */
+static pthread_mutex_t migrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int migrate_seq;	/* numbers temporary names, atomic */
+
+/* Offset in the mirror file of block n */
+#define block_pos(n) (BLOCKFILE_HEADER_SIZE + (off_t)(n) * BLOCKFILE_BLOCK_SIZE)
+
+/* Blocks covering size bytes */
+#define block_count(size) (((size) + BLOCKFILE_BLOCK_SIZE - 1) / BLOCKFILE_BLOCK_SIZE)
+
+/* Layout of compressed files */
+#define CHUNK_BLOCKS 16		/* blocks compressed together */
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCKFILE_BLOCK_SIZE)
+#define GROUP_CHUNKS (BLOCKFILE_BLOCK_SIZE / sizeof(uint32_t))	/* chunks per map block */
+#define GROUP_SIZE (BLOCKFILE_BLOCK_SIZE + (off_t)GROUP_CHUNKS * CHUNK_SIZE)
+
+/* Offset in a compressed file of the map entry and the slot of chunk c */
+#define map_pos(c) (BLOCKFILE_HEADER_SIZE + (off_t)((c) / GROUP_CHUNKS) * GROUP_SIZE + \
+		    (off_t)((c) % GROUP_CHUNKS) * sizeof(uint32_t))
+#define chunk_pos(c) (BLOCKFILE_HEADER_SIZE + (off_t)((c) / GROUP_CHUNKS) * GROUP_SIZE + \
+		      BLOCKFILE_BLOCK_SIZE + (off_t)((c) % GROUP_CHUNKS) * CHUNK_SIZE)
+
+#define is_compressed(h) ((h)->flags & BLOCKFILE_COMPRESSED)
+
+static struct blockfile_stats stats;	/* atomic */
+
+/* Read exactly size bytes at offset
+ * Return: 0, -EIO if the file is shorter, or a negative errno
+ */
+static int read_exact(int fd, unsigned char* buf, size_t size, off_t offset){
+    ssize_t n = pread(fd, buf, size, offset);
+
+    if(n < 0){
+	return -errno;
+    }
+    return (size_t)n == size ? 0 : -EIO;
+}
+
+extern int blockfile_salt(const char* mirror, unsigned char* salt){
+    char tmp_name[64];
+    int dirfd = open(mirror, O_RDONLY | O_DIRECTORY);
+    int fd;
+    int ret;
+
+    if(dirfd == -1){
+	return -errno;
+    }
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", BLOCKFILE_SALT_NAME, (int)getpid());
+
+    for(;;){
+	fd = openat(dirfd, BLOCKFILE_SALT_NAME, O_RDONLY | O_NOFOLLOW);
+	if(fd != -1){
+	    ret = read_exact(fd, salt, BLOCKFILE_SALT_SIZE, 0);
+	    close(fd);
+	    break;
+	}
+	if(errno != ENOENT){
+	    ret = -errno;
+	    break;
+	}
+
+	/* Written in full beside it and linked into place, so a crash or a
+	 * mount racing this one never sees part of a salt */
+	if(RAND_bytes(salt, BLOCKFILE_SALT_SIZE) != 1){
+	    ret = -EIO;
+	    break;
+	}
+	unlinkat(dirfd, tmp_name, 0);
+	fd = openat(dirfd, tmp_name, O_CREAT | O_EXCL | O_WRONLY, 0444);
+	if(fd == -1){
+	    ret = -errno;
+	    break;
+	}
+	ret = pwrite(fd, salt, BLOCKFILE_SALT_SIZE, 0) == BLOCKFILE_SALT_SIZE &&
+	    fsync(fd) == 0 ? 0 : (errno ? -errno : -EIO);
+	close(fd);
+	if(ret == 0 && linkat(dirfd, tmp_name, dirfd, BLOCKFILE_SALT_NAME, 0) == -1){
+	    ret = -errno;
+	}
+	unlinkat(dirfd, tmp_name, 0);
+	if(ret != -EEXIST){
+	    break;
+	}
+	/* another mount made one first */
+    }
+
+    close(dirfd);
+    return ret;
+}
+
+extern int blockfile_key_derive(struct blockfile_key* key, const char* password,
+				const unsigned char* salt){
+    memset(key, 0, sizeof(*key));
+    if(!aes_xts_key_derive(&key->xts_v1, password, (const unsigned char*)KEY_SALT_V1,
+			   strlen(KEY_SALT_V1), KEY_ROUNDS) ||
+       (salt && !aes_xts_key_derive(&key->xts, password, salt, BLOCKFILE_SALT_SIZE,
+				    KEY_ROUNDS)) ||
+       !aes_cbc_key_derive(&key->legacy, password)){
+	return -EINVAL;
+    }
+    key->salted = salt != NULL;
+    return 0;
+}
+
+/* The key the blocks of the file h heads are encrypted with */
+static const struct aes_xts_key* block_key(const struct blockfile_header* h,
+					   const struct blockfile_key* key){
+    return h->version > 1 ? &key->xts : &key->xts_v1;
+}
+
+/* Compute the key check value of h, an HMAC of its nonce under the key */
+static int key_check(const struct blockfile_header* h, const struct blockfile_key* key,
+		     unsigned char* check){
+    unsigned char msg[sizeof(KEY_CHECK) + sizeof(h->nonce)];
+    unsigned int len = BLOCKFILE_CHECK_SIZE;
+
+    memcpy(msg, KEY_CHECK, sizeof(KEY_CHECK));
+    memcpy(msg + sizeof(KEY_CHECK), h->nonce, sizeof(h->nonce));
+    return HMAC(EVP_sha256(), key->xts.bytes, sizeof(key->xts.bytes),
+		msg, sizeof(msg), check, &len) ? 0 : -EIO;
+}
+
+static int is_hole(const unsigned char* block){
+    return block[0] == 0 && !memcmp(block, block + 1, BLOCKFILE_BLOCK_SIZE - 1);
+}
+
+/* A crypt_blocks() call, for cryptpool_run() */
+struct crypt_job{
+    const struct blockfile_header* h;
+    const struct blockfile_key* key;
+    uint64_t first;
+    const unsigned char* in;
+    const unsigned char* const* blocks;
+    unsigned char* out;
+    int action;
+};
+
+/* Cipher blocks [i, i + n) of a crypt_job */
+static int crypt_range(void* arg, size_t i, size_t n){
+    const struct crypt_job* job = arg;
+    size_t end = i + n;
+
+    for(size_t j; i < end; i = j){
+	const unsigned char* src = job->blocks ? job->blocks[i] : job->in + i * BLOCKFILE_BLOCK_SIZE;
+	unsigned char* dst = job->out + i * BLOCKFILE_BLOCK_SIZE;
+
+	if(job->action == DECRYPT && is_hole(src)){
+	    memset(dst, 0, BLOCKFILE_BLOCK_SIZE);
+	    j = i + 1;
+	    continue;
+	}
+	/* blocks that are contiguous in memory go to the cipher together */
+	j = i + 1;
+	while(!job->blocks && j < end &&
+	      (job->action == ENCRYPT || !is_hole(job->in + j * BLOCKFILE_BLOCK_SIZE))){
+	    j++;
+	}
+	if(!aes_xts_crypt(block_key(job->h, job->key), job->h->nonce, job->first + i,
+			  BLOCKFILE_BLOCK_SIZE, j - i, src, dst, job->action)){
+	    return -EIO;
+	}
+    }
+    return 0;
+}
+
+/* Encrypt or decrypt count blocks, starting at block first, into out
+ * They come from in, or from blocks[i] if blocks is not NULL; in may be out.
+ * Large runs are split across the crypto pool.
+ */
+static int crypt_blocks(const struct blockfile_header* h,
+			const struct blockfile_key* key, uint64_t first,
+			size_t count, const unsigned char* in,
+			const unsigned char* const* blocks,
+			unsigned char* out, int action){
+    struct crypt_job job = {h, key, first, in, blocks, out, action};
+
+    return cryptpool_run(count, BLOCKFILE_BLOCK_SIZE, crypt_range, &job);
+}
+
+/* Read up to size bytes at offset, zero filling past the end of the file
+ * Return: 0, or a negative errno
+ */
+static int read_full(int fd, unsigned char* buf, size_t size, off_t offset){
+    size_t got = 0;
+
+    while(got < size){
+	ssize_t n = pread(fd, buf + got, size - got, offset + got);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -errno;
+	}
+	if(n == 0){
+	    break;
+	}
+	got += n;
+    }
+    memset(buf + got, 0, size - got);
+    return 0;
+}
+
+static int write_full(int fd, const unsigned char* buf, size_t size, off_t offset){
+    size_t done = 0;
+
+    while(done < size){
+	ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -errno;
+	}
+	done += n;
+    }
+    return 0;
+}
+
+/* Read and decrypt chunk c of a compressed file into the CHUNK_SIZE bytes
+ * of plain
+ * A compressed chunk whose length does not fill the blocks its map entry
+ * gives, or that does not decompress, is one a crash tore: -EIO.
+ */
+static int load_chunk(int fd, const struct blockfile_header* h,
+		      const struct blockfile_key* key, uint64_t c,
+		      unsigned char* plain){
+    uint32_t k;
+    uint32_t len;
+    unsigned char* packed;
+    uLongf plain_len = CHUNK_SIZE;
+    int ret;
+
+    ret = read_full(fd, (unsigned char*)&k, sizeof(k), map_pos(c));
+    if(ret){
+	return ret;
+    }
+    if(k == 0){
+	/* stored raw, or never written */
+	ret = read_full(fd, plain, CHUNK_SIZE, chunk_pos(c));
+	if(ret){
+	    return ret;
+	}
+	return crypt_blocks(h, key, c * CHUNK_BLOCKS, CHUNK_BLOCKS, plain, NULL, plain, DECRYPT);
+    }
+    if(k >= CHUNK_BLOCKS){
+	return -EIO;
+    }
+
+    packed = malloc(k * BLOCKFILE_BLOCK_SIZE);
+    if(!packed){
+	return -ENOMEM;
+    }
+    ret = read_full(fd, packed, k * BLOCKFILE_BLOCK_SIZE, chunk_pos(c));
+    if(ret == 0){
+	ret = crypt_blocks(h, key, c * CHUNK_BLOCKS, k, packed, NULL, packed, DECRYPT);
+    }
+    if(ret == 0){
+	memcpy(&len, packed, sizeof(len));
+	if(len == 0 || block_count(sizeof(len) + (uint64_t)len) != k ||
+	   uncompress(plain, &plain_len, packed + sizeof(len), len) != Z_OK ||
+	   plain_len != CHUNK_SIZE){
+	    ret = -EIO;
+	}
+    }
+    free(packed);
+    return ret;
+}
+
+/* Compress and encrypt the CHUNK_SIZE bytes of plain as chunk c, of which
+ * used blocks are in the file. A chunk that does not compress to fewer
+ * blocks than used is stored raw, as uncompressed files store their blocks.
+ * The map entry of a compressed chunk is written before its slot and that
+ * of a raw one after, so a crash in between leaves the map saying
+ * compressed over a slot that load_chunk() finds torn, never raw over
+ * compressed data.
+ * Return: Blocks of the slot written, or a negative errno
+ */
+static int store_chunk(int fd, const struct blockfile_header* h,
+		       const struct blockfile_key* key, uint64_t c,
+		       const unsigned char* plain, size_t used){
+    unsigned char* packed = malloc(CHUNK_SIZE);
+    uint32_t len32;
+    uLongf len = used > 1 ? (used - 1) * BLOCKFILE_BLOCK_SIZE - sizeof(len32) : 0;
+    uint32_t entry = 0;
+    size_t k = used;
+    int ret;
+
+    if(!packed){
+	return -ENOMEM;
+    }
+    /* a compressed chunk starts with its length, inside the encryption */
+    if(len > 0 && compress2(packed + sizeof(len32), &len, plain, CHUNK_SIZE, Z_BEST_SPEED) == Z_OK){
+	len32 = len;
+	memcpy(packed, &len32, sizeof(len32));
+	k = block_count(sizeof(len32) + len);
+	entry = k;
+	memset(packed + sizeof(len32) + len, 0, k * BLOCKFILE_BLOCK_SIZE - sizeof(len32) - len);
+	ret = crypt_blocks(h, key, c * CHUNK_BLOCKS, k, packed, NULL, packed, ENCRYPT);
+	if(ret == 0){
+	    ret = write_full(fd, (const unsigned char*)&entry, sizeof(entry), map_pos(c));
+	}
+	if(ret == 0){
+	    ret = write_full(fd, packed, k * BLOCKFILE_BLOCK_SIZE, chunk_pos(c));
+	}
+    }
+    else{
+	ret = crypt_blocks(h, key, c * CHUNK_BLOCKS, k, plain, NULL, packed, ENCRYPT);
+	if(ret == 0){
+	    ret = write_full(fd, packed, k * BLOCKFILE_BLOCK_SIZE, chunk_pos(c));
+	}
+	if(ret == 0){
+	    ret = write_full(fd, (const unsigned char*)&entry, sizeof(entry), map_pos(c));
+	}
+    }
+    free(packed);
+    if(ret){
+	return ret;
+    }
+
+    /* Free the rest of the slot. Only a raw chunk reads it, as holes that
+     * must read as zeros, so it gets zeros written if punching fails. */
+    if(k < CHUNK_BLOCKS &&
+       fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		 chunk_pos(c) + (off_t)k * BLOCKFILE_BLOCK_SIZE,
+		 (CHUNK_BLOCKS - k) * BLOCKFILE_BLOCK_SIZE) == -1 && !entry){
+	static const unsigned char zeros[BLOCKFILE_BLOCK_SIZE];
+
+	for(size_t i = k; ret == 0 && i < CHUNK_BLOCKS; i++){
+	    ret = write_full(fd, zeros, sizeof(zeros), chunk_pos(c) + (off_t)i * BLOCKFILE_BLOCK_SIZE);
+	}
+	if(ret){
+	    return ret;
+	}
+    }
+    __atomic_add_fetch(entry ? &stats.compressed : &stats.raw, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.plain_bytes, used * BLOCKFILE_BLOCK_SIZE, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.stored_bytes, k * BLOCKFILE_BLOCK_SIZE, __ATOMIC_RELAXED);
+    return k;
+}
+
+/* A read or write of blocks [first, first + count) of a compressed file,
+ * for cryptpool_run() over the chunks it touches */
+struct chunk_job{
+    int fd;
+    const struct blockfile_header* h;
+    const struct blockfile_key* key;
+    uint64_t first;
+    size_t count;
+    uint64_t first_chunk;
+    unsigned char* out;		/* reads */
+    const unsigned char* in;	/* writes, from in or blocks[i] */
+    const unsigned char* const* blocks;
+};
+
+/* Read chunks [i, i + n) of a chunk_job, copying the blocks it wants */
+static int read_chunk_range(void* arg, size_t i, size_t n){
+    const struct chunk_job* job = arg;
+    unsigned char* plain = malloc(CHUNK_SIZE);
+    int ret = 0;
+
+    if(!plain){
+	return -ENOMEM;
+    }
+    for(uint64_t c = job->first_chunk + i; ret == 0 && c < job->first_chunk + i + n; c++){
+	uint64_t from = c * CHUNK_BLOCKS > job->first ? c * CHUNK_BLOCKS : job->first;
+	uint64_t to = (c + 1) * CHUNK_BLOCKS < job->first + job->count ?
+	    (c + 1) * CHUNK_BLOCKS : job->first + job->count;
+
+	ret = load_chunk(job->fd, job->h, job->key, c, plain);
+	if(ret == 0){
+	    memcpy(job->out + (from - job->first) * BLOCKFILE_BLOCK_SIZE,
+		   plain + (from - c * CHUNK_BLOCKS) * BLOCKFILE_BLOCK_SIZE,
+		   (to - from) * BLOCKFILE_BLOCK_SIZE);
+	}
+    }
+    free(plain);
+    return ret;
+}
+
+/* Write chunks [i, i + n) of a chunk_job; a chunk it only partly covers
+ * keeps the rest of its blocks */
+static int write_chunk_range(void* arg, size_t i, size_t n){
+    const struct chunk_job* job = arg;
+    unsigned char* plain = malloc(CHUNK_SIZE);
+    uint64_t end = block_count(job->h->size);
+    int ret = 0;
+
+    if(!plain){
+	return -ENOMEM;
+    }
+    if(end < job->first + job->count){
+	end = job->first + job->count;
+    }
+    for(uint64_t c = job->first_chunk + i; ret == 0 && c < job->first_chunk + i + n; c++){
+	uint64_t from = c * CHUNK_BLOCKS > job->first ? c * CHUNK_BLOCKS : job->first;
+	uint64_t to = (c + 1) * CHUNK_BLOCKS < job->first + job->count ?
+	    (c + 1) * CHUNK_BLOCKS : job->first + job->count;
+	size_t used = end - c * CHUNK_BLOCKS < CHUNK_BLOCKS ? end - c * CHUNK_BLOCKS : CHUNK_BLOCKS;
+
+	if(to - from < CHUNK_BLOCKS){
+	    ret = load_chunk(job->fd, job->h, job->key, c, plain);
+	}
+	for(uint64_t b = from; ret == 0 && b < to; b++){
+	    memcpy(plain + (b - c * CHUNK_BLOCKS) * BLOCKFILE_BLOCK_SIZE,
+		   job->blocks ? job->blocks[b - job->first] :
+		   job->in + (b - job->first) * BLOCKFILE_BLOCK_SIZE,
+		   BLOCKFILE_BLOCK_SIZE);
+	}
+	if(ret == 0){
+	    int k = store_chunk(job->fd, job->h, job->key, c, plain, used);
+	    ret = k < 0 ? k : 0;
+	}
+    }
+    free(plain);
+    return ret;
+}
+
+/* Read or write blocks of a compressed file, chunks split across the crypto
+ * pool */
+static int chunk_blocks(int fd, const struct blockfile_header* h,
+			const struct blockfile_key* key, uint64_t first, size_t count,
+			unsigned char* out, const unsigned char* in,
+			const unsigned char* const* blocks){
+    struct chunk_job job = {fd, h, key, first, count, first / CHUNK_BLOCKS, out, in, blocks};
+    size_t chunks = (first + count - 1) / CHUNK_BLOCKS - job.first_chunk + 1;
+
+    if(count == 0){
+	return 0;
+    }
+    return cryptpool_run(chunks, CHUNK_SIZE, out ? read_chunk_range : write_chunk_range, &job);
+}
+
+extern int blockfile_read_blocks(int fd, const struct blockfile_header* h,
+				 const struct blockfile_key* key, uint64_t first,
+				 size_t count, unsigned char* plain){
+    size_t want = count * BLOCKFILE_BLOCK_SIZE;
+    size_t got = 0;
+
+    if(is_compressed(h)){
+	return chunk_blocks(fd, h, key, first, count, plain, NULL, NULL);
+    }
+    while(got < want){
+	ssize_t n = pread(fd, plain + got, want - got, block_pos(first) + got);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -errno;
+	}
+	if(n == 0){
+	    break;
+	}
+	got += n;
+    }
+    memset(plain + got, 0, want - got);
+    return crypt_blocks(h, key, first, count, plain, NULL, plain, DECRYPT);
+}
+
+/* Encrypt count blocks, from plain or blocks as crypt_blocks() takes them,
+ * and write them from block first, WRITE_BLOCKS at a time
+ */
+static int write_run(int fd, const struct blockfile_header* h,
+		     const struct blockfile_key* key, uint64_t first,
+		     size_t count, const unsigned char* plain,
+		     const unsigned char* const* blocks){
+    size_t chunk = count < WRITE_BLOCKS ? count : WRITE_BLOCKS;
+    unsigned char* cipher;
+    int ret = 0;
+
+    if(is_compressed(h)){
+	return chunk_blocks(fd, h, key, first, count, NULL, plain, blocks);
+    }
+    cipher = malloc(chunk * BLOCKFILE_BLOCK_SIZE);
+    if(!cipher){
+	return -ENOMEM;
+    }
+    for(size_t i = 0; ret == 0 && i < count; i += chunk){
+	size_t want;
+	size_t done = 0;
+
+	if(chunk > count - i){
+	    chunk = count - i;
+	}
+	want = chunk * BLOCKFILE_BLOCK_SIZE;
+	ret = crypt_blocks(h, key, first + i, chunk,
+			   plain ? plain + i * BLOCKFILE_BLOCK_SIZE : NULL,
+			   blocks ? blocks + i : NULL, cipher, ENCRYPT);
+	while(ret == 0 && done < want){
+	    ssize_t n = pwrite(fd, cipher + done, want - done, block_pos(first + i) + done);
+	    if(n < 0){
+		if(errno != EINTR){
+		    ret = -errno;
+		}
+		continue;
+	    }
+	    done += n;
+	}
+    }
+    free(cipher);
+    return ret;
+}
+
+extern int blockfile_write_blocks(int fd, const struct blockfile_header* h,
+				  const struct blockfile_key* key, uint64_t first,
+				  size_t count, const unsigned char* plain){
+    return write_run(fd, h, key, first, count, plain, NULL);
+}
+
+extern int blockfile_write_blockv(int fd, const struct blockfile_header* h,
+				  const struct blockfile_key* key, uint64_t first,
+				  size_t count, const unsigned char* const* blocks){
+    return write_run(fd, h, key, first, count, NULL, blocks);
+}
+
+/* Read block n into plain, or zero plain if n is past the plaintext */
+static int load_block(int fd, const struct blockfile_header* h,
+		      const struct blockfile_key* key, uint64_t n,
+		      unsigned char* plain){
+    if(n >= block_count(h->size)){
+	memset(plain, 0, BLOCKFILE_BLOCK_SIZE);
+	return 0;
+    }
+    return blockfile_read_blocks(fd, h, key, n, 1, plain);
+}
+
+extern int blockfile_store_size(int fd, const struct blockfile_header* h){
+    if(pwrite(fd, &h->size, sizeof(h->size),
+	      offsetof(struct blockfile_header, size)) != sizeof(h->size)){
+	return errno ? -errno : -EIO;
+    }
+    return 0;
+}
+
+extern int blockfile_create(int fd, struct blockfile_header* h,
+			    const struct blockfile_key* key, uint32_t flags){
+    if(!key->salted){
+	return -EACCES;
+    }
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, BLOCKFILE_MAGIC, sizeof(h->magic));
+    h->version = BLOCKFILE_VERSION;
+    h->cipher = BLOCKFILE_AES_256_XTS;
+    h->block_size = BLOCKFILE_BLOCK_SIZE;
+    h->flags = flags;
+    h->size = 0;
+    if(RAND_bytes(h->nonce, sizeof(h->nonce)) != 1 || key_check(h, key, h->check)){
+	return -EIO;
+    }
+
+    if(pwrite(fd, h, sizeof(*h), 0) != sizeof(*h)){
+	return errno ? -errno : -EIO;
+    }
+    /* reserve the rest of the header so block 0 is aligned */
+    if(ftruncate(fd, BLOCKFILE_HEADER_SIZE) == -1){
+	return -errno;
+    }
+    return 0;
+}
+
+extern int blockfile_load(int fd, struct blockfile_header* h,
+			  const struct blockfile_key* key){
+    unsigned char check[BLOCKFILE_CHECK_SIZE];
+    ssize_t n = pread(fd, h, sizeof(*h), 0);
+
+    if(n < 0){
+	return -errno;
+    }
+    if((size_t)n < sizeof(*h) || memcmp(h->magic, BLOCKFILE_MAGIC, sizeof(h->magic))){
+	return -EINVAL;
+    }
+    if(h->version < 1 || h->version > BLOCKFILE_VERSION ||
+       h->flags & ~(h->version > 1 ? BLOCKFILE_COMPRESSED : 0) ||
+       h->cipher != BLOCKFILE_AES_256_XTS || h->block_size != BLOCKFILE_BLOCK_SIZE){
+	fprintf(stderr, "Unsupported block file: version %u, flags %#x, cipher %u, block size %u\n",
+		h->version, h->flags, h->cipher, h->block_size);
+	return -EIO;
+    }
+    /* version 1 files have nothing to check against */
+    if(key && h->version > 1){
+	if(!key->salted){
+	    return -EACCES;
+	}
+	if(key_check(h, key, check)){
+	    return -EIO;
+	}
+	if(CRYPTO_memcmp(check, h->check, sizeof(check))){
+	    fprintf(stderr, "Block file encrypted with another password\n");
+	    return -EACCES;
+	}
+    }
+    return 0;
+}
+
+extern int blockfile_probe(int fd){
+    char magic[sizeof(((struct blockfile_header*)0)->magic)];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	!memcmp(magic, BLOCKFILE_MAGIC, sizeof(magic));
+}
+
+extern ssize_t blockfile_read(int fd, const struct blockfile_header* h,
+			      const struct blockfile_key* key,
+			      char* buf, size_t size, off_t offset){
+    uint64_t first;
+    size_t count;
+    unsigned char* plain;
+    int ret;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+    if((uint64_t)offset >= h->size || size == 0){
+	return 0;
+    }
+    if(size > h->size - offset){
+	size = h->size - offset;
+    }
+
+    first = offset / BLOCKFILE_BLOCK_SIZE;
+    count = (offset + size - 1) / BLOCKFILE_BLOCK_SIZE - first + 1;
+    plain = malloc(count * BLOCKFILE_BLOCK_SIZE);
+    if(!plain){
+	return -ENOMEM;
+    }
+    ret = blockfile_read_blocks(fd, h, key, first, count, plain);
+    if(ret == 0){
+	memcpy(buf, plain + offset % BLOCKFILE_BLOCK_SIZE, size);
+    }
+    free(plain);
+    return ret ? ret : (ssize_t)size;
+}
+
+extern ssize_t blockfile_write(int fd, struct blockfile_header* h,
+			       const struct blockfile_key* key,
+			       const char* buf, size_t size, off_t offset){
+    uint64_t first;
+    uint64_t last;
+    size_t count;
+    size_t head;
+    unsigned char* plain;
+    int ret = 0;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+    if(size == 0){
+	return 0;
+    }
+
+    first = offset / BLOCKFILE_BLOCK_SIZE;
+    last = (offset + size - 1) / BLOCKFILE_BLOCK_SIZE;
+    count = last - first + 1;
+    head = offset % BLOCKFILE_BLOCK_SIZE;
+    plain = malloc(count * BLOCKFILE_BLOCK_SIZE);
+    if(!plain){
+	return -ENOMEM;
+    }
+
+    /* Blocks the write only partly covers keep the rest of their bytes */
+    if(head){
+	ret = load_block(fd, h, key, first, plain);
+    }
+    if(ret == 0 && (offset + size) % BLOCKFILE_BLOCK_SIZE && (last != first || !head)){
+	ret = load_block(fd, h, key, last, plain + (count - 1) * BLOCKFILE_BLOCK_SIZE);
+    }
+    if(ret == 0){
+	memcpy(plain + head, buf, size);
+	ret = blockfile_write_blocks(fd, h, key, first, count, plain);
+    }
+    if(ret == 0 && offset + size > h->size){
+	h->size = offset + size;
+	ret = blockfile_store_size(fd, h);
+    }
+    free(plain);
+    return ret ? ret : (ssize_t)size;
+}
+
+/* blockfile_truncate() of a compressed file */
+static int truncate_chunks(int fd, struct blockfile_header* h,
+			   const struct blockfile_key* key, off_t size){
+    uint64_t c = size / CHUNK_SIZE;
+    off_t end = chunk_pos(c);
+    int ret;
+
+    if((uint64_t)size >= h->size){
+	h->size = size;
+	return blockfile_store_size(fd, h);
+    }
+
+    /* The chunk the file now ends in is stored again without what is cut
+     * off it, and later chunks of its group unmapped, so growing the file
+     * again reads zeros there */
+    if(size % CHUNK_SIZE){
+	unsigned char* plain = malloc(CHUNK_SIZE);
+
+	if(!plain){
+	    return -ENOMEM;
+	}
+	ret = load_chunk(fd, h, key, c, plain);
+	if(ret == 0){
+	    memset(plain + size % CHUNK_SIZE, 0, CHUNK_SIZE - size % CHUNK_SIZE);
+	    ret = store_chunk(fd, h, key, c, plain, block_count((uint64_t)size) - c * CHUNK_BLOCKS);
+	}
+	free(plain);
+	if(ret < 0){
+	    return ret;
+	}
+	end += (off_t)ret * BLOCKFILE_BLOCK_SIZE;
+	c++;
+    }
+    else if(c % GROUP_CHUNKS == 0){
+	end = map_pos(c);	/* the whole group goes */
+    }
+
+    /* Cut the slots off before unmapping them, so a crash in between
+     * leaves compressed entries over holes, which read as torn, rather
+     * than raw ones over compressed data */
+    if(ftruncate(fd, end) == -1){
+	return -errno;
+    }
+    if(c % GROUP_CHUNKS){
+	static const uint32_t unmapped[GROUP_CHUNKS];
+
+	ret = write_full(fd, (const unsigned char*)unmapped,
+			 (GROUP_CHUNKS - c % GROUP_CHUNKS) * sizeof(uint32_t), map_pos(c));
+	if(ret){
+	    return ret;
+	}
+    }
+    h->size = size;
+    return blockfile_store_size(fd, h);
+}
+
+extern int blockfile_truncate(int fd, struct blockfile_header* h,
+			      const struct blockfile_key* key, off_t size){
+    int ret;
+
+    if(size < 0){
+	return -EINVAL;
+    }
+    if(is_compressed(h)){
+	return truncate_chunks(fd, h, key, size);
+    }
+
+    /* Zero what is cut off the new last block, so growing the file
+     * again reads zeros there */
+    if((uint64_t)size < h->size && size % BLOCKFILE_BLOCK_SIZE){
+	unsigned char plain[BLOCKFILE_BLOCK_SIZE];
+	uint64_t n = size / BLOCKFILE_BLOCK_SIZE;
+
+	ret = blockfile_read_blocks(fd, h, key, n, 1, plain);
+	if(ret){
+	    return ret;
+	}
+	memset(plain + size % BLOCKFILE_BLOCK_SIZE, 0,
+	       BLOCKFILE_BLOCK_SIZE - size % BLOCKFILE_BLOCK_SIZE);
+	ret = blockfile_write_blocks(fd, h, key, n, 1, plain);
+	if(ret){
+	    return ret;
+	}
+    }
+
+    if(ftruncate(fd, block_pos(block_count((uint64_t)size))) == -1){
+	return -errno;
+    }
+    h->size = size;
+    return blockfile_store_size(fd, h);
+}
+
+/* Copy every xattr of from to to, best effort */
+static void copy_xattrs(int from, int to){
+    char names[4096];
+    char value[4096];
+    ssize_t len = flistxattr(from, names, sizeof(names));
+
+    for(char* name = names; len > 0 && name < names + len; name += strlen(name) + 1){
+	ssize_t vlen = fgetxattr(from, name, value, sizeof(value));
+	if(vlen >= 0){
+	    fsetxattr(to, name, value, vlen, 0);
+	}
+    }
+}
+
+/* Encrypt the whole blocks at the front of the size bytes of plain into fd
+ * at offset, then move what is left of plain to its front
+ * Return: Bytes left in plain, or a negative errno
+ */
+static ssize_t migrate_blocks(int fd, struct blockfile_header* h,
+			      const struct blockfile_key* key,
+			      unsigned char* plain, size_t size, off_t offset){
+    size_t whole = size / BLOCKFILE_BLOCK_SIZE * BLOCKFILE_BLOCK_SIZE;
+    ssize_t n;
+
+    if(whole == 0){
+	return size;
+    }
+    n = blockfile_write(fd, h, key, (const char*)plain, whole, offset);
+    if(n < 0){
+	return n;
+    }
+    memmove(plain, plain + whole, size - whole);
+    return size - whole;
+}
+
+/* Give the new file for name a temporary name beside it, in tmp_name: link
+ * fd, made with O_TMPFILE, there, or create it there if fd is -1. Names
+ * that exist already are skipped, never replaced.
+ * Return: The file's fd, or a negative errno
+ */
+static int migrate_temp(int dirfd, const char* name, int fd, mode_t mode,
+			char* tmp_name){
+    char link[64];
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    for(;;){
+	if(snprintf(tmp_name, PATH_MAX, "%s%s.%d.%u", name, MIGRATE_SUFFIX, (int)getpid(),
+		    __atomic_fetch_add(&migrate_seq, 1, __ATOMIC_RELAXED)) >= PATH_MAX){
+	    tmp_name[0] = '\0';
+	    return -ENAMETOOLONG;
+	}
+	if(fd != -1 ? linkat(AT_FDCWD, link, dirfd, tmp_name, AT_SYMLINK_FOLLOW) == 0 :
+	   (fd = openat(dirfd, tmp_name, O_CREAT | O_EXCL | O_RDWR, mode)) != -1){
+	    return fd;
+	}
+	if(errno != EEXIST){
+	    int ret = -errno;
+
+	    tmp_name[0] = '\0';	/* not ours to remove */
+	    return ret;
+	}
+    }
+}
+
+extern int blockfile_migrate(int dirfd, const char* name,
+			     const struct blockfile_key* key){
+    char tmp_name[PATH_MAX];
+    struct blockfile_header h;
+    struct aes_stream stream;
+    struct stat st;
+    unsigned char* cipher = NULL;
+    unsigned char* plain = NULL;
+    size_t have = 0;		/* plaintext in plain, not written yet */
+    off_t done = 0;		/* plaintext written */
+    int in;
+    int fd = -1;
+    int ret = 0;
+
+    tmp_name[0] = '\0';
+    pthread_mutex_lock(&migrate_lock);
+    in = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+    if(in == -1){
+	pthread_mutex_unlock(&migrate_lock);
+	return -errno;
+    }
+    if(fstat(in, &st) == -1){
+	ret = -errno;
+	goto out;
+    }
+    if(blockfile_probe(in)){
+	/* converted by another caller while this one waited */
+	goto out;
+    }
+
+    /* Written unnamed and only named once complete, so a crash leaves
+     * nothing behind; without O_TMPFILE it is made under a temporary name */
+    fd = openat(dirfd, ".", O_TMPFILE | O_RDWR, st.st_mode & 07777);
+    if(fd == -1){
+	fd = migrate_temp(dirfd, name, -1, st.st_mode & 07777, tmp_name);
+	if(fd < 0){
+	    ret = fd;
+	    fd = -1;
+	    goto out;
+	}
+    }
+    if(fchown(fd, st.st_uid, st.st_gid) == -1){
+	/* only matters when eFUSE runs as root */
+    }
+    copy_xattrs(in, fd);
+
+    ret = blockfile_create(fd, &h, key, 0);
+    cipher = malloc(MIGRATE_BLOCKS * BLOCKFILE_BLOCK_SIZE);
+    /* room for a partial block left over and a cipher block held back */
+    plain = malloc((MIGRATE_BLOCKS + 1) * BLOCKFILE_BLOCK_SIZE + EVP_MAX_BLOCK_LENGTH);
+    if(ret == 0 && (!cipher || !plain)){
+	ret = -ENOMEM;
+    }
+
+    /* Decrypt the old file straight into the new one; an empty one has
+     * never been written */
+    if(ret == 0 && st.st_size > 0){
+	int outlen;
+
+	if(!aes_stream_init(&stream, &key->legacy, DECRYPT)){
+	    ret = -EIO;
+	}
+	for(off_t off = 0; ret == 0; ){
+	    ssize_t n = pread(in, cipher, MIGRATE_BLOCKS * BLOCKFILE_BLOCK_SIZE, off);
+	    if(n < 0 && errno == EINTR){
+		continue;
+	    }
+	    if(n <= 0){
+		ret = n < 0 ? -errno : 0;
+		break;
+	    }
+	    off += n;
+	    if(!aes_stream_update(&stream, cipher, n, plain + have, &outlen)){
+		ret = -EIO;
+		break;
+	    }
+	    have += outlen;
+	    n = migrate_blocks(fd, &h, key, plain, have, done);
+	    if(n < 0){
+		ret = n;
+		break;
+	    }
+	    done += have - n;
+	    have = n;
+	}
+	if(ret == 0){
+	    if(aes_stream_final(&stream, plain + have, &outlen)){
+		have += outlen;
+	    }
+	    else{
+		ret = -EIO;
+	    }
+	}
+	else{
+	    aes_stream_free(&stream);
+	}
+	if(ret == -EIO){
+	    fprintf(stderr, "Could not decrypt %s for migration\n", name);
+	}
+	if(ret == 0 && have > 0){
+	    ssize_t n = blockfile_write(fd, &h, key, (const char*)plain, have, done);
+	    ret = n < 0 ? n : 0;
+	}
+    }
+
+    if(ret == 0 && fsync(fd) == -1){
+	ret = -errno;
+    }
+    if(ret == 0 && !tmp_name[0]){
+	int linked = migrate_temp(dirfd, name, fd, 0, tmp_name);
+	ret = linked < 0 ? linked : 0;
+    }
+    if(ret == 0 && renameat(dirfd, tmp_name, dirfd, name) == -1){
+	ret = -errno;
+    }
+
+ out:
+    if(fd != -1){
+	close(fd);
+	if(ret && tmp_name[0]){
+	    unlinkat(dirfd, tmp_name, 0);
+	}
+    }
+    free(cipher);
+    free(plain);
+    close(in);
+    pthread_mutex_unlock(&migrate_lock);
+    return ret;
+}
+
+extern void blockfile_get_stats(struct blockfile_stats* out){
+    out->compressed = __atomic_load_n(&stats.compressed, __ATOMIC_RELAXED);
+    out->raw = __atomic_load_n(&stats.raw, __ATOMIC_RELAXED);
+    out->plain_bytes = __atomic_load_n(&stats.plain_bytes, __ATOMIC_RELAXED);
+    out->stored_bytes = __atomic_load_n(&stats.stored_bytes, __ATOMIC_RELAXED);
+}
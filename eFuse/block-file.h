@@ -0,0 +1,217 @@
+/* block-file.h
+ * Random access encrypted file format for eFUSE
+ *
+ * An encrypted mirror file is a BLOCKFILE_HEADER_SIZE header followed by the
+ * plaintext in BLOCKFILE_BLOCK_SIZE blocks, each encrypted on its own with
+ * AES-256-XTS. Block n is encrypted with the file's random nonce, n xored
+ * into its first 8 bytes, as the XTS tweak, so a read or write only has to
+ * decrypt or encrypt the blocks it touches.
+ *
+ * The last block is zero padded to a whole block and the header records the
+ * plaintext size, so it can be known without decrypting anything. The
+ * header's magic also tells block files apart from plaintext ones on mirrors
+ * without the user.encrypted xattr. A block that is all zero bytes on disk
+ * is a hole and reads as zeros, so extending a file never has to write the
+ * gap.
+ *
+ * Files created with BLOCKFILE_COMPRESSED compress the plaintext
+ * with zlib before encrypting it, 64K chunks of 16 blocks at a time: a single
+ * block could not take less than a block of the mirror's disk. Groups of 1024
+ * chunk slots of 64K each follow a map block holding, for each chunk, the
+ * number of blocks it compresses to. A compressed chunk takes the first
+ * blocks of its slot, encrypted as blocks 16c, 16c + 1, ... of the file would
+ * be, and the rest of the slot is punched out of the mirror. Its exact
+ * length is kept in front of the compressed data, inside the encryption. A
+ * chunk that does not save a block is stored raw, as in uncompressed files,
+ * with 0 in the map. The map is not encrypted; it tells no more than the
+ * holes in the mirror would. A chunk whose map entry and slot a crash left
+ * out of step reads as an error, not as garbage.
+ *
+ * The block key is derived from the mount password with a random salt kept
+ * in the mirror's root, in BLOCKFILE_SALT_NAME, and the header holds an HMAC
+ * of the nonce under it, so opening a file with the wrong password fails
+ * instead of decrypting it to garbage. Version 1 files, written before the
+ * salt and the check existed, have no check and use a key derived with a
+ * salt every mirror shares.
+ *
+ * Files written by earlier versions of eFUSE, one CBC stream over the whole
+ * file, are converted with blockfile_migrate().
+ *
+ * Unless noted otherwise functions return 0 or a negative errno, as FUSE
+ * operations do.
+ *
+ */
+
+#ifndef BLOCK_FILE_H
+#define BLOCK_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+
+#define BLOCKFILE_MAGIC "eFUSEblk"
+#define BLOCKFILE_VERSION 2	/* 1: no key check, fixed salt, no flags */
+#define BLOCKFILE_AES_256_XTS 1	/* cipher ids */
+
+#define BLOCKFILE_COMPRESSED 0x1	/* header flags */
+
+#define BLOCKFILE_BLOCK_SIZE 4096
+#define BLOCKFILE_HEADER_SIZE 4096	/* keeps blocks page aligned in the mirror */
+
+#define BLOCKFILE_SALT_NAME ".efuse-salt"	/* in the mirror's root */
+#define BLOCKFILE_SALT_SIZE 16
+#define BLOCKFILE_CHECK_SIZE 32
+
+/* On disk header, in host byte order */
+struct blockfile_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t cipher;
+    uint32_t block_size;
+    uint32_t flags;
+    uint64_t size;		/* plaintext bytes */
+    unsigned char nonce[16];
+    unsigned char check[BLOCKFILE_CHECK_SIZE];	/* HMAC-SHA256 of the nonce, version 2 */
+};
+
+/* Keys derived from the mount password, once */
+struct blockfile_key{
+    struct aes_xts_key xts;	/* blocks, with the mirror's salt */
+    struct aes_xts_key xts_v1;	/* blocks of version 1 files */
+    struct aes_cbc_key legacy;	/* whole-file CBC files, for migration */
+    int salted;			/* xts is set */
+};
+
+/* int blockfile_salt(const char* mirror, unsigned char* salt)
+ * Purpose: Read the BLOCKFILE_SALT_SIZE byte salt of the mirror rooted at
+ *          mirror, making a random one if it has none yet
+ * Return: 0, -EIO if the salt file is damaged, or a negative errno
+ */
+extern int blockfile_salt(const char* mirror, unsigned char* salt);
+
+/* int blockfile_key_derive(struct blockfile_key* key, const char* password,
+ *                          const unsigned char* salt)
+ * Purpose: Derive the block keys (PBKDF2-HMAC-SHA256) and the key of files
+ *          written by earlier versions from the mount password; with salt
+ *          NULL only version 1 and whole-file CBC files can be read
+ * Return: 0, or -EINVAL if OpenSSL fails
+ */
+extern int blockfile_key_derive(struct blockfile_key* key, const char* password,
+				const unsigned char* salt);
+
+/* Compression of the chunks written since mount */
+struct blockfile_stats{
+    uint64_t compressed;	/* chunks stored compressed */
+    uint64_t raw;		/* chunks stored raw */
+    uint64_t plain_bytes;	/* bytes of the blocks they hold */
+    uint64_t stored_bytes;	/* bytes they take in the mirror */
+};
+
+/* int blockfile_create(int fd, struct blockfile_header* h,
+ *                      const struct blockfile_key* key, uint32_t flags)
+ * Purpose: Write a new header with a fresh nonce, its key check and flags,
+ *          0 or BLOCKFILE_COMPRESSED, to the empty file fd
+ * Return: 0, -EACCES if key has no salted key, or a negative errno
+ */
+extern int blockfile_create(int fd, struct blockfile_header* h,
+			    const struct blockfile_key* key, uint32_t flags);
+
+/* int blockfile_load(int fd, struct blockfile_header* h,
+ *                    const struct blockfile_key* key)
+ * Purpose: Read and check the header of fd and, unless key is NULL, that it
+ *          was written with key
+ * Return: 0, -EINVAL if fd does not start with BLOCKFILE_MAGIC (a whole-file
+ *         CBC file), -EIO if the header is from an unsupported version,
+ *         -EACCES if the file was encrypted with another key
+ */
+extern int blockfile_load(int fd, struct blockfile_header* h,
+			  const struct blockfile_key* key);
+
+/* int blockfile_probe(int fd)
+ * Purpose: Check whether fd starts with BLOCKFILE_MAGIC, without checking
+ *          the rest of the header
+ * Return: 1 if it does, 0 if not or if it cannot be read
+ */
+extern int blockfile_probe(int fd);
+
+/* Size of the uncompressed mirror file holding size plaintext bytes */
+#define BLOCKFILE_DISK_SIZE(size) \
+    (BLOCKFILE_HEADER_SIZE + ((size) + BLOCKFILE_BLOCK_SIZE - 1) / BLOCKFILE_BLOCK_SIZE * BLOCKFILE_BLOCK_SIZE)
+
+/* int blockfile_store_size(int fd, const struct blockfile_header* h)
+ * Purpose: Write h->size to the header of fd
+ */
+extern int blockfile_store_size(int fd, const struct blockfile_header* h);
+
+/* int blockfile_read_blocks(int fd, const struct blockfile_header* h,
+ *                           const struct blockfile_key* key, uint64_t first,
+ *                           size_t count, unsigned char* plain)
+ * Purpose: Read and decrypt count whole blocks from block first into plain;
+ *          blocks past the end of the mirror file read as zeros
+ */
+extern int blockfile_read_blocks(int fd, const struct blockfile_header* h,
+				 const struct blockfile_key* key, uint64_t first,
+				 size_t count, unsigned char* plain);
+
+/* int blockfile_write_blocks(int fd, const struct blockfile_header* h,
+ *                            const struct blockfile_key* key, uint64_t first,
+ *                            size_t count, const unsigned char* plain)
+ * Purpose: Encrypt count whole blocks of plain and write them from block
+ *          first; h->size is not changed
+ */
+extern int blockfile_write_blocks(int fd, const struct blockfile_header* h,
+				  const struct blockfile_key* key, uint64_t first,
+				  size_t count, const unsigned char* plain);
+
+/* As blockfile_write_blocks(), with block first + i at blocks[i] */
+extern int blockfile_write_blockv(int fd, const struct blockfile_header* h,
+				  const struct blockfile_key* key, uint64_t first,
+				  size_t count, const unsigned char* const* blocks);
+
+/* ssize_t blockfile_read(int fd, const struct blockfile_header* h,
+ *                        const struct blockfile_key* key,
+ *                        char* buf, size_t size, off_t offset)
+ * Purpose: Decrypt up to size plaintext bytes at offset into buf
+ * Return: Bytes read, short at the end of the file, or a negative errno
+ */
+extern ssize_t blockfile_read(int fd, const struct blockfile_header* h,
+			      const struct blockfile_key* key,
+			      char* buf, size_t size, off_t offset);
+
+/* ssize_t blockfile_write(int fd, struct blockfile_header* h,
+ *                         const struct blockfile_key* key,
+ *                         const char* buf, size_t size, off_t offset)
+ * Purpose: Encrypt size bytes of buf into the file at offset, re-encrypting
+ *          only the blocks they overlap, and grow h->size if they extend it
+ * Return: size, or a negative errno
+ */
+extern ssize_t blockfile_write(int fd, struct blockfile_header* h,
+			       const struct blockfile_key* key,
+			       const char* buf, size_t size, off_t offset);
+
+/* int blockfile_truncate(int fd, struct blockfile_header* h,
+ *                        const struct blockfile_key* key, off_t size)
+ * Purpose: Set the plaintext size of fd; growing it leaves a hole
+ */
+extern int blockfile_truncate(int fd, struct blockfile_header* h,
+			      const struct blockfile_key* key, off_t size);
+
+/* int blockfile_migrate(int dirfd, const char* name,
+ *                       const struct blockfile_key* key)
+ * Purpose: Convert the whole-file CBC file name in the directory dirfd,
+ *          encrypted by do_crypt() with the mount password, to the block
+ *          format. The new file is written unnamed (O_TMPFILE) with the
+ *          same mode, owner and xattrs, linked beside it under an unused
+ *          temporary name and renamed over it, so it is untouched if this
+ *          fails. Migrations are serialized: a file another call converted
+ *          meanwhile is left alone.
+ * Return: 0 or a negative errno
+ */
+extern int blockfile_migrate(int dirfd, const char* name,
+			     const struct blockfile_key* key);
+
+extern void blockfile_get_stats(struct blockfile_stats* stats);
+
+#endif
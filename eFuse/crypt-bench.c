@@ -0,0 +1,168 @@
+/* crypt-bench.c
+ * Latency of large block file reads and writes, with and without the
+ * crypto pool
+ *
+ * Usage: ./crypt-bench [directory [threads [repeats]]]
+ *
+ * Writes and reads a block file in directory (default /tmp) in requests of
+ * 1M to 16M, once ciphering in the calling thread only and once split
+ * across threads (default: CPUs, at most CRYPTPOOL_MAX_THREADS), and prints
+ * the mean latency of each request size. The file stays in the page cache,
+ * so the numbers are mostly ciphering. It then does the same in 16M requests
+ * with a compressed block file holding log-like text, and prints how much of
+ * the disk it takes.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block-file.h"
+#include "crypt-pool.h"
+
+#define MAX_REQUEST (16 << 20)
+
+static const size_t sizes[] = {1 << 20, 4 << 20, 16 << 20};
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Mean seconds per request of size bytes over repeats requests */
+static double run(int fd, struct blockfile_header* h, const struct blockfile_key* key,
+		  unsigned char* buf, size_t size, int repeats, int write){
+    size_t count = size / BLOCKFILE_BLOCK_SIZE;
+    double start = now();
+
+    for(int i = 0; i < repeats; i++){
+	int ret = write ? blockfile_write_blocks(fd, h, key, 0, count, buf)
+			: blockfile_read_blocks(fd, h, key, 0, count, buf);
+	if(ret){
+	    fprintf(stderr, "%s: %s\n", write ? "write" : "read", strerror(-ret));
+	    exit(1);
+	}
+    }
+    return (now() - start) / repeats;
+}
+
+/* Fill buf with size bytes of text resembling a server log */
+static void fill_log(unsigned char* buf, size_t size){
+    static const char* const paths[] = {"/", "/index.html", "/api/v1/items", "/static/app.js"};
+    size_t used = 0;
+    unsigned int seed = 1;
+
+    for(int i = 0; used < size; i++){
+	char line[160];
+	int n = snprintf(line, sizeof(line),
+			 "2024-05-%02d 12:%02d:%02d.%03d INFO request id=%08x path=%s status=%d bytes=%u\n",
+			 i / 86400 % 28 + 1, i / 60 % 60, i % 60, rand_r(&seed) % 1000,
+			 rand_r(&seed), paths[rand_r(&seed) % 4], rand_r(&seed) % 8 ? 200 : 404,
+			 rand_r(&seed) % 65536);
+
+	if((size_t)n > size - used){
+	    n = size - used;
+	}
+	memcpy(buf + used, line, n);
+	used += n;
+    }
+}
+
+int main(int argc, char* argv[]){
+    const char* dir = argc > 1 ? argv[1] : "/tmp";
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = argc > 2 ? (unsigned int)atoi(argv[2]) :
+	cpus > CRYPTPOOL_MAX_THREADS ? CRYPTPOOL_MAX_THREADS : cpus > 0 ? (unsigned int)cpus : 1;
+    int repeats = argc > 3 ? atoi(argv[3]) : 20;
+    char path[PATH_MAX];
+    struct blockfile_header h;
+    struct blockfile_key key;
+    double latency[2][2][sizeof(sizes) / sizeof(*sizes)];
+    double packed[2];
+    struct stat st;
+    unsigned char* buf;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/crypt-bench.XXXXXX", dir);
+    fd = mkstemp(path);
+    if(fd == -1){
+	perror(path);
+	return 1;
+    }
+    unlink(path);
+
+    buf = malloc(MAX_REQUEST);
+    if(!buf || blockfile_key_derive(&key, "crypt-bench", (const unsigned char*)"crypt-bench salt") ||
+       blockfile_create(fd, &h, &key, 0)){
+	fprintf(stderr, "Setup failed\n");
+	return 1;
+    }
+    for(size_t i = 0; i < MAX_REQUEST; i++){
+	buf[i] = i * 7;
+    }
+    /* fault in the file and the buffer */
+    run(fd, &h, &key, buf, MAX_REQUEST, 1, 1);
+
+    for(int pooled = 0; pooled < 2; pooled++){
+	if(cryptpool_init(pooled ? threads : 1, 0) != 0){
+	    fprintf(stderr, "Could not start %u threads\n", threads);
+	    return 1;
+	}
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++){
+	    latency[pooled][0][s] = run(fd, &h, &key, buf, sizes[s], repeats, 1);
+	    latency[pooled][1][s] = run(fd, &h, &key, buf, sizes[s], repeats, 0);
+	}
+	cryptpool_destroy();
+    }
+
+    /* compressed, with the pool */
+    close(fd);
+    snprintf(path, sizeof(path), "%s/crypt-bench.XXXXXX", dir);
+    fd = mkstemp(path);
+    if(fd == -1){
+	perror(path);
+	return 1;
+    }
+    unlink(path);
+    fill_log(buf, MAX_REQUEST);
+    if(blockfile_create(fd, &h, &key, BLOCKFILE_COMPRESSED) || cryptpool_init(threads, 0) != 0){
+	fprintf(stderr, "Setup failed\n");
+	return 1;
+    }
+    run(fd, &h, &key, buf, MAX_REQUEST, 1, 1);
+    packed[0] = run(fd, &h, &key, buf, MAX_REQUEST, repeats, 1);
+    packed[1] = run(fd, &h, &key, buf, MAX_REQUEST, repeats, 0);
+    cryptpool_destroy();
+    if(fstat(fd, &st) == -1){
+	perror("fstat");
+	return 1;
+    }
+
+    printf("%u threads, %d requests each, mean latency in ms\n", threads, repeats);
+    printf("%8s %10s %10s %8s %10s %10s %8s\n", "request",
+	   "write 1", "write N", "speedup", "read 1", "read N", "speedup");
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++){
+	printf("%7zuM %10.2f %10.2f %7.2fx %10.2f %10.2f %7.2fx\n", sizes[s] >> 20,
+	       latency[0][0][s] * 1e3, latency[1][0][s] * 1e3,
+	       latency[0][0][s] / latency[1][0][s],
+	       latency[0][1][s] * 1e3, latency[1][1][s] * 1e3,
+	       latency[0][1][s] / latency[1][1][s]);
+    }
+
+    printf("compressed %2zuM: write %.2f, read %.2f, %lld bytes on disk (%.2fx)\n",
+	   (size_t)MAX_REQUEST >> 20, packed[0] * 1e3, packed[1] * 1e3,
+	   (long long)st.st_blocks * 512, (double)MAX_REQUEST / (st.st_blocks * 512));
+
+    close(fd);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/* crypt-pool.c
+ * Worker threads that share the ciphering of large requests for eFUSE
+ *
+ * See crypt-pool.h. Split requests wait in a queue under pool.lock; workers
+ * take ranges from the job at its head, and the caller takes ranges from
+ * its own job until none are left, so a job finishes even when every
+ * worker is busy with others.
+ *
+ */
+
+#include "crypt-pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define CHUNKS_PER_THREAD 2	/* ranges per thread, to even out slow ones */
+
+struct job{
+    int (*fn)(void* arg, size_t first, size_t n);
+    void* arg;
+    size_t count;
+    size_t chunk;		/* units per range */
+    size_t next;		/* first unit not handed out */
+    size_t running;		/* ranges handed out and not finished */
+    int ret;
+    struct job* next_job;
+    pthread_cond_t done;
+};
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct job* head;
+    pthread_t* threads;
+    unsigned int nthreads;	/* workers */
+    size_t min_bytes;
+    int stop;
+    uint64_t parallel;
+    uint64_t serial;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+};
+
+/* Take the next range of job, taking job off the queue with its last one
+ * Return: 1 with the range in first and n, 0 if job has none left
+ */
+static int take_range(struct job* job, size_t* first, size_t* n){
+    if(job->next == job->count){
+	return 0;
+    }
+    *first = job->next;
+    *n = job->count - job->next < job->chunk ? job->count - job->next : job->chunk;
+    job->next += *n;
+    job->running++;
+
+    if(job->next == job->count){
+	for(struct job** p = &pool.head; *p; p = &(*p)->next_job){
+	    if(*p == job){
+		*p = job->next_job;
+		break;
+	    }
+	}
+    }
+    return 1;
+}
+
+/* Run a range of job taken with take_range(); called and returns with
+ * pool.lock held */
+static void run_range(struct job* job, size_t first, size_t n){
+    int ret;
+
+    pthread_mutex_unlock(&pool.lock);
+    ret = job->fn(job->arg, first, n);
+    pthread_mutex_lock(&pool.lock);
+
+    if(ret && !job->ret){
+	job->ret = ret;
+    }
+    if(--job->running == 0 && job->next == job->count){
+	pthread_cond_signal(&job->done);
+    }
+}
+
+static void* worker(void* arg){
+    size_t first;
+    size_t n;
+
+    (void)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while(!pool.stop){
+	if(!pool.head){
+	    pthread_cond_wait(&pool.work, &pool.lock);
+	    continue;
+	}
+	/* the head job stays valid while it has a range running */
+	struct job* job = pool.head;
+	if(take_range(job, &first, &n)){
+	    run_range(job, first, n);
+	}
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+extern int cryptpool_init(unsigned int threads, size_t min_bytes){
+    if(threads > CRYPTPOOL_MAX_THREADS){
+	threads = CRYPTPOOL_MAX_THREADS;
+    }
+    pool.min_bytes = min_bytes;
+    pool.stop = 0;
+    if(threads <= 1){
+	return 0;
+    }
+
+    pool.threads = calloc(threads - 1, sizeof(*pool.threads));
+    if(!pool.threads){
+	return -ENOMEM;
+    }
+    for(unsigned int i = 0; i < threads - 1; i++){
+	int ret = pthread_create(&pool.threads[i], NULL, worker, NULL);
+	if(ret){
+	    /* make do with the ones that started */
+	    if(i == 0){
+		free(pool.threads);
+		pool.threads = NULL;
+		return -ret;
+	    }
+	    break;
+	}
+	pool.nthreads++;
+    }
+    return 0;
+}
+
+extern void cryptpool_destroy(void){
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(unsigned int i = 0; i < pool.nthreads; i++){
+	pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.nthreads = 0;
+}
+
+extern int cryptpool_run(size_t count, size_t unit_bytes,
+			 int (*fn)(void* arg, size_t first, size_t n), void* arg){
+    struct job job;
+    size_t pieces;
+    size_t first;
+    size_t n;
+
+    if(pool.nthreads == 0 || count < 2 || count * unit_bytes < pool.min_bytes){
+	__atomic_add_fetch(&pool.serial, 1, __ATOMIC_RELAXED);
+	return fn(arg, 0, count);
+    }
+
+    pieces = (size_t)(pool.nthreads + 1) * CHUNKS_PER_THREAD;
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.chunk = (count + pieces - 1) / pieces;
+    job.next = 0;
+    job.running = 0;
+    job.ret = 0;
+    job.next_job = NULL;
+    pthread_cond_init(&job.done, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    {
+	struct job** p = &pool.head;
+	while(*p){
+	    p = &(*p)->next_job;
+	}
+	*p = &job;
+    }
+    pthread_cond_broadcast(&pool.work);
+    pool.parallel++;
+
+    while(take_range(&job, &first, &n)){
+	run_range(&job, first, n);
+    }
+    while(job.running > 0){
+	pthread_cond_wait(&job.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_cond_destroy(&job.done);
+    return job.ret;
+}
+
+extern void cryptpool_get_stats(struct cryptpool_stats* stats){
+    pthread_mutex_lock(&pool.lock);
+    stats->parallel = pool.parallel;
+    stats->serial = __atomic_load_n(&pool.serial, __ATOMIC_RELAXED);
+    stats->threads = pool.nthreads ? pool.nthreads + 1 : 1;
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,51 @@
+/* crypt-pool.h
+ * Worker threads that share the ciphering of large requests for eFUSE
+ *
+ * Blocks of the block format are ciphered independently, so a request over
+ * many blocks can be split into ranges and ciphered on several cores. A
+ * request of at least the pool's threshold is split into ranges that the
+ * workers and the calling thread take in turn; smaller ones, or all of them
+ * when the pool is off, run in the calling thread alone. Every thread keeps
+ * its own cipher contexts (aes-crypt.h).
+ *
+ */
+
+#ifndef CRYPT_POOL_H
+#define CRYPT_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRYPTPOOL_MAX_THREADS 64
+#define CRYPTPOOL_DEFAULT_THREADS 8	/* at most; fewer on smaller machines */
+#define CRYPTPOOL_DEFAULT_MIN_KB 256
+
+struct cryptpool_stats{
+    uint64_t parallel;		/* requests split across threads */
+    uint64_t serial;		/* requests run by their caller alone */
+    unsigned int threads;	/* threads ciphering a split request */
+};
+
+/* int cryptpool_init(unsigned int threads, size_t min_bytes)
+ * Purpose: Start threads - 1 workers, so that with the calling thread
+ *          threads cipher requests of at least min_bytes; 0 or 1 thread
+ *          turns the pool off. Start it after the process has daemonized.
+ * Return: 0, or a negative errno
+ */
+extern int cryptpool_init(unsigned int threads, size_t min_bytes);
+
+/* Stop and join the workers */
+extern void cryptpool_destroy(void);
+
+/* int cryptpool_run(size_t count, size_t unit_bytes,
+ *                   int (*fn)(void* arg, size_t first, size_t n), void* arg)
+ * Purpose: Call fn on ranges [first, first + n) covering units [0, count)
+ *          of unit_bytes each, in parallel if the request is large enough
+ * Return: 0, or the first error fn returned
+ */
+extern int cryptpool_run(size_t count, size_t unit_bytes,
+			 int (*fn)(void* arg, size_t first, size_t n), void* arg);
+
+extern void cryptpool_get_stats(struct cryptpool_stats* stats);
+
+#endif
@@ -12,567 +12,1546 @@
 
   gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
 
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
+  Note: eFUSE uses the low level FUSE 3 API. Every mirror inode the kernel
+        knows has a node id in the inode table (inode-table.h) holding an
+        O_PATH fd on it, so operations work relative to that fd with
+        openat(), fstatat() and the like instead of resolving a path from
+        the mirror root each time. Calls that cannot take an O_PATH fd go
+        through its /proc/self/fd link.
+
+        Each open() creates an eFUSE_handle, kept in fi->fh until release(),
+        holding the mirror file and whether it is encrypted, so read(),
+        write() and the fi based calls work on it instead of reopening the
+        file and re-reading its xattr.
+
+        Encrypted files (user.encrypted is "true", or on mirrors without
+        xattrs a block file header) are kept in the block format of
+        block-file.h, so reads and writes only decrypt and encrypt the 4K
+        blocks they touch, and attributes report the plaintext size from the
+        header. Files from before the block format, one CBC stream over the
+        whole file, are converted when they are first looked up, or else
+        when they are opened.
+        Handles on the same encrypted file share an open_file (open-file.h)
+        that buffers writes as plaintext blocks, which a background thread
+        encrypts and writes to the mirror once there are enough of them, and
+        flush(), fsync() and the last release() wait for and finish
+        writing; reads of an open_file run side by side, while
+        writes, truncates and flushes of it take turns, so requests can be
+        served by several threads unless -s is given. Decrypted blocks are
+        kept in a cache shared by the whole mount (block-cache.h); its
+        counters can be read from the user.eFUSE.stats xattr of the mount
+        root and are printed at unmount.
+        Keys are derived from the password once, at mount, with the random
+        salt kept in the mirror's root (hidden from the mount), and all ciphering
+        is on memory buffers (aes-crypt.h), with requests over many blocks
+        split across a pool of crypto threads (crypt-pool.h). Sequential
+        reads of an encrypted file have the blocks ahead of them decrypted
+        into the cache by a background thread (readahead.h); plaintext
+        files are handed to FUSE as the mirror fd, so their data can be
+        splice()d between the mirror and /dev/fuse. Whether a file is
+        encrypted, and its plaintext size, are kept with its inode.
+        With -o compress, new encrypted files are compressed before they
+        are encrypted, 64K at a time (block-file.h).
+
+        The kernel caches attributes and names for attr_timeout and
+        entry_timeout, and keeps file data in its page cache across opens
+        while the mirror file keeps the mtime and size it had when eFUSE
+        last saw it (auto_cache). All writes and truncates through the
+        mount reach the kernel's cache as well; the mirror changing
+        underneath it is only seen at the next open. Directories are read
+        with readdirplus, which looks up each entry as it is listed, so
+        listing a directory with ls -l takes no lookup or getattr per
+        entry. mount-bench measures these options on a mounted eFUSE.
 
 */
 
-#define FUSE_USE_VERSION 28
+#define FUSE_USE_VERSION 31
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
-#ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
-#endif
+/* For O_PATH, AT_EMPTY_PATH and renameat2() */
+#define _GNU_SOURCE
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "aes-crypt.h"	//1 encrypts, 0 decrypts, -1 copies
+#include "block-file.h"
+#include "open-file.h"
+#include "block-cache.h"
+#include "crypt-pool.h"
+#include "readahead.h"
+#include "inode-table.h"
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/xattr.h>
 #include <linux/limits.h>
 
-#define eFUSE_data ((struct eFUSE_state *) fuse_get_context()->private_data)
-#define USAGE "./eFUSE <Encryption Password> <Mirror Root Directory> <Mount Target Directory>\n"
+#define eFUSE_data(req) ((struct eFUSE_state *) fuse_req_userdata(req))
+#define USAGE "./eFUSE <Encryption Password> <Mirror Root Directory> <Mount Target Directory> [FUSE options]\n" \
+              "eFUSE options:\n" \
+              "    -o cache_mb=N   size of the decrypted block cache (default 64, 0 turns it off)\n" \
+              "    -o crypt_threads=N   threads ciphering one large request (default: CPUs, at most 8)\n" \
+              "    -o crypt_parallel_kb=N   smallest request split across them (default 256)\n" \
+              "    -o readahead_kb=N   most of a sequentially read encrypted file decrypted ahead (default 2048, 0 turns it off)\n" \
+              "    -o compress   compress encrypted files created from now on\n" \
+              "    -o nowriteback   encrypt and write out dirty data in the writing thread, not in the background\n" \
+              "    -o xattr_timeout=S   seconds whether a file is encrypted, and its size, are cached (default 1.0)\n" \
+              "    -o attr_timeout=S, entry_timeout=S   seconds the kernel caches attributes and names (default 1.0)\n" \
+              "    -o negative_timeout=S   seconds it caches names that do not exist (default 1.0)\n" \
+              "    -o auto_cache   keep file data in the page cache while the mirror file is unchanged (default)\n" \
+              "    -o noauto_cache   drop it at every open\n" \
+              "    -o kernel_cache   always keep it; only if nothing but this mount changes the mirror\n" \
+              "FUSE options:\n" \
+              "    -f   stay in the foreground\n" \
+              "    -d   debug output, implies -f\n" \
+              "    -s   one thread, instead of one per concurrent request\n"
+
+#define STATS_XATTR "user.eFUSE.stats"
 
 #define ENCRYPT 1
 #define DECRYPT 0
 #define COPY -1
 
+#define DEFAULT_TIMEOUT 1.0
+
 struct eFUSE_state{
     char* mirror_path;
     char* crypt_password;
+    struct blockfile_key key;   // block key, derived from crypt_password at mount
+    unsigned int cache_mb;      // -o cache_mb=
+    unsigned int crypt_threads; // -o crypt_threads=
+    unsigned int crypt_parallel_kb;     // -o crypt_parallel_kb=
+    unsigned int readahead_kb;  // -o readahead_kb=
+    int compress;               // -o compress
+    int writeback;              // -o nowriteback turns it off
+    double xattr_timeout;       // -o xattr_timeout=
+    double attr_timeout;        // -o attr_timeout=
+    double entry_timeout;       // -o entry_timeout=
+    double negative_timeout;    // -o negative_timeout=
+    int auto_cache;             // -o auto_cache, -o noauto_cache
+    int kernel_cache;           // -o kernel_cache
+    int nonopts;                // arguments that were not options, while parsing
+    struct fuse_session* se;    // for notifications to the kernel
 };
 
-static void full_path(const char* path, char nPath[PATH_MAX])
+#define eFUSE_OPT(t, p, v) { t, offsetof(struct eFUSE_state, p), v }
+
+static const struct fuse_opt eFUSE_opts[] = {
+    eFUSE_OPT("cache_mb=%u", cache_mb, 1),
+    eFUSE_OPT("crypt_threads=%u", crypt_threads, 1),
+    eFUSE_OPT("crypt_parallel_kb=%u", crypt_parallel_kb, 1),
+    eFUSE_OPT("readahead_kb=%u", readahead_kb, 1),
+    eFUSE_OPT("compress", compress, 1),
+    eFUSE_OPT("nowriteback", writeback, 0),
+    eFUSE_OPT("xattr_timeout=%lf", xattr_timeout, 1),
+    eFUSE_OPT("attr_timeout=%lf", attr_timeout, 1),
+    // the kernel's attribute cache took over from eFUSE's own
+    eFUSE_OPT("stat_timeout=%lf", attr_timeout, 1),
+    eFUSE_OPT("entry_timeout=%lf", entry_timeout, 1),
+    eFUSE_OPT("negative_timeout=%lf", negative_timeout, 1),
+    eFUSE_OPT("auto_cache", auto_cache, 1),
+    eFUSE_OPT("noauto_cache", auto_cache, 0),
+    eFUSE_OPT("kernel_cache", kernel_cache, 1),
+    FUSE_OPT_END
+};
+
+static struct inode* inode_of(fuse_ino_t ino)
 {
-    strcpy(nPath, eFUSE_data->mirror_path);
-    strncat(nPath, path, PATH_MAX);
+    if(ino == FUSE_ROOT_ID)
+        return inodes_root();
+    return (struct inode *) (uintptr_t) ino;
 }
 
-static int eFUSE_getattr(const char *path, struct stat *stbuf)
+// The /proc/self/fd link of an inode's O_PATH fd, for calls that cannot
+// take the fd itself
+static void proc_path(const struct inode* in, char path[64])
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = lstat(new_path, stbuf);
-	if (res == -1)
-		return -errno;
-    
-	return 0;
+    snprintf(path, 64, "/proc/self/fd/%d", in->fd);
 }
 
-static int eFUSE_access(const char *path, int mask)
+static double now(void)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = access(new_path, mask);
-	if (res == -1)
-		return -errno;
+    struct timespec ts;
 
-	return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static int eFUSE_readlink(const char *path, char *buf, size_t size)
+// Per-open state, kept in fi->fh from open()/create() to release()
+struct eFUSE_handle{
+    int fd;         // mirror file
+    int encrypted;  // is_encrypted() at open
+    int written;    // written or truncated through, so flushing changes the mirror
+    struct open_file* of;   // encrypted files, shared by their handles
+    struct readahead ra;    // encrypted files
+};
+
+#define eFUSE_handle(fi) ((struct eFUSE_handle *) (uintptr_t) (fi)->fh)
+
+// A mirror file is encrypted if user.encrypted is "true", or if it is a
+// block format file on a mirror without xattrs or copied without them
+static int is_encrypted(int fd)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = readlink(new_path, buf, size - 1);
-	if (res == -1)
-		return -errno;
-
-	buf[res] = '\0';
-	return 0;
-}
-
-
-static int eFUSE_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
-{
-	DIR *dp;
-	struct dirent *de;
-    
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    
-	(void) offset;
-	(void) fi;
-
-	dp = opendir(new_path);
-	if (dp == NULL)
-		return -errno;
-
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
-	}
+    char value[8];
+    ssize_t len = fgetxattr(fd, "user.encrypted", value, sizeof(value) - 1);
 
-	closedir(dp);
-	return 0;
+    if(len >= 0){
+        value[len] = '\0';
+        if(!strcmp(value, "true"))
+            return 1;
+    }
+    return blockfile_probe(fd);
 }
 
-static int eFUSE_mknod(const char *path, mode_t mode, dev_t rdev)
+// Reads whether the regular file of in is encrypted and its plaintext size
+// from fd, open on it, or from a new fd if fd is -1; called with in->lock
+// held. Returns -EINVAL for a whole-file CBC file, else 0.
+static int inode_examine(struct inode* in, int fd)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    
-	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
-	   is more portable */
-	if (S_ISREG(mode)) {
-		res = open(new_path, O_CREAT | O_EXCL | O_WRONLY, mode);
-		if (res >= 0)
-			res = close(res);
-	} else if (S_ISFIFO(mode))
-		res = mkfifo(new_path, mode);
-	else
-		res = mknod(new_path, mode, rdev);
-	if (res == -1)
-		return -errno;
-
-	return 0;
-}
-
-static int eFUSE_mkdir(const char *path, mode_t mode)
+    struct blockfile_header header;
+    char path[64];
+    int own = fd == -1;
+    int res = 0;
+
+    if(own){
+        proc_path(in, path);
+        fd = open(path, O_RDONLY);
+        if(fd == -1)
+            return 0;   // unreadable, so unknown
+    }
+
+    in->encrypted = is_encrypted(fd);
+    in->have_size = 0;
+    if(in->encrypted){
+        res = blockfile_load(fd, &header, NULL);
+        if(res == 0){
+            in->have_size = 1;
+            in->size = header.size;
+        }
+    }
+    in->checked = now();
+
+    if(own)
+        close(fd);
+    return res == -EINVAL ? res : 0;
+}
+
+// Whether what in holds about its file is recent; called with in->lock held
+static int inode_known(const struct eFUSE_state* state, const struct inode* in)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = mkdir(new_path, mode);
-	if (res == -1)
-		return -errno;
+    return in->encrypted != -1 && in->checked > 0 &&
+        now() - in->checked < state->xattr_timeout;
+}
 
-	return 0;
+// Makes the next inode_known() of in fail, after eFUSE changed its file
+static void inode_changed(struct inode* in)
+{
+    pthread_mutex_lock(&in->lock);
+    in->checked = 0;
+    pthread_mutex_unlock(&in->lock);
 }
 
-static int eFUSE_unlink(const char *path)
+// Encrypted files report their plaintext size: an open one's, unflushed
+// writes included, or else the one in its header. Returns -EINVAL for a
+// whole-file CBC file, else 0.
+static int plain_size(const struct eFUSE_state* state, struct inode* in,
+                      struct stat* st)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = unlink(new_path);
-	if (res == -1)
-		return -errno;
+    uint64_t size;
+    int res = 0;
+
+    if(!S_ISREG(st->st_mode))
+        return 0;
+    if(openfile_size(st, &size)){
+        st->st_size = size;
+        return 0;
+    }
 
-	return 0;
+    pthread_mutex_lock(&in->lock);
+    if(!inode_known(state, in) || (in->encrypted == 1 && !in->have_size))
+        res = inode_examine(in, -1);
+    if(in->encrypted == 1 && in->have_size)
+        st->st_size = in->size;
+    pthread_mutex_unlock(&in->lock);
+    return res;
 }
 
-static int eFUSE_rmdir(const char *path)
+// Whether name in dir is the mirror's key salt, which is not shown through
+// the mount. The kernel only asks to create or rename over a name it could
+// not look up; everything else it would do to it fails at lookup.
+static int is_hidden(const struct inode* dir, const char* name)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = rmdir(new_path);
-	if (res == -1)
-		return -errno;
+    return dir == inodes_root() && !strcmp(name, BLOCKFILE_SALT_NAME);
+}
+
+// Looks up name in dir and takes a kernel reference to its inode for e;
+// with migrate, a whole-file CBC file is converted to the block format
+// first. One that cannot be converted is still found, and open() tries
+// again.
+static int do_lookup(const struct eFUSE_state* state, struct inode* dir,
+                     const char* name, struct fuse_entry_param* e, int migrate)
+{
+    struct inode* in;
+    int fd;
+    int res;
+
+    if(is_hidden(dir, name))
+        return -ENOENT;
 
-	return 0;
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = state->attr_timeout;
+    e->entry_timeout = state->entry_timeout;
+
+    for(int tries = 0; ; tries++){
+        fd = openat(dir->fd, name, O_PATH | O_NOFOLLOW);
+        if(fd == -1)
+            return -errno;
+        if(fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1){
+            res = -errno;
+            close(fd);
+            return res;
+        }
+        in = inodes_add(fd, &e->attr);
+        if(in == NULL)
+            return -errno;
+
+        res = plain_size(state, in, &e->attr);
+        if(res != -EINVAL || tries > 0 || !migrate)
+            break;
+        res = blockfile_migrate(dir->fd, name, &state->key);
+        if(res != 0){
+            fprintf(stderr, "Could not convert %s at lookup: %s\n", name, strerror(-res));
+            break;
+        }
+        inodes_forget(in, 1);
+    }
+
+    e->ino = (uintptr_t) in;
+    return 0;
 }
 
-static int eFUSE_symlink(const char *from, const char *to)
+// Makes a handle on a block format file encrypted, sharing the file's
+// open_file
+static int handle_attach(const struct eFUSE_state* state, struct eFUSE_handle* fh)
 {
-	int res;
-    char new_tpath[PATH_MAX];
-    full_path(to, new_tpath);
-	res = symlink(from, new_tpath);
-	if (res == -1)
-		return -errno;
+    struct stat st;
 
-	return 0;
+    if(fstat(fh->fd, &st) == -1)
+        return -errno;
+    fh->of = openfile_get(fh->fd, &st, &state->key);
+    if(fh->of == NULL)
+        return -errno;
+    fh->encrypted = 1;
+    readahead_start(&fh->ra, fh->of);
+    return 0;
 }
 
-static int eFUSE_rename(const char *from, const char *to)
+// Converts the whole-file CBC file of in, which lookup did not convert,
+// and replaces *fd, open on it, with an fd on the result. The name comes
+// from the /proc link of in. in is moved to the new file, so its node id
+// stands for it from now on, and the kernel is told to drop what it holds
+// about the old one.
+static int inode_migrate(const struct eFUSE_state* state, struct inode* in, int* fd)
 {
-	int res;
-    char new_fpath[PATH_MAX];
-    char new_tpath[PATH_MAX];
-    full_path(from, new_fpath);
-    full_path(to, new_tpath);
-	res = rename(new_fpath, new_tpath);
-	if (res == -1)
-		return -errno;
+    struct blockfile_header header;
+    struct stat st;
+    struct inode* dir;
+    char link[64];
+    char path[PATH_MAX];
+    char* name;
+    ssize_t len;
+    int dirfd;
+    int newfd = -1;
+    int pathfd = -1;
+    int res;
+
+    proc_path(in, link);
+    len = readlink(link, path, sizeof(path) - 1);
+    if(len == -1)
+        return -errno;
+    path[len] = '\0';
+    name = strrchr(path, '/');
+    if(name == NULL)
+        return -EIO;
+    *name++ = '\0';
+    dirfd = open(path[0] ? path : "/", O_RDONLY | O_DIRECTORY);
+    if(dirfd == -1)
+        return -errno;
+
+    // the name has to still be this file: an unlinked one reads "x (deleted)"
+    if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        res = -errno;
+    else if(st.st_dev != in->dev || st.st_ino != in->ino)
+        res = -ESTALE;
+    else
+        res = blockfile_migrate(dirfd, name, &state->key);
+    if(res == 0){
+        newfd = openat(dirfd, name, (fcntl(*fd, F_GETFL) & O_ACCMODE) | O_NOFOLLOW);
+        pathfd = openat(dirfd, name, O_PATH | O_NOFOLLOW);
+        if(newfd == -1 || pathfd == -1)
+            res = -errno;
+    }
+    if(res == 0 && fstat(pathfd, &st) == -1)
+        res = -errno;
+    if(res == 0)
+        res = blockfile_load(newfd, &header, &state->key);
+    if(res != 0){
+        fprintf(stderr, "Could not convert %s at open: %s\n", name, strerror(-res));
+        if(newfd != -1)
+            close(newfd);
+        if(pathfd != -1)
+            close(pathfd);
+        close(dirfd);
+        inode_changed(in);
+        return res;
+    }
 
-	return 0;
+    close(*fd);
+    *fd = newfd;
+    inodes_move(in, pathfd, &st);
+    inode_changed(in);
+    // attributes of the old file, and the entry that led to it
+    fuse_lowlevel_notify_inval_inode(state->se, (uintptr_t) in, -1, 0);
+    if(fstat(dirfd, &st) == 0 && (dir = inodes_find(&st)) != NULL)
+        fuse_lowlevel_notify_inval_entry(state->se,
+                                         dir == inodes_root() ? FUSE_ROOT_ID : (uintptr_t) dir,
+                                         name, strlen(name));
+    close(dirfd);
+    return 0;
 }
 
-static int eFUSE_link(const char *from, const char *to)
+// Makes a handle on fd, open on the mirror file of in; fd is closed if
+// this fails
+static int handle_make(const struct eFUSE_state* state, struct inode* in,
+                       int fd, struct eFUSE_handle** out)
 {
-	int res;
-    char new_fpath[PATH_MAX];
-    char new_tpath[PATH_MAX];
-    full_path(from, new_fpath);
-    full_path(to, new_tpath);
-	res = link(new_fpath, new_tpath);
-	if (res == -1)
-		return -errno;
+    struct eFUSE_handle* fh;
+    struct blockfile_header header;
+    struct stat st;
+    uint64_t size;
+    int encrypted;
+    int res = 0;
+
+    pthread_mutex_lock(&in->lock);
+    if(!inode_known(state, in))
+        inode_examine(in, fd);
+    encrypted = in->encrypted;
+    // a file already open elsewhere, or with a known size, is known to be
+    // in the block format
+    if(encrypted && !in->have_size &&
+       (fstat(fd, &st) == -1 || !openfile_size(&st, &size)))
+        res = blockfile_load(fd, &header, &state->key);
+    pthread_mutex_unlock(&in->lock);
+
+    if(res == -EINVAL)
+        res = inode_migrate(state, in, &fd);
+    if(res != 0){
+        close(fd);
+        return res;
+    }
 
-	return 0;
+    fh = malloc(sizeof(*fh));
+    if(fh == NULL){
+        close(fd);
+        return -ENOMEM;
+    }
+    fh->fd = fd;
+    fh->encrypted = 0;
+    fh->written = 0;
+    fh->of = NULL;
+    if(encrypted){
+        res = handle_attach(state, fh);
+        if(res != 0){
+            // what was known about the file may be what failed
+            inode_changed(in);
+            close(fd);
+            free(fh);
+            return res;
+        }
+    }
+
+    *out = fh;
+    return 0;
 }
 
-static int eFUSE_chmod(const char *path, mode_t mode)
+// The flags the mirror file behind a handle is opened with. It is always
+// opened readable, as writes read back the blocks they partly cover, and
+// without O_APPEND, as writes land at plaintext offsets; O_TRUNC is done
+// by handle_truncate(), so the header stays.
+static int handle_flags(int flags)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = chmod(new_path, mode);
-	if (res == -1)
-		return -errno;
+    if((flags & O_ACCMODE) == O_WRONLY)
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    return flags & ~(O_APPEND | O_TRUNC | O_CREAT | O_EXCL | O_NOFOLLOW);
+}
+
+// Opens the mirror file of in behind a new handle
+static int handle_open(const struct eFUSE_state* state, struct inode* in,
+                       int flags, struct eFUSE_handle** out)
+{
+    char path[64];
+    int fd;
 
-	return 0;
+    proc_path(in, path);
+    fd = open(path, handle_flags(flags));
+    if(fd == -1)
+        return -errno;
+    return handle_make(state, in, fd, out);
 }
 
-static int eFUSE_chown(const char *path, uid_t uid, gid_t gid)
+static int handle_close(const struct eFUSE_state* state, struct eFUSE_handle* fh)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = lchown(new_path, uid, gid);
-	if (res == -1)
-		return -errno;
+    int res = 0;
 
-	return 0;
+    if(fh->of){
+        readahead_end(&fh->ra);
+        res = openfile_put(fh->of, &state->key);
+    }
+    if(close(fh->fd) == -1 && res == 0)
+        res = -errno;
+    free(fh);
+    return res;
 }
 
-static int eFUSE_truncate(const char *path, off_t size)
+// Truncates the plaintext of an open file to size bytes
+static int handle_truncate(const struct eFUSE_state* state,
+                           struct eFUSE_handle* fh, off_t size)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = truncate(new_path, size);
-	if (res == -1)
-		return -errno;
+    fh->written = 1;
+    if(!fh->encrypted){
+        if(ftruncate(fh->fd, size) == -1)
+            return -errno;
+        return 0;
+    }
 
-	return 0;
+    return openfile_truncate(fh->of, &state->key, size);
 }
 
-static int eFUSE_utimens(const char *path, const struct timespec ts[2])
+// Remembers the mtime and size of the mirror file of in as those of the
+// data the kernel caches, after eFUSE opened or changed it
+static void cache_stamp(struct inode* in, int fd)
 {
-	int res;
-	struct timeval tv[2];
+    struct stat st;
+
+    pthread_mutex_lock(&in->lock);
+    in->cache_valid = fstat(fd, &st) == 0;
+    in->cache_mtime = st.st_mtim;
+    in->cache_size = st.st_size;
+    pthread_mutex_unlock(&in->lock);
+}
 
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+// Lets the kernel keep the pages it has of in if the mirror file has not
+// changed since they were cached
+static void cache_open(const struct eFUSE_state* state, struct inode* in,
+                       struct eFUSE_handle* fh, struct fuse_file_info* fi)
+{
+    struct stat st;
 
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = utimes(new_path, tv);
-	if (res == -1)
-		return -errno;
+    if(state->kernel_cache){
+        fi->keep_cache = 1;
+        return;
+    }
+    if(!state->auto_cache || fstat(fh->fd, &st) == -1)
+        return;
+
+    pthread_mutex_lock(&in->lock);
+    fi->keep_cache = in->cache_valid &&
+        in->cache_mtime.tv_sec == st.st_mtim.tv_sec &&
+        in->cache_mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        in->cache_size == st.st_size;
+    in->cache_valid = 1;
+    in->cache_mtime = st.st_mtim;
+    in->cache_size = st.st_size;
+    pthread_mutex_unlock(&in->lock);
+}
 
-	return 0;
+// After a handle wrote, the header and mirror file changed with the data
+// the kernel already has
+static void handle_wrote(struct inode* in, struct eFUSE_handle* fh)
+{
+    inode_changed(in);
+    cache_stamp(in, fh->fd);
 }
 
-static int eFUSE_open(const char *path, struct fuse_file_info *fi)
+static void eFUSE_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = open(new_path, fi->flags);
-	if (res == -1)
-		return -errno;
+    struct eFUSE_state* state = eFUSE_data(req);
+    struct fuse_entry_param e;
+    int res = do_lookup(state, inode_of(parent), name, &e, 1);
+
+    if(res == -ENOENT && state->negative_timeout > 0){
+        // ino 0 caches that name does not exist
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = state->negative_timeout;
+        fuse_reply_entry(req, &e);
+    }
+    else if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &e);
+}
 
-	close(res);
-	return 0;
+static void eFUSE_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    inodes_forget(inode_of(ino), nlookup);
+    fuse_reply_none(req);
 }
 
-static int eFUSE_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+static void eFUSE_forget_multi(fuse_req_t req, size_t count,
+                               struct fuse_forget_data *forgets)
 {
+    for(size_t i = 0; i < count; i++)
+        inodes_forget(inode_of(forgets[i].ino), forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+// Replies with the attributes of in, or of the handle's file
+static void reply_attr(fuse_req_t req, struct inode* in,
+                       struct fuse_file_info* fi)
+{
+    struct eFUSE_state* state = eFUSE_data(req);
+    struct stat st;
     int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    
-    (void) fi;
-    (void) offset;
-    
-    //get xattr_value
-    FILE *currentFile = fopen(new_path, "r");
-    FILE *temp = tmpfile();
-    
-    if(currentFile == NULL)
-        return -errno;
-    
-    ssize_t xattr_length = getxattr(new_path, "user.encrypted", NULL, 0);
-    char* xattr_value = malloc(sizeof(*xattr_value) * (xattr_length + 1));
-    xattr_length = getxattr(new_path, "user.encrypted", xattr_value, xattr_length);
-    xattr_value[xattr_length] = '\0';
-    
-    if (!strcmp(xattr_value, "true")) //if encrypted
-    {
-        do_crypt(currentFile, temp, DECRYPT, eFUSE_data -> crypt_password); //decrypt
-        
-        // reset pointers
-        rewind(currentFile);
-        rewind(temp);
-        
-        // read decrypted file
-        res = fread(buf, 1, size, temp);
-        if (res == -1)
+
+    if(fi && S_ISREG(in->type))
+        res = fstat(eFUSE_handle(fi)->fd, &st);
+    else
+        res = fstatat(in->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    if(res == -1){
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    plain_size(state, in, &st);
+    fuse_reply_attr(req, &st, state->attr_timeout);
+}
+
+static void eFUSE_getattr(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+    reply_attr(req, inode_of(ino), fi);
+}
+
+static void eFUSE_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                          int to_set, struct fuse_file_info *fi)
+{
+    struct eFUSE_state* state = eFUSE_data(req);
+    struct inode* in = inode_of(ino);
+    // an fi of a directory holds an eFUSE_dir
+    struct eFUSE_handle* fh = fi && S_ISREG(in->type) ? eFUSE_handle(fi) : NULL;
+    char path[64];
+    int res = 0;
+
+    proc_path(in, path);
+
+    if(to_set & FUSE_SET_ATTR_MODE){
+        if((fh ? fchmod(fh->fd, attr->st_mode) : chmod(path, attr->st_mode)) == -1)
             res = -errno;
     }
-    else //not encrypted, normal read
-    {
-        res = fread(buf, 1, size, currentFile);
-        if (res == -1)
+    if(res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))){
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+        if(fchownat(in->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
             res = -errno;
     }
-    
-    free(xattr_value);
-    
-    // close files
-    fclose(currentFile);
-    fclose(temp);
-    
-    return res;
+    if(res == 0 && (to_set & FUSE_SET_ATTR_SIZE)){
+        // encrypted files have to be re-encrypted, so go through a handle
+        if(fh){
+            res = handle_truncate(state, fh, attr->st_size);
+            handle_wrote(in, fh);
+        }
+        else{
+            struct eFUSE_handle* tmp;
+
+            res = handle_open(state, in, O_RDWR, &tmp);
+            if(res == 0){
+                res = handle_truncate(state, tmp, attr->st_size);
+                handle_wrote(in, tmp);
+                int closed = handle_close(state, tmp);
+                if(res == 0)
+                    res = closed;
+            }
+        }
+    }
+    if(res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))){
+        struct timespec tv[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+
+        if(to_set & FUSE_SET_ATTR_ATIME_NOW)
+            tv[0].tv_nsec = UTIME_NOW;
+        else if(to_set & FUSE_SET_ATTR_ATIME)
+            tv[0] = attr->st_atim;
+        if(to_set & FUSE_SET_ATTR_MTIME_NOW)
+            tv[1].tv_nsec = UTIME_NOW;
+        else if(to_set & FUSE_SET_ATTR_MTIME)
+            tv[1] = attr->st_mtim;
+
+        // the /proc link of a symlink would set its target's times
+        if(fh)
+            res = futimens(fh->fd, tv);
+        else if(S_ISLNK(in->type))
+            res = utimensat(in->fd, "", tv, AT_EMPTY_PATH);
+        else
+            res = utimensat(AT_FDCWD, path, tv, 0);
+        if(res == -1)
+            res = -errno;
+    }
+
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        reply_attr(req, in, fi);
 }
 
-static int eFUSE_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+static void eFUSE_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    char path[64];
+
+    proc_path(inode_of(ino), path);
+    fuse_reply_err(req, faccessat(AT_FDCWD, path, mask, 0) == -1 ? errno : 0);
+}
+
+static void eFUSE_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char buf[PATH_MAX + 1];
+    ssize_t res = readlinkat(inode_of(ino)->fd, "", buf, sizeof(buf));
+
+    if(res == -1){
+        fuse_reply_err(req, errno);
+        return;
+    }
+    if(res == sizeof(buf)){
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    buf[res] = '\0';
+    fuse_reply_readlink(req, buf);
+}
+
+// Replies to mknod(), mkdir(), symlink() and link() with the entry they
+// made, res being what their call returned
+static void reply_new_entry(fuse_req_t req, struct inode* dir,
+                            const char* name, int res)
+{
+    struct fuse_entry_param e;
+
+    if(res == -1){
+        fuse_reply_err(req, errno);
+        return;
+    }
+    res = do_lookup(eFUSE_data(req), dir, name, &e, 1);
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void eFUSE_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode, dev_t rdev)
+{
+    struct inode* dir = inode_of(parent);
+
+    reply_new_entry(req, dir, name, mknodat(dir->fd, name, mode, rdev));
+}
+
+static void eFUSE_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode)
+{
+    struct inode* dir = inode_of(parent);
+
+    reply_new_entry(req, dir, name, mkdirat(dir->fd, name, mode));
+}
+
+static void eFUSE_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                          const char *name)
+{
+    struct inode* dir = inode_of(parent);
+
+    reply_new_entry(req, dir, name, symlinkat(link, dir->fd, name));
+}
+
+static void eFUSE_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                       const char *newname)
+{
+    struct inode* dir = inode_of(newparent);
+    char path[64];
+
+    proc_path(inode_of(ino), path);
+    reply_new_entry(req, dir, newname,
+                    linkat(AT_FDCWD, path, dir->fd, newname, AT_SYMLINK_FOLLOW));
+}
+
+static void eFUSE_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    int res = unlinkat(inode_of(parent)->fd, name, 0);
+
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void eFUSE_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    int res = unlinkat(inode_of(parent)->fd, name, AT_REMOVEDIR);
+
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void eFUSE_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         fuse_ino_t newparent, const char *newname,
+                         unsigned int flags)
 {
     int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    
-    (void) fi;
-    
-    //get xattr_value
-    FILE *currentFile = fopen(new_path, "r+");
-    FILE *temp = tmpfile();
-    
-    if(currentFile == NULL)
-        return -errno;
-    
-    
-    ssize_t xattr_length = getxattr(new_path, "user.encrypted", NULL, 0);
-    char* xattr_value = malloc(sizeof(*xattr_value) * (xattr_length + 1));
-    xattr_length = getxattr(new_path, "user.encrypted", xattr_value, xattr_length);
-    xattr_value[xattr_length] = '\0';
-    
-    
-    if (!strcmp(xattr_value, "true")) // If encrypted
+
+    if(is_hidden(inode_of(newparent), newname)){
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    if(flags)
+        res = renameat2(inode_of(parent)->fd, name,
+                        inode_of(newparent)->fd, newname, flags);
+    else
+        res = renameat(inode_of(parent)->fd, name,
+                       inode_of(newparent)->fd, newname);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void eFUSE_open(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    struct eFUSE_state* state = eFUSE_data(req);
+    struct inode* in = inode_of(ino);
+    struct eFUSE_handle* fh;
+    int res = handle_open(state, in, fi->flags, &fh);
+
+    if(res == 0 && (fi->flags & O_TRUNC)){
+        res = handle_truncate(state, fh, 0);
+        handle_wrote(in, fh);
+        if(res != 0)
+            handle_close(state, fh);
+    }
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    cache_open(state, in, fh, fi);
+    fi->fh = (uintptr_t) fh;
+    fuse_reply_open(req, fi);
+}
+
+static void eFUSE_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode, struct fuse_file_info *fi)
+{
+    struct eFUSE_state* state = eFUSE_data(req);
+    struct inode* dir = inode_of(parent);
+    struct fuse_entry_param e;
+    struct eFUSE_handle* fh;
+    struct inode* in;
+    struct stat st;
+    int res;
+    int fd;
+
+    if(is_hidden(dir, name)){
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    fd = openat(dir->fd, name, handle_flags(fi->flags) | O_CREAT | O_NOFOLLOW |
+                (fi->flags & O_EXCL), mode);
+
+    if(fd == -1){
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    //add encrypted attribute to files created, unless this opened a file
+    //that already has data
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0){
+        struct blockfile_header header;
+
+        // the header alone marks the file encrypted if the mirror has no
+        // xattrs; earlier versions of eFUSE only know user.encrypted
+        res = blockfile_create(fd, &header, &state->key,
+                               state->compress ? BLOCKFILE_COMPRESSED : 0);
+        if(res != 0){
+            close(fd);
+            fuse_reply_err(req, -res);
+            return;
+        }
+        fsetxattr(fd, "user.encrypted", "true", 4, 0);
+    }
+
+    res = do_lookup(state, dir, name, &e, 1);
+    if(res != 0){
+        close(fd);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    in = inode_of(e.ino);
+    res = handle_make(state, in, fd, &fh);
+    if(res == 0 && (fi->flags & O_TRUNC)){
+        res = handle_truncate(state, fh, 0);
+        handle_wrote(in, fh);
+        e.attr.st_size = 0;
+        if(res != 0)
+            handle_close(state, fh);
+    }
+    if(res != 0){
+        inodes_forget(in, 1);
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    cache_open(state, in, fh, fi);
+    fi->fh = (uintptr_t) fh;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void eFUSE_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    struct eFUSE_handle *fh = eFUSE_handle(fi);
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    char* plain;
+    ssize_t res;
+
+    (void) ino;
+
+    if (!fh->encrypted) // FUSE reads the mirror fd itself, with splice() if it can
     {
-        do_crypt(currentFile, temp, DECRYPT, eFUSE_data -> crypt_password); // decrypt
+        buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf.buf[0].fd = fh->fd;
+        buf.buf[0].pos = offset;
+        fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+        return;
     }
+
+    // decrypt only the blocks under [offset, offset + size), after asking
+    // for the ones after them if reads are sequential
+    readahead_note(&fh->ra, offset, size);
+    plain = malloc(size);
+    if (plain == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    res = openfile_read(fh->of, &eFUSE_data(req)->key, plain, size, offset);
+    if (res < 0)
+        fuse_reply_err(req, -res);
     else
+        fuse_reply_buf(req, plain, res);
+    free(plain);
+}
+
+// Plaintext writes are copied by FUSE straight from its buffer, a pipe with
+// splice, to the mirror fd; encrypted ones need the data in memory and are
+// buffered until flush(), fsync() or release()
+static void eFUSE_write_buf(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info *fi)
+{
+    struct eFUSE_handle *fh = eFUSE_handle(fi);
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    ssize_t res;
+
+    (void) ino;
+
+    fh->written = 1;
+    if (!fh->encrypted)
     {
-        do_crypt(currentFile, temp, COPY, eFUSE_data -> crypt_password); // not encrypted, just make a copy
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd = fh->fd;
+        dst.buf[0].pos = offset;
+        res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
     }
-    
-    // always write to temp
-    res = pwrite(fileno(temp), buf, size, offset);
-    if (res == -1)
-        res = -errno;
-    
-    // reset file pointers
-    rewind(currentFile);
-    rewind(temp);
-    
-    // encrypt on close if file was encrypted before
-    if (!strcmp(xattr_value, "true"))
+    else if (buf->count == 1 && buf->idx == 0 && buf->off == 0 &&
+             !(buf->buf[0].flags & FUSE_BUF_IS_FD))
     {
-        do_crypt(temp, currentFile, ENCRYPT, eFUSE_data -> crypt_password);
+        res = openfile_write(fh->of, &eFUSE_data(req)->key, buf->buf[0].mem,
+                             size, offset);
     }
     else
     {
-        do_crypt(temp, currentFile, COPY, eFUSE_data -> crypt_password);
-    }
-    
-    // reset file pointers
-    rewind(currentFile);
-    rewind(temp);
-    
-    free(xattr_value);
-    
-    // close files
-    fclose(currentFile);
-    fclose(temp);
-    
-    return res;
+        dst.buf[0].mem = malloc(size);
+        if (dst.buf[0].mem == NULL)
+        {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        res = fuse_buf_copy(&dst, buf, 0);
+        if (res >= 0)
+            res = openfile_write(fh->of, &eFUSE_data(req)->key, dst.buf[0].mem,
+                                 res, offset);
+        free(dst.buf[0].mem);
+    }
+
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void eFUSE_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs stbuf;
+
+    if (fstatvfs(inode_of(ino)->fd, &stbuf) == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_statfs(req, &stbuf);
 }
 
-static int eFUSE_statfs(const char *path, struct statvfs *stbuf)
+static void eFUSE_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	int res = 0;
+	struct eFUSE_handle *fh = eFUSE_handle(fi);
+
+	if (fh->encrypted)
+		res = openfile_flush(fh->of, &eFUSE_data(req)->key);
+	// the mirror file changes as the writes reach it
+	if (fh->written)
+		handle_wrote(inode_of(ino), fh);
+	fuse_reply_err(req, -res);
+}
+
+static void eFUSE_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct eFUSE_handle *fh = eFUSE_handle(fi);
+	struct inode *in = inode_of(ino);
+	int written = fh->written;
 	int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-	res = statvfs(new_path, stbuf);
-	if (res == -1)
-		return -errno;
 
-	return 0;
+	if (written)
+		cache_stamp(in, fh->fd);
+	res = handle_close(eFUSE_data(req), fh);
+	// the last close of an encrypted file writes what is left of it
+	if (written)
+		inode_changed(in);
+	fuse_reply_err(req, -res);
+}
+
+static void eFUSE_fsync(fuse_req_t req, fuse_ino_t ino, int isdatasync,
+                        struct fuse_file_info *fi)
+{
+	int res;
+	struct eFUSE_handle *fh = eFUSE_handle(fi);
+
+	if (fh->encrypted) {
+		res = openfile_fsync(fh->of, &eFUSE_data(req)->key, isdatasync);
+	} else {
+		res = isdatasync ? fdatasync(fh->fd) : fsync(fh->fd);
+		if (res == -1)
+			res = -errno;
+	}
+	if (fh->written)
+		handle_wrote(inode_of(ino), fh);
+	fuse_reply_err(req, -res);
 }
 
-static int eFUSE_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+// Per-opendir() state: the mirror directory stream and where it is, so
+// readdir() continues from the entry it stopped at
+struct eFUSE_dir{
+    DIR* dp;
+    off_t offset;           // of the next entry readdir() returns
+    struct dirent* entry;   // read from dp but not yet returned, or NULL
+};
 
-    (void) fi;
+#define eFUSE_dir(fi) ((struct eFUSE_dir *) (uintptr_t) (fi)->fh)
 
-    int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    res = creat(new_path, mode);
-    if(res == -1)
-        return -errno;
-    
-    //add encrypted attribute to files created
-    setxattr(new_path, "user.encrypted", "true", 4, 0);
+static void eFUSE_opendir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+    struct eFUSE_dir* d = malloc(sizeof(*d));
+    int fd;
 
-    close(res);
+    if(d == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fd = openat(inode_of(ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+    d->dp = fd == -1 ? NULL : fdopendir(fd);
+    if(d->dp == NULL){
+        int err = errno;
+        if(fd != -1)
+            close(fd);
+        free(d);
+        fuse_reply_err(req, err);
+        return;
+    }
+    d->offset = 0;
+    d->entry = NULL;
 
-    return 0;
+    fi->fh = (uintptr_t) d;
+    fuse_reply_open(req, fi);
 }
 
+static int is_dot_or_dotdot(const char* name)
+{
+    return name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
 
-static int eFUSE_release(const char *path, struct fuse_file_info *fi)
+// Fills a reply of up to size bytes with the entries of the directory from
+// offset on; with plus, readdirplus, each entry carries the attributes a
+// lookup would reply with, plaintext size included, and takes a reference
+// to its inode
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t offset, struct fuse_file_info *fi, int plus)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+    struct eFUSE_state* state = eFUSE_data(req);
+    struct eFUSE_dir* d = eFUSE_dir(fi);
+    char* buf = malloc(size);
+    size_t used = 0;
+    int err = 0;
+
+    if(buf == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    if(offset != d->offset){
+        seekdir(d->dp, offset);
+        d->offset = offset;
+        d->entry = NULL;
+    }
 
-	(void) path;
-	(void) fi;
-	return 0;
+    for(;;){
+        struct fuse_entry_param e;
+        const char* name;
+        size_t len;
+
+        if(d->entry == NULL){
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if(d->entry == NULL){
+                err = errno;
+                break;
+            }
+        }
+        name = d->entry->d_name;
+        if(is_hidden(inode_of(ino), name)){
+            d->offset = d->entry->d_off;
+            d->entry = NULL;
+            continue;
+        }
+
+        memset(&e, 0, sizeof(e));
+        e.attr.st_ino = d->entry->d_ino;
+        e.attr.st_mode = d->entry->d_type << 12;
+        if(!plus){
+            len = fuse_add_direntry(req, buf + used, size - used, name,
+                                    &e.attr, d->entry->d_off);
+        }
+        else{
+            // "." and ".." are not looked up; ino 0 leaves them alone.
+            // Listing does not convert CBC files, so it never writes.
+            if(!is_dot_or_dotdot(name)){
+                err = -do_lookup(state, inode_of(ino), name, &e, 0);
+                if(err == ENOENT){
+                    // removed since readdir() saw it
+                    err = 0;
+                    d->offset = d->entry->d_off;
+                    d->entry = NULL;
+                    continue;
+                }
+                if(err != 0)
+                    break;
+            }
+            len = fuse_add_direntry_plus(req, buf + used, size - used, name,
+                                         &e, d->entry->d_off);
+            if(len > size - used && e.ino != 0)
+                inodes_forget(inode_of(e.ino), 1);
+        }
+        if(len > size - used)
+            break;
+        used += len;
+        d->offset = d->entry->d_off;
+        d->entry = NULL;
+    }
+
+    // an error after some entries is reported by the next call
+    if(err != 0 && used == 0)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_buf(req, buf, used);
+    free(buf);
 }
 
-static int eFUSE_fsync(const char *path, int isdatasync,
-		     struct fuse_file_info *fi)
+static void eFUSE_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t offset, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+    do_readdir(req, ino, size, offset, fi, 0);
+}
 
-	(void) path;
-	(void) isdatasync;
-	(void) fi;
-	return 0;
+static void eFUSE_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t offset, struct fuse_file_info *fi)
+{
+    do_readdir(req, ino, size, offset, fi, 1);
 }
 
-static int eFUSE_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+static void eFUSE_releasedir(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi)
 {
-    
-    int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    res = lsetxattr(new_path, name, value, size, flags);
-	if (res == -1)
-		return -errno;
-	return 0;
+    (void) ino;
+
+    closedir(eFUSE_dir(fi)->dp);
+    free(eFUSE_dir(fi));
+    fuse_reply_err(req, 0);
 }
 
-static int eFUSE_getxattr(const char *path, const char *name, char *value,
-			size_t size)
+// Formats the mount's counters for STATS_XATTR and unmount
+static int stats_text(char* buf, size_t size)
 {
-    int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    res = lgetxattr(new_path, name, value, size);
-	if (res == -1)
-		return -errno;
-	return res;
+    struct blockcache_stats cache;
+    struct cryptpool_stats crypt;
+    struct readahead_stats ra;
+    struct blockfile_stats packed;
+    struct openfile_stats wb;
+
+    blockcache_get_stats(&cache);
+    cryptpool_get_stats(&crypt);
+    readahead_get_stats(&ra);
+    blockfile_get_stats(&packed);
+    openfile_get_stats(&wb);
+    return snprintf(buf, size,
+                    "cache: %llu hits, %llu misses, %llu evictions, %llu invalidations, "
+                    "%zu of %zu blocks\n"
+                    "crypt: %llu requests split across %u threads, %llu not split\n"
+                    "readahead: %llu windows, %llu blocks decrypted ahead, %llu dropped\n"
+                    "writeback: %llu files written back, %llu blocks, %llu failed, "
+                    "%llu writes throttled, %llu blocks dirty\n"
+                    "compression: %llu chunks compressed, %llu stored raw, "
+                    "%llu bytes in %llu (%.2fx)\n"
+                    "inodes: %zu known to the kernel\n",
+                    (unsigned long long) cache.hits, (unsigned long long) cache.misses,
+                    (unsigned long long) cache.evictions,
+                    (unsigned long long) cache.invalidations,
+                    cache.used, cache.capacity,
+                    (unsigned long long) crypt.parallel, crypt.threads,
+                    (unsigned long long) crypt.serial,
+                    (unsigned long long) ra.requests, (unsigned long long) ra.blocks,
+                    (unsigned long long) ra.dropped,
+                    (unsigned long long) wb.passes, (unsigned long long) wb.blocks,
+                    (unsigned long long) wb.errors, (unsigned long long) wb.throttled,
+                    (unsigned long long) wb.dirty,
+                    (unsigned long long) packed.compressed,
+                    (unsigned long long) packed.raw,
+                    (unsigned long long) packed.plain_bytes,
+                    (unsigned long long) packed.stored_bytes,
+                    packed.stored_bytes ?
+                        (double) packed.plain_bytes / packed.stored_bytes : 1.0,
+                    inodes_count());
+}
+
+// Replies to getxattr() and listxattr() with the res bytes of value, or
+// their size if size is 0
+static void reply_xattr(fuse_req_t req, const char* value, ssize_t res,
+                        size_t size)
+{
+    if(res == -1)
+        fuse_reply_err(req, errno);
+    else if(size == 0)
+        fuse_reply_xattr(req, res);
+    else
+        fuse_reply_buf(req, value, res);
 }
 
-static int eFUSE_listxattr(const char *path, char *list, size_t size)
+// The path to reach the xattrs of in through. The /proc link of a
+// symlink's O_PATH fd would be followed to its target, so a symlink is
+// reached by its name in the mirror instead, with the l*xattr() calls.
+// Returns 0 or -errno.
+static int xattr_path(const struct inode* in, char path[PATH_MAX])
 {
+    char link[64];
+    ssize_t len;
+
+    proc_path(in, link);
+    if(!S_ISLNK(in->type)){
+        strcpy(path, link);
+        return 0;
+    }
+    len = readlink(link, path, PATH_MAX - 1);
+    if(len == -1)
+        return -errno;
+    path[len] = '\0';
+    return 0;
+}
+
+static void eFUSE_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           const char *value, size_t size, int flags)
+{
+    struct inode* in = inode_of(ino);
+    char path[PATH_MAX];
     int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    res = llistxattr(new_path, list, size);
-	if (res == -1)
-		return -errno;
-	return res;
+
+    res = xattr_path(in, path);
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = S_ISLNK(in->type) ? lsetxattr(path, name, value, size, flags) :
+        setxattr(path, name, value, size, flags);
+    inode_changed(in);
+    fuse_reply_err(req, res == -1 ? errno : 0);
 }
 
-static int eFUSE_removexattr(const char *path, const char *name)
+static void eFUSE_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           size_t size)
 {
+    struct inode* in = inode_of(ino);
+    char path[PATH_MAX];
+    char* value = NULL;
+    ssize_t res;
+
+    if (ino == FUSE_ROOT_ID && !strcmp(name, STATS_XATTR)) {
+        char text[1024];
+        res = stats_text(text, sizeof(text));
+        if (size != 0 && size < (size_t) res)
+            fuse_reply_err(req, ERANGE);
+        else
+            reply_xattr(req, text, res, size);
+        return;
+    }
+
+    res = xattr_path(in, path);
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if(size != 0 && (value = malloc(size)) == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    res = S_ISLNK(in->type) ? lgetxattr(path, name, value, size) :
+        getxattr(path, name, value, size);
+    reply_xattr(req, value, res, size);
+    free(value);
+}
+
+static void eFUSE_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    struct inode* in = inode_of(ino);
+    char path[PATH_MAX];
+    char* list = NULL;
+    ssize_t res;
+
+    res = xattr_path(in, path);
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if(size != 0 && (list = malloc(size)) == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    res = S_ISLNK(in->type) ? llistxattr(path, list, size) :
+        listxattr(path, list, size);
+    reply_xattr(req, list, res, size);
+    free(list);
+}
+
+static void eFUSE_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    struct inode* in = inode_of(ino);
+    char path[PATH_MAX];
     int res;
-    char new_path[PATH_MAX];
-    full_path(path, new_path);
-    res = lremovexattr(new_path, name);
-	if (res == -1)
-		return -errno;
-	return 0;
+
+    res = xattr_path(in, path);
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = S_ISLNK(in->type) ? lremovexattr(path, name) : removexattr(path, name);
+    inode_changed(in);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+// Threads started before fuse_daemonize() would not survive the fork, so
+// the crypto pool, readahead and writeback threads start here
+static void eFUSE_init(void *userdata, struct fuse_conn_info *conn)
+{
+    struct eFUSE_state* state = userdata;
+
+    // let read() and write_buf() splice() plaintext file data
+    conn->want |= conn->capable &
+        (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    // list directories with their entries' attributes, the kernel choosing
+    // when a plain readdir() will do
+    conn->want |= conn->capable & (FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+
+    if(cryptpool_init(state->crypt_threads, (size_t) state->crypt_parallel_kb << 10) != 0)
+        fprintf(stderr, "Could not start crypto threads, ciphering in one thread\n");
+    if(readahead_init((size_t) state->readahead_kb << 10, &state->key) != 0)
+        fprintf(stderr, "Could not start the readahead thread, reading on demand\n");
+    if(state->writeback && openfile_writeback_init(&state->key) != 0)
+        fprintf(stderr, "Could not start the writeback thread, writing out in the writers\n");
+}
+
+static void eFUSE_destroy(void *userdata)
+{
+    char text[1024];
+
+    (void) userdata;
+
+    readahead_destroy();
+    openfile_writeback_destroy();
+    cryptpool_destroy();
+    stats_text(text, sizeof(text));
+    fputs(text, stderr);
 }
 
-static struct fuse_operations eFUSE_oper = {
+static const struct fuse_lowlevel_ops eFUSE_oper = {
+	.init		= eFUSE_init,
+	.destroy	= eFUSE_destroy,
+	.lookup		= eFUSE_lookup,
+	.forget		= eFUSE_forget,
+	.forget_multi	= eFUSE_forget_multi,
 	.getattr	= eFUSE_getattr,
+	.setattr	= eFUSE_setattr,
 	.access		= eFUSE_access,
 	.readlink	= eFUSE_readlink,
-	.readdir	= eFUSE_readdir,
 	.mknod		= eFUSE_mknod,
 	.mkdir		= eFUSE_mkdir,
 	.symlink	= eFUSE_symlink,
+	.link		= eFUSE_link,
 	.unlink		= eFUSE_unlink,
 	.rmdir		= eFUSE_rmdir,
 	.rename		= eFUSE_rename,
-	.link		= eFUSE_link,
-	.chmod		= eFUSE_chmod,
-	.chown		= eFUSE_chown,
-	.truncate	= eFUSE_truncate,
-	.utimens	= eFUSE_utimens,
 	.open		= eFUSE_open,
+	.create		= eFUSE_create,
 	.read		= eFUSE_read,
-	.write		= eFUSE_write,
+	.write_buf	= eFUSE_write_buf,
 	.statfs		= eFUSE_statfs,
-	.create     = eFUSE_create,
+	.flush		= eFUSE_flush,
 	.release	= eFUSE_release,
 	.fsync		= eFUSE_fsync,
+	.opendir	= eFUSE_opendir,
+	.readdir	= eFUSE_readdir,
+	.readdirplus	= eFUSE_readdirplus,
+	.releasedir	= eFUSE_releasedir,
 	.setxattr	= eFUSE_setxattr,
 	.getxattr	= eFUSE_getxattr,
 	.listxattr	= eFUSE_listxattr,
 	.removexattr	= eFUSE_removexattr,
 };
 
+// The password and mirror come before the mount point; the mount point and
+// all other arguments go on to FUSE
+static int eFUSE_opt_proc(void *data, const char *arg, int key,
+                          struct fuse_args *outargs)
+{
+    struct eFUSE_state* state = data;
+
+    (void) outargs;
+
+    if(key != FUSE_OPT_KEY_NONOPT)
+        return 1;
+
+    switch(state->nonopts++){
+    case 0:
+        state->crypt_password = strdup(arg);
+        return state->crypt_password ? 0 : -1;
+    case 1:
+        state->mirror_path = realpath(arg, NULL);
+        if(state->mirror_path == NULL){
+            perror(arg);
+            return -1;
+        }
+        return 0;
+    default:
+        return 1;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     umask(0);
-    
-    if(argc != 4){
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session* se;
+    struct eFUSE_state* temp_data;
+    unsigned char salt[BLOCKFILE_SALT_SIZE];
+    int res;
+    temp_data = calloc(1, sizeof(struct eFUSE_state));
+
+    if(temp_data == NULL){
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+    temp_data->cache_mb = BLOCKCACHE_DEFAULT_MB;
+    temp_data->crypt_threads = CRYPTPOOL_DEFAULT_THREADS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus > 0 && cpus < CRYPTPOOL_DEFAULT_THREADS)
+        temp_data->crypt_threads = cpus;
+    temp_data->crypt_parallel_kb = CRYPTPOOL_DEFAULT_MIN_KB;
+    temp_data->readahead_kb = READAHEAD_DEFAULT_KB;
+    temp_data->writeback = 1;
+    temp_data->xattr_timeout = DEFAULT_TIMEOUT;
+    temp_data->attr_timeout = DEFAULT_TIMEOUT;
+    temp_data->entry_timeout = DEFAULT_TIMEOUT;
+    temp_data->negative_timeout = DEFAULT_TIMEOUT;
+    temp_data->auto_cache = 1;
+
+    if(fuse_opt_parse(&args, temp_data, eFUSE_opts, eFUSE_opt_proc) == -1 ||
+       temp_data->nonopts < 3 ||
+       fuse_parse_cmdline(&args, &opts) != 0 || opts.mountpoint == NULL){
         printf(USAGE);
         return 1;
     }
-    
-    struct eFUSE_state* temp_data;
-    temp_data = malloc(sizeof(struct eFUSE_state));
-    
-    if(temp_data == NULL){
+
+    // without a salt only files from before there was one can be used
+    res = blockfile_salt(temp_data->mirror_path, salt);
+    if(res != 0)
+        fprintf(stderr, "%s: cannot read or make the key salt (%s); "
+                "new encrypted files cannot be created\n",
+                temp_data->mirror_path, strerror(-res));
+    if(blockfile_key_derive(&temp_data->key, temp_data->crypt_password,
+                            res == 0 ? salt : NULL) != 0){
+        fprintf(stderr, "Key derivation error\n");
+        return 1;
+    }
+    if(blockcache_init((size_t) temp_data->cache_mb << 20) != 0){
         fprintf(stderr, "Memory allocation error\n");
         return 1;
     }
-    
-    temp_data->crypt_password = argv[1];
-    temp_data->mirror_path = realpath(argv[2], NULL);
+    res = inodes_init(temp_data->mirror_path);
+    if(res != 0){
+        fprintf(stderr, "%s: %s\n", temp_data->mirror_path, strerror(-res));
+        return 1;
+    }
 
-    
     printf("cypt password -> %s\n", temp_data->crypt_password);
     printf("mirrored path -> %s\n", temp_data->mirror_path);
-    
-    argv[1] = argv[3];
-    argv[2] = NULL;
-    argv[3] = NULL;
-    
-    argc -= 2;
-    
-    int fuse_ret = fuse_main(argc, argv, &eFUSE_oper, temp_data);
+
+    res = 1;
+    se = fuse_session_new(&args, &eFUSE_oper, sizeof(eFUSE_oper), temp_data);
+    temp_data->se = se;
+    if(se != NULL){
+        if(fuse_set_signal_handlers(se) == 0){
+            if(fuse_session_mount(se, opts.mountpoint) == 0){
+                fuse_daemonize(opts.foreground);
+                if(opts.singlethread)
+                    res = fuse_session_loop(se);
+                else
+                    res = fuse_session_loop_mt(se, opts.clone_fd);
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
     free(temp_data);
-    
-    return fuse_ret;
+
+    return res ? 1 : 0;
 }
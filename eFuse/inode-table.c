@@ -0,0 +1,203 @@
+/* inode-table.c
+ * Mirror inodes known to the kernel, for eFUSE
+ *
+ * See inode-table.h. Inodes live in a chained hash table keyed by st_dev and
+ * st_ino that doubles when it holds more inodes than buckets, all under
+ * table_lock.
+ *
+ */
+
+#define _GNU_SOURCE	/* O_PATH */
+
+#include "inode-table.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MIN_BUCKETS 1024	/* power of two */
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode** buckets;
+static size_t nbuckets;
+static size_t count;
+static struct inode root;
+
+static size_t bucket_of(dev_t dev, ino_t ino, size_t n){
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+
+    return (h ^ (h >> 29)) & (n - 1);
+}
+
+static void inode_init(struct inode* in, int fd, const struct stat* st){
+    in->fd = fd;
+    in->dev = st->st_dev;
+    in->ino = st->st_ino;
+    in->type = st->st_mode & S_IFMT;
+    in->nlookup = 1;
+    in->next = NULL;
+    pthread_mutex_init(&in->lock, NULL);
+    in->encrypted = -1;
+    in->have_size = 0;
+    in->checked = 0;
+    in->cache_valid = 0;
+}
+
+/* Doubles the table; called with table_lock held. Failing to only leaves
+ * the chains longer. */
+static void grow(void){
+    size_t n = nbuckets * 2;
+    struct inode** b = calloc(n, sizeof(*b));
+
+    if(!b){
+	return;
+    }
+    for(size_t i = 0; i < nbuckets; i++){
+	while(buckets[i]){
+	    struct inode* in = buckets[i];
+	    size_t j = bucket_of(in->dev, in->ino, n);
+
+	    buckets[i] = in->next;
+	    in->next = b[j];
+	    b[j] = in;
+	}
+    }
+    free(buckets);
+    buckets = b;
+    nbuckets = n;
+}
+
+extern int inodes_init(const char* mirror_path){
+    struct stat st;
+    int fd = open(mirror_path, O_PATH | O_DIRECTORY);
+
+    if(fd == -1){
+	return -errno;
+    }
+    if(fstat(fd, &st) == -1){
+	close(fd);
+	return -errno;
+    }
+
+    buckets = calloc(MIN_BUCKETS, sizeof(*buckets));
+    if(!buckets){
+	close(fd);
+	return -ENOMEM;
+    }
+    nbuckets = MIN_BUCKETS;
+    inode_init(&root, fd, &st);
+    return 0;
+}
+
+extern struct inode* inodes_root(void){
+    return &root;
+}
+
+extern struct inode* inodes_add(int fd, const struct stat* st){
+    struct inode* in;
+    size_t b;
+
+    /* the root is not in the table; a lookup of ".." can reach it */
+    if(st->st_dev == root.dev && st->st_ino == root.ino){
+	close(fd);
+	return &root;
+    }
+
+    pthread_mutex_lock(&table_lock);
+    b = bucket_of(st->st_dev, st->st_ino, nbuckets);
+    for(in = buckets[b]; in; in = in->next){
+	if(in->dev == st->st_dev && in->ino == st->st_ino){
+	    in->nlookup++;
+	    pthread_mutex_unlock(&table_lock);
+	    close(fd);
+	    return in;
+	}
+    }
+
+    in = malloc(sizeof(*in));
+    if(!in){
+	pthread_mutex_unlock(&table_lock);
+	close(fd);
+	errno = ENOMEM;
+	return NULL;
+    }
+    inode_init(in, fd, st);
+    in->next = buckets[b];
+    buckets[b] = in;
+    if(++count > nbuckets){
+	grow();
+    }
+    pthread_mutex_unlock(&table_lock);
+    return in;
+}
+
+extern struct inode* inodes_find(const struct stat* st){
+    struct inode* in;
+
+    if(st->st_dev == root.dev && st->st_ino == root.ino){
+	return &root;
+    }
+    pthread_mutex_lock(&table_lock);
+    for(in = buckets[bucket_of(st->st_dev, st->st_ino, nbuckets)]; in; in = in->next){
+	if(in->dev == st->st_dev && in->ino == st->st_ino){
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&table_lock);
+    return in;
+}
+
+extern void inodes_move(struct inode* in, int fd, const struct stat* st){
+    size_t b;
+
+    pthread_mutex_lock(&table_lock);
+    for(struct inode** p = &buckets[bucket_of(in->dev, in->ino, nbuckets)]; *p; p = &(*p)->next){
+	if(*p == in){
+	    *p = in->next;
+	    break;
+	}
+    }
+    in->dev = st->st_dev;
+    in->ino = st->st_ino;
+    b = bucket_of(in->dev, in->ino, nbuckets);
+    in->next = buckets[b];
+    buckets[b] = in;
+    dup2(fd, in->fd);
+    pthread_mutex_unlock(&table_lock);
+    close(fd);
+}
+
+extern void inodes_forget(struct inode* in, uint64_t n){
+    if(in == &root){
+	return;
+    }
+
+    pthread_mutex_lock(&table_lock);
+    in->nlookup -= n < in->nlookup ? n : in->nlookup;
+    if(in->nlookup > 0){
+	pthread_mutex_unlock(&table_lock);
+	return;
+    }
+    for(struct inode** p = &buckets[bucket_of(in->dev, in->ino, nbuckets)]; *p; p = &(*p)->next){
+	if(*p == in){
+	    *p = in->next;
+	    break;
+	}
+    }
+    count--;
+    pthread_mutex_unlock(&table_lock);
+
+    close(in->fd);
+    pthread_mutex_destroy(&in->lock);
+    free(in);
+}
+
+extern size_t inodes_count(void){
+    size_t n;
+
+    pthread_mutex_lock(&table_lock);
+    n = count;
+    pthread_mutex_unlock(&table_lock);
+    return n;
+}
@@ -0,0 +1,85 @@
+/* inode-table.h
+ * Mirror inodes known to the kernel, for eFUSE
+ *
+ * Every mirror inode eFUSE hands to the kernel gets a struct inode, whose
+ * address is its FUSE node id. The inode keeps an O_PATH fd on the mirror
+ * inode for as long as the kernel holds a reference, so operations work
+ * relative to it with openat(), fstatat() and the like instead of resolving
+ * a path from the mirror root every time. Inodes are found by their mirror
+ * st_dev and st_ino, so a file looked up through two names or hard links
+ * has one struct inode.
+ *
+ * An inode also remembers what takes opening the file to learn: whether it
+ * is encrypted and its plaintext size, and for auto_cache the mtime and size
+ * of the data the kernel may still have cached.
+ *
+ */
+
+#ifndef INODE_TABLE_H
+#define INODE_TABLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct inode{
+    int fd;			/* O_PATH on the mirror inode */
+    dev_t dev;
+    ino_t ino;
+    mode_t type;		/* S_IFMT bits of st_mode */
+    uint64_t nlookup;		/* kernel references, under the table lock */
+    struct inode* next;		/* hash chain, under the table lock */
+
+    pthread_mutex_t lock;	/* everything below */
+    int encrypted;		/* -1 if not known */
+    int have_size;
+    uint64_t size;		/* plaintext size of a block format file */
+    double checked;		/* when encrypted and size were learned */
+    int cache_valid;		/* the kernel may cache data of this mtime and size */
+    struct timespec cache_mtime;
+    off_t cache_size;
+};
+
+/* int inodes_init(const char* mirror_path)
+ * Purpose: Open the mirror root as the root inode, which is never forgotten
+ * Return: 0, or a negative errno
+ */
+extern int inodes_init(const char* mirror_path);
+
+extern struct inode* inodes_root(void);
+
+/* struct inode* inodes_add(int fd, const struct stat* st)
+ * Purpose: Take a kernel reference to the inode of st, with the O_PATH fd
+ *          fd on it if it is new; fd is closed if the inode was known, or
+ *          on failure
+ * Return: The inode, or NULL with errno set
+ */
+extern struct inode* inodes_add(int fd, const struct stat* st);
+
+/* struct inode* inodes_find(const struct stat* st)
+ * Purpose: Find the inode of st without taking a reference, for a FUSE
+ *          node id to send notifications about; it may be forgotten as soon
+ *          as this returns
+ * Return: The inode, or NULL if the kernel does not hold it
+ */
+extern struct inode* inodes_find(const struct stat* st);
+
+/* void inodes_move(struct inode* in, int fd, const struct stat* st)
+ * Purpose: Point in at the mirror inode of st, after the file it stood for
+ *          was replaced under its name, keeping its node id. fd, an O_PATH fd
+ *          on st, is dup2()ed over in->fd, so concurrent users of in->fd see
+ *          one file or the other, and closed. If another inode already
+ *          stands for st, both do from now on.
+ */
+extern void inodes_move(struct inode* in, int fd, const struct stat* st);
+
+/* Drop n kernel references, freeing the inode with the last one */
+extern void inodes_forget(struct inode* in, uint64_t n);
+
+/* Inodes the kernel holds */
+extern size_t inodes_count(void);
+
+#endif
@@ -0,0 +1,226 @@
+/* mount-bench.c
+ * Throughput and latency of common file operations in a directory, to
+ * compare eFUSE mount options with each other and with the mirror itself
+ *
+ * Usage: ./mount-bench [directory [MB]]
+ *
+ * Writes a file of MB megabytes (default 64) in directory (default .) in
+ * 128K requests, reads it back several times, then times small reads,
+ * stat() of the file and of a missing name, open/read/close, and listing a
+ * directory of small files with the stat() of each, as ls -l does. Run it
+ * in a mount made with each set of options, e.g.
+ *
+ *     ./eFUSE pw mirror mnt -o noauto_cache && ./mount-bench mnt
+ *     ./eFUSE pw mirror mnt -o kernel_cache,attr_timeout=10 && ./mount-bench mnt
+ *
+ * and in the mirror for the speed of the underlying file system.
+ *
+ * Results, 64 MB, mirror on tmpfs, the eFUSE mount with 8 threads reading
+ * /dev/fuse and no splice. MB/s varies by about 30% from run to run, so
+ * these are means of two or three runs; the times in us hardly vary.
+ *
+ *                       write first again pread stat miss  open ls -l again
+ *                        MB/s  MB/s  MB/s    us   us   us    us    us    us
+ *   mirror itself        2210  4480  4710   1.0  0.9  1.0   1.8   1.2   0.9
+ *   auto_cache (default)  520   510  4740   1.2  1.0  0.7    32    13   5.7
+ *   noauto_cache          590   640  1010   8.8  0.9  0.6    48    15   4.8
+ *   kernel_cache          680   700  4920   1.0  0.6  0.5    24   8.8   3.3
+ *   *_timeout=10          500   570  4440   1.0  0.9  0.7    29    11   4.5
+ *   *_timeout=0           680   630  4010   6.1   13  7.8    39    27    19
+ *
+ * (*_timeout is attr_timeout, entry_timeout and negative_timeout together;
+ * the default is 1 second.) Writes and first reads are bound by encryption
+ * whatever the options. Keeping the page cache across opens is what pays:
+ * without it every reopened read and small pread goes to eFUSE and
+ * decrypts again. auto_cache gets the same reads as kernel_cache for some
+ * 8 us more per open, the price of checking the mtime and size. Timeouts
+ * of 0 make every stat, missing name and ls -l entry a trip to eFUSE, 10
+ * to 20 times slower than a cached one; above the default they change
+ * nothing here, because each test finishes within a second.
+ *
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST (128 << 10)
+#define READ_PASSES 5
+#define SMALL 4096
+#define SMALL_OPS 20000
+#define LIST_FILES 2000
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char* what){
+    perror(what);
+    exit(1);
+}
+
+/* Seconds to read the whole file at path in REQUEST sized reads */
+static double read_all(const char* path, unsigned char* buf){
+    double start = now();
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+
+    if(fd == -1){
+	fail(path);
+    }
+    while((n = read(fd, buf, REQUEST)) > 0){
+    }
+    if(n == -1){
+	fail("read");
+    }
+    close(fd);
+    return now() - start;
+}
+
+/* Seconds to list dir and stat() each entry */
+static double list_all(const char* dir){
+    char path[PATH_MAX];
+    struct dirent* entry;
+    struct stat st;
+    double start = now();
+    DIR* dp = opendir(dir);
+
+    if(!dp){
+	fail(dir);
+    }
+    while((entry = readdir(dp))){
+	snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+	if(lstat(path, &st) == -1){
+	    fail(path);
+	}
+    }
+    closedir(dp);
+    return now() - start;
+}
+
+int main(int argc, char* argv[]){
+    const char* dir = argc > 1 ? argv[1] : ".";
+    size_t mb = argc > 2 ? (size_t)atoi(argv[2]) : 64;
+    size_t size = mb << 20;
+    char path[PATH_MAX];
+    char missing[PATH_MAX];
+    char list[PATH_MAX - 16];	/* room for the names of its files */
+    unsigned char* buf;
+    struct stat st;
+    double start;
+    double t;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/mount-bench.%d", dir, (int)getpid());
+    snprintf(missing, sizeof(missing), "%s/mount-bench.missing", dir);
+    buf = malloc(REQUEST);
+    if(!buf || size == 0){
+	fprintf(stderr, "Usage: %s [directory [MB]]\n", argv[0]);
+	return 1;
+    }
+    for(size_t i = 0; i < REQUEST; i++){
+	buf[i] = i * 7;
+    }
+
+    printf("%zuM file in %s\n", mb, dir);
+
+    start = now();
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1){
+	fail(path);
+    }
+    for(size_t done = 0; done < size; done += REQUEST){
+	if(write(fd, buf, REQUEST) != REQUEST){
+	    fail("write");
+	}
+    }
+    if(fsync(fd) == -1 || close(fd) == -1){
+	fail("fsync");
+    }
+    printf("%-28s %10.1f MB/s\n", "write + fsync", mb / (now() - start));
+
+    t = read_all(path, buf);
+    printf("%-28s %10.1f MB/s\n", "first read", mb / t);
+    t = 0;
+    for(int i = 0; i < READ_PASSES; i++){
+	t += read_all(path, buf);
+    }
+    printf("%-28s %10.1f MB/s\n", "repeated read (reopened)", mb * READ_PASSES / t);
+
+    fd = open(path, O_RDONLY);
+    if(fd == -1){
+	fail(path);
+    }
+    srand(1);
+    start = now();
+    for(int i = 0; i < SMALL_OPS; i++){
+	off_t offset = (off_t)(rand() % (size / SMALL)) * SMALL;
+	if(pread(fd, buf, SMALL, offset) != SMALL){
+	    fail("pread");
+	}
+    }
+    printf("%-28s %10.2f us\n", "4K random pread", (now() - start) / SMALL_OPS * 1e6);
+    close(fd);
+
+    start = now();
+    for(int i = 0; i < SMALL_OPS; i++){
+	if(stat(path, &st) == -1){
+	    fail("stat");
+	}
+    }
+    printf("%-28s %10.2f us\n", "stat", (now() - start) / SMALL_OPS * 1e6);
+
+    start = now();
+    for(int i = 0; i < SMALL_OPS; i++){
+	if(stat(missing, &st) == 0){
+	    fprintf(stderr, "%s exists\n", missing);
+	    return 1;
+	}
+    }
+    printf("%-28s %10.2f us\n", "stat of a missing name", (now() - start) / SMALL_OPS * 1e6);
+
+    start = now();
+    for(int i = 0; i < SMALL_OPS; i++){
+	fd = open(path, O_RDONLY);
+	if(fd == -1 || read(fd, buf, SMALL) != SMALL){
+	    fail("open/read");
+	}
+	close(fd);
+    }
+    printf("%-28s %10.2f us\n", "open + 4K read + close", (now() - start) / SMALL_OPS * 1e6);
+
+    snprintf(list, sizeof(list), "%s/mount-bench.%d.d", dir, (int)getpid());
+    if(mkdir(list, 0755) == -1){
+	fail(list);
+    }
+    for(int i = 0; i < LIST_FILES; i++){
+	snprintf(path, sizeof(path), "%s/%d", list, i);
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if(fd == -1 || write(fd, buf, i % SMALL) != i % SMALL || close(fd) == -1){
+	    fail(path);
+	}
+    }
+    t = list_all(list);
+    printf("%-28s %10.2f us\n", "ls -l, first, per entry", t / LIST_FILES * 1e6);
+    t = list_all(list);
+    printf("%-28s %10.2f us\n", "ls -l, again, per entry", t / LIST_FILES * 1e6);
+    for(int i = 0; i < LIST_FILES; i++){
+	snprintf(path, sizeof(path), "%s/%d", list, i);
+	unlink(path);
+    }
+    rmdir(list);
+
+    snprintf(path, sizeof(path), "%s/mount-bench.%d", dir, (int)getpid());
+    unlink(path);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,863 @@
+/* open-file.c
+ * Shared state of an open encrypted file for eFUSE
+ *
+ * See open-file.h. Open files live in a hash table keyed by mirror inode,
+ * under table_lock; everything in an open_file past its reference count is
+ * under its own reader/writer lock. Reads only look at the dirty blocks and
+ * header, so they share it and decrypt side by side; writes, truncates and
+ * flushes change them and hold it alone.
+ *
+ * The writeback thread takes a file's dirty blocks out of its table into its
+ * sorted in-flight array, where reads and writes still find them, and writes
+ * them with the lock released, so only the bookkeeping either side of it
+ * holds writes up. Compressed files are the exception: rewriting a chunk
+ * also rewrites blocks a read may be reading from the mirror, so they stay
+ * locked throughout. Files queued for writeback, the one being written and
+ * whether a file is in writeback at all are under writeback.lock, whose
+ * condition variable is also what flushes and throttled writes wait on.
+ *
+ */
+
+#define _GNU_SOURCE	/* pthread_rwlockattr_setkind_np() */
+
+#include "open-file.h"
+#include "block-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TABLE_BUCKETS 256
+#define DIRTY_BUCKETS 1024	/* power of two */
+
+/* Blocks covering size bytes */
+#define block_count(size) (((size) + BLOCKFILE_BLOCK_SIZE - 1) / BLOCKFILE_BLOCK_SIZE)
+
+struct dirty_block{
+    uint64_t n;
+    struct dirty_block* next;
+    unsigned char data[BLOCKFILE_BLOCK_SIZE];
+};
+
+struct open_file{
+    dev_t dev;
+    ino_t ino;
+    int refs;			/* under table_lock */
+    struct open_file* next;	/* table chain, under table_lock */
+    uint64_t size;		/* header.size, atomic, for openfile_size() */
+
+    pthread_rwlock_t lock;		/* read by reads, written by the rest */
+    int fd;
+    int writable;		/* fd was opened for writing; set under lock, atomic */
+    struct blockfile_header header;	/* size includes dirty blocks */
+    struct blockcache_file cache_key;
+    int size_dirty;		/* header.size not stored yet */
+    size_t ndirty;
+    struct dirty_block* dirty[DIRTY_BUCKETS];
+    struct dirty_block** inflight;	/* being written back, in block order */
+    size_t ninflight;
+    int writeback_failed;	/* flush in the writer until a flush succeeds */
+
+    int writing;		/* in writeback; changed under both locks */
+    int queued;			/* under writeback.lock */
+    struct open_file* queue_next;	/* under writeback.lock */
+};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct open_file* table[TABLE_BUCKETS];
+static long dirty_total;	/* dirty and in-flight blocks of every file, atomic */
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;	/* a file left writeback */
+    struct open_file* head;	/* files queued, oldest first */
+    struct open_file* tail;
+    struct open_file* running;
+    const struct blockfile_key* key;
+    pthread_t thread;
+    int started;
+    int stop;
+    struct openfile_stats stats;
+} writeback = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static struct open_file** table_bucket(dev_t dev, ino_t ino){
+    return &table[(dev * 31 + ino) % TABLE_BUCKETS];
+}
+
+static struct open_file* table_find(const struct stat* st){
+    struct open_file* of = *table_bucket(st->st_dev, st->st_ino);
+
+    while(of && (of->dev != st->st_dev || of->ino != st->st_ino)){
+	of = of->next;
+    }
+    return of;
+}
+
+static int fd_writable(int fd){
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && (flags & O_ACCMODE) != O_RDONLY;
+}
+
+/* Wait until of is not in writeback */
+static void wait_idle(struct open_file* of){
+    pthread_mutex_lock(&writeback.lock);
+    while(of->writing){
+	pthread_cond_wait(&writeback.done, &writeback.lock);
+    }
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+/* Write lock of once it is not in writeback, so nothing else is writing
+ * its blocks or using its fd */
+static void lock_idle(struct open_file* of){
+    for(;;){
+	pthread_rwlock_wrlock(&of->lock);
+	if(!of->writing){
+	    return;
+	}
+	pthread_rwlock_unlock(&of->lock);
+	wait_idle(of);
+    }
+}
+
+extern struct open_file* openfile_get(int fd, const struct stat* st,
+				      const struct blockfile_key* key){
+    pthread_rwlockattr_t lock_attr;
+    struct open_file* of;
+    int writable = fd_writable(fd);
+    int ret;
+
+    pthread_mutex_lock(&table_lock);
+    of = table_find(st);
+    if(of){
+	int newfd = -1;
+
+	of->refs++;
+	if(writable && !__atomic_load_n(&of->writable, __ATOMIC_RELAXED)){
+	    newfd = dup(fd);
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	/* Later flushes need a descriptor they can write through. Swapped
+	 * in outside table_lock, as waiting out a writeback pass would stall
+	 * every lookup on the mount; two writable opens can both get here. */
+	if(newfd != -1){
+	    lock_idle(of);
+	    if(!of->writable){
+		close(of->fd);
+		of->fd = newfd;
+		__atomic_store_n(&of->writable, 1, __ATOMIC_RELAXED);
+		newfd = -1;
+	    }
+	    pthread_rwlock_unlock(&of->lock);
+	    if(newfd != -1){
+		close(newfd);
+	    }
+	}
+	return of;
+    }
+
+    of = calloc(1, sizeof(*of));
+    if(!of){
+	pthread_mutex_unlock(&table_lock);
+	errno = ENOMEM;
+	return NULL;
+    }
+    /* Loaded under table_lock, so it cannot race the last openfile_put()
+     * of an earlier open_file flushing its header */
+    ret = blockfile_load(fd, &of->header, key);
+    if(ret == 0){
+	of->fd = dup(fd);
+	ret = of->fd == -1 ? -errno : 0;
+    }
+    if(ret){
+	pthread_mutex_unlock(&table_lock);
+	free(of);
+	errno = -ret;
+	return NULL;
+    }
+    of->dev = st->st_dev;
+    of->ino = st->st_ino;
+    blockcache_file_init(&of->cache_key, st->st_dev, st->st_ino, &of->header);
+    of->size = of->header.size;
+    of->refs = 1;
+    of->writable = writable;
+    pthread_rwlockattr_init(&lock_attr);
+    /* a stream of reads would otherwise hold writes off indefinitely */
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&of->lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
+    of->next = *table_bucket(st->st_dev, st->st_ino);
+    *table_bucket(st->st_dev, st->st_ino) = of;
+    pthread_mutex_unlock(&table_lock);
+    return of;
+}
+
+static struct dirty_block* dirty_find(struct open_file* of, uint64_t n){
+    struct dirty_block* d = of->dirty[n & (DIRTY_BUCKETS - 1)];
+
+    while(d && d->n != n){
+	d = d->next;
+    }
+    return d;
+}
+
+static void dirty_insert(struct open_file* of, struct dirty_block* d){
+    struct dirty_block** bucket = &of->dirty[d->n & (DIRTY_BUCKETS - 1)];
+
+    d->next = *bucket;
+    *bucket = d;
+    of->ndirty++;
+    __atomic_add_fetch(&dirty_total, 1, __ATOMIC_RELAXED);
+}
+
+/* The in-flight copy of block n, if it is being written back */
+static struct dirty_block* inflight_find(struct open_file* of, uint64_t n){
+    size_t lo = 0;
+    size_t hi = of->ninflight;
+
+    while(lo < hi){
+	size_t mid = lo + (hi - lo) / 2;
+
+	if(of->inflight[mid]->n == n){
+	    return of->inflight[mid];
+	}
+	if(of->inflight[mid]->n < n){
+	    lo = mid + 1;
+	}
+	else{
+	    hi = mid;
+	}
+    }
+    return NULL;
+}
+
+/* The newest copy of block n not yet in the mirror, if any */
+static struct dirty_block* unwritten_find(struct open_file* of, uint64_t n){
+    struct dirty_block* d = of->ndirty ? dirty_find(of, n) : NULL;
+
+    return d || !of->ninflight ? d : inflight_find(of, n);
+}
+
+/* Fill plain with block n from memory, unwritten or cached, if it is there */
+static int block_from_memory(struct open_file* of, uint64_t n, unsigned char* plain){
+    struct dirty_block* d = unwritten_find(of, n);
+
+    if(d){
+	memcpy(plain, d->data, BLOCKFILE_BLOCK_SIZE);
+	return 1;
+    }
+    return blockcache_get(&of->cache_key, n, plain);
+}
+
+static int dirty_cmp(const void* a, const void* b){
+    uint64_t x = (*(struct dirty_block* const*)a)->n;
+    uint64_t y = (*(struct dirty_block* const*)b)->n;
+
+    return (x > y) - (x < y);
+}
+
+/* Take every dirty block out of the table, in block order
+ * Return: The blocks, or NULL with *count 0 if there are none or no memory
+ */
+static struct dirty_block** take_dirty(struct open_file* of, size_t* count){
+    struct dirty_block** blocks = of->ndirty ? malloc(of->ndirty * sizeof(*blocks)) : NULL;
+
+    *count = 0;
+    if(!blocks){
+	return NULL;
+    }
+    for(size_t i = 0; i < DIRTY_BUCKETS; i++){
+	for(struct dirty_block* d = of->dirty[i]; d; d = d->next){
+	    blocks[(*count)++] = d;
+	}
+	of->dirty[i] = NULL;
+    }
+    of->ndirty = 0;
+    qsort(blocks, *count, sizeof(*blocks), dirty_cmp);
+    return blocks;
+}
+
+/* Encrypt and write the count blocks, in block order, in runs of
+ * consecutive blocks
+ * Return: 0, or the first error, after which the rest are not written
+ */
+static int write_blocks(int fd, const struct blockfile_header* h,
+			const struct blockfile_key* key,
+			struct dirty_block* const* blocks, size_t count){
+    const unsigned char** data = malloc(count * sizeof(*data));
+    size_t j;
+    int ret = 0;
+
+    if(!data){
+	return -ENOMEM;
+    }
+    for(size_t i = 0; i < count; i++){
+	data[i] = blocks[i]->data;
+    }
+    for(size_t i = 0; ret == 0 && i < count; i = j){
+	for(j = i + 1; j < count && blocks[j]->n == blocks[i]->n + (j - i); j++){
+	}
+	ret = blockfile_write_blockv(fd, h, key, blocks[i]->n, j - i, data + i);
+    }
+    free(data);
+    return ret;
+}
+
+/* Free written blocks, or if writing them failed put back the ones no
+ * write has replaced since */
+static void finish_blocks(struct open_file* of, struct dirty_block** blocks,
+			  size_t count, int ret){
+    for(size_t i = 0; i < count; i++){
+	if(ret == 0 || dirty_find(of, blocks[i]->n)){
+	    free(blocks[i]);
+	}
+	else{
+	    dirty_insert(of, blocks[i]);
+	}
+    }
+    /* dirty_insert() counted the blocks put back again */
+    __atomic_sub_fetch(&dirty_total, count, __ATOMIC_RELAXED);
+}
+
+/* Encrypt and write the dirty blocks, then the header, with of locked and
+ * not in writeback. Blocks that fail stay dirty.
+ */
+static int flush_locked(struct open_file* of, const struct blockfile_key* key){
+    struct dirty_block** blocks;
+    size_t count;
+    int ret = 0;
+
+    if(of->ndirty > 0){
+	blocks = take_dirty(of, &count);
+	if(!blocks){
+	    return -ENOMEM;
+	}
+	ret = write_blocks(of->fd, &of->header, key, blocks, count);
+	finish_blocks(of, blocks, count, ret);
+	free(blocks);
+    }
+
+    if(ret == 0 && of->size_dirty){
+	ret = blockfile_store_size(of->fd, &of->header);
+	if(ret == 0){
+	    of->size_dirty = 0;
+	}
+    }
+    if(ret == 0){
+	of->writeback_failed = 0;
+    }
+    return ret;
+}
+
+/* Write back of's dirty blocks and header, in the writeback thread */
+static void writeback_file(struct open_file* of, const struct blockfile_key* key){
+    struct blockfile_header header;
+    struct dirty_block** blocks;
+    size_t count;
+    int size_dirty;
+    int locked;
+    int ret;
+
+    pthread_rwlock_wrlock(&of->lock);
+    blocks = take_dirty(of, &count);
+    if(!blocks){
+	pthread_rwlock_unlock(&of->lock);
+	return;
+    }
+    of->inflight = blocks;
+    of->ninflight = count;
+    /* writes can change the size meanwhile; this is the size of the file
+     * the blocks are written to */
+    header = of->header;
+    size_dirty = of->size_dirty;
+    pthread_mutex_lock(&writeback.lock);
+    of->writing = 1;
+    pthread_mutex_unlock(&writeback.lock);
+    locked = (header.flags & BLOCKFILE_COMPRESSED) != 0;
+    if(!locked){
+	pthread_rwlock_unlock(&of->lock);
+    }
+
+    ret = write_blocks(of->fd, &header, key, blocks, count);
+    if(ret == 0 && size_dirty){
+	ret = blockfile_store_size(of->fd, &header);
+    }
+
+    if(!locked){
+	pthread_rwlock_wrlock(&of->lock);
+    }
+    of->inflight = NULL;
+    of->ninflight = 0;
+    finish_blocks(of, blocks, count, ret);
+    if(ret == 0 && of->header.size == header.size){
+	of->size_dirty = 0;
+    }
+    if(ret){
+	of->writeback_failed = 1;
+    }
+    pthread_mutex_lock(&writeback.lock);
+    of->writing = 0;
+    writeback.stats.passes++;
+    writeback.stats.blocks += ret ? 0 : count;
+    writeback.stats.errors += ret != 0;
+    pthread_mutex_unlock(&writeback.lock);
+    pthread_rwlock_unlock(&of->lock);
+    free(blocks);
+}
+
+static void* writeback_worker(void* arg){
+    (void)arg;
+
+    pthread_mutex_lock(&writeback.lock);
+    while(!writeback.stop){
+	struct open_file* of = writeback.head;
+
+	if(!of){
+	    pthread_cond_wait(&writeback.work, &writeback.lock);
+	    continue;
+	}
+	writeback.head = of->queue_next;
+	if(!writeback.head){
+	    writeback.tail = NULL;
+	}
+	of->queued = 0;
+
+	writeback.running = of;
+	pthread_mutex_unlock(&writeback.lock);
+	writeback_file(of, writeback.key);
+	pthread_mutex_lock(&writeback.lock);
+	writeback.running = NULL;
+	pthread_cond_broadcast(&writeback.done);
+    }
+    pthread_mutex_unlock(&writeback.lock);
+    return NULL;
+}
+
+/* Queue of for the writeback thread unless it already is */
+static void writeback_queue(struct open_file* of){
+    pthread_mutex_lock(&writeback.lock);
+    if(!of->queued && !writeback.stop){
+	of->queued = 1;
+	of->queue_next = NULL;
+	if(writeback.tail){
+	    writeback.tail->queue_next = of;
+	}
+	else{
+	    writeback.head = of;
+	}
+	writeback.tail = of;
+	pthread_cond_signal(&writeback.work);
+    }
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+/* Take of out of the queue and wait for the thread to be done with it */
+static void writeback_cancel(struct open_file* of){
+    pthread_mutex_lock(&writeback.lock);
+    if(of->queued){
+	struct open_file* prev = NULL;
+
+	for(struct open_file* p = writeback.head; p != of; p = p->queue_next){
+	    prev = p;
+	}
+	if(prev){
+	    prev->queue_next = of->queue_next;
+	}
+	else{
+	    writeback.head = of->queue_next;
+	}
+	if(writeback.tail == of){
+	    writeback.tail = prev;
+	}
+	of->queued = 0;
+    }
+    while(writeback.running == of){
+	pthread_cond_wait(&writeback.done, &writeback.lock);
+    }
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+/* Hold a writer back while its file has all the dirty blocks it may, until
+ * the file's writeback is done, and while the mount has, until writeback
+ * makes room */
+static void throttle(struct open_file* of, int file_full){
+    int waited = 0;
+
+    pthread_mutex_lock(&writeback.lock);
+    while(!writeback.stop &&
+	  ((file_full && (of->queued || of->writing)) ||
+	   (__atomic_load_n(&dirty_total, __ATOMIC_RELAXED) >= OPENFILE_DIRTY_TOTAL_MAX &&
+	    (writeback.head || writeback.running)))){
+	waited = 1;
+	pthread_cond_wait(&writeback.done, &writeback.lock);
+    }
+    writeback.stats.throttled += waited;
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+extern int openfile_writeback_init(const struct blockfile_key* key){
+    int ret;
+
+    writeback.key = key;
+    writeback.stop = 0;
+    ret = pthread_create(&writeback.thread, NULL, writeback_worker, NULL);
+    if(ret){
+	return -ret;
+    }
+    writeback.started = 1;
+    return 0;
+}
+
+extern void openfile_writeback_destroy(void){
+    if(!writeback.started){
+	return;
+    }
+    pthread_mutex_lock(&writeback.lock);
+    writeback.stop = 1;
+    pthread_cond_broadcast(&writeback.work);
+    pthread_cond_broadcast(&writeback.done);
+    pthread_mutex_unlock(&writeback.lock);
+
+    pthread_join(writeback.thread, NULL);
+    writeback.started = 0;
+}
+
+extern void openfile_get_stats(struct openfile_stats* stats){
+    pthread_mutex_lock(&writeback.lock);
+    *stats = writeback.stats;
+    pthread_mutex_unlock(&writeback.lock);
+    stats->dirty = __atomic_load_n(&dirty_total, __ATOMIC_RELAXED);
+}
+
+extern int openfile_put(struct open_file* of, const struct blockfile_key* key){
+    int ret;
+
+    pthread_mutex_lock(&table_lock);
+    if(of->refs > 1){
+	of->refs--;
+	pthread_mutex_unlock(&table_lock);
+	return 0;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    /* Flush while of is still findable, then again under table_lock for
+     * anything written by a handle that came and went meanwhile */
+    lock_idle(of);
+    ret = flush_locked(of, key);
+    pthread_rwlock_unlock(&of->lock);
+
+    pthread_mutex_lock(&table_lock);
+    if(--of->refs > 0){
+	pthread_mutex_unlock(&table_lock);
+	return ret;
+    }
+    for(struct open_file** p = table_bucket(of->dev, of->ino); *p; p = &(*p)->next){
+	if(*p == of){
+	    *p = of->next;
+	    break;
+	}
+    }
+    writeback_cancel(of);
+    if(ret == 0){
+	ret = flush_locked(of, key);
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    /* what still could not be written is lost */
+    for(int i = 0; i < DIRTY_BUCKETS; i++){
+	while(of->dirty[i]){
+	    struct dirty_block* d = of->dirty[i];
+	    of->dirty[i] = d->next;
+	    free(d);
+	    __atomic_sub_fetch(&dirty_total, 1, __ATOMIC_RELAXED);
+	}
+    }
+    close(of->fd);
+    pthread_rwlock_destroy(&of->lock);
+    free(of);
+    return ret;
+}
+
+extern ssize_t openfile_read(struct open_file* of, const struct blockfile_key* key,
+			     char* buf, size_t size, off_t offset){
+    uint64_t first;
+    size_t count;
+    unsigned char* plain;
+    int ret = 0;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+
+    pthread_rwlock_rdlock(&of->lock);
+    if((uint64_t)offset >= of->header.size || size == 0){
+	pthread_rwlock_unlock(&of->lock);
+	return 0;
+    }
+    if(size > of->header.size - offset){
+	size = of->header.size - offset;
+    }
+
+    first = offset / BLOCKFILE_BLOCK_SIZE;
+    count = (offset + size - 1) / BLOCKFILE_BLOCK_SIZE - first + 1;
+    plain = malloc(count * BLOCKFILE_BLOCK_SIZE);
+    if(!plain){
+	pthread_rwlock_unlock(&of->lock);
+	return -ENOMEM;
+    }
+
+    /* Blocks in memory are copied; each run of blocks between them is read
+     * with one pread() and cached */
+    for(size_t i = 0; i < count; ){
+	size_t j = i;
+	int hit = 0;
+
+	while(j < count && !(hit = block_from_memory(of, first + j,
+						      plain + j * BLOCKFILE_BLOCK_SIZE))){
+	    j++;
+	}
+	if(j > i){
+	    ret = blockfile_read_blocks(of->fd, &of->header, key, first + i, j - i,
+					plain + i * BLOCKFILE_BLOCK_SIZE);
+	    if(ret){
+		break;
+	    }
+	    for(size_t k = i; k < j; k++){
+		blockcache_put(&of->cache_key, first + k, plain + k * BLOCKFILE_BLOCK_SIZE);
+	    }
+	}
+	i = hit ? j + 1 : j;
+    }
+    pthread_rwlock_unlock(&of->lock);
+
+    if(ret == 0){
+	memcpy(buf, plain + offset % BLOCKFILE_BLOCK_SIZE, size);
+    }
+    free(plain);
+    return ret ? ret : (ssize_t)size;
+}
+
+extern int openfile_prefetch(struct open_file* of, const struct blockfile_key* key,
+			     uint64_t first, size_t count){
+    unsigned char* plain;
+    uint64_t end;
+    size_t i = 0;
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&of->lock);
+    end = block_count(of->header.size);
+    if(first >= end){
+	pthread_rwlock_unlock(&of->lock);
+	return 0;
+    }
+    if(count > end - first){
+	count = end - first;
+    }
+    plain = malloc(count * BLOCKFILE_BLOCK_SIZE);
+    if(!plain){
+	pthread_rwlock_unlock(&of->lock);
+	return -ENOMEM;
+    }
+
+    /* Each run of blocks that are neither dirty nor cached is read with one
+     * pread() */
+    while(i < count && ret >= 0){
+	size_t j;
+
+	while(i < count && (unwritten_find(of, first + i) ||
+			    blockcache_contains(&of->cache_key, first + i))){
+	    i++;
+	}
+	for(j = i; j < count && !unwritten_find(of, first + j) &&
+		!blockcache_contains(&of->cache_key, first + j); j++){
+	}
+	if(j > i){
+	    int err = blockfile_read_blocks(of->fd, &of->header, key, first + i, j - i,
+					    plain + i * BLOCKFILE_BLOCK_SIZE);
+	    if(err){
+		ret = err;
+		break;
+	    }
+	    for(size_t k = i; k < j; k++){
+		blockcache_put(&of->cache_key, first + k, plain + k * BLOCKFILE_BLOCK_SIZE);
+	    }
+	    ret += j - i;
+	}
+	i = j;
+    }
+    pthread_rwlock_unlock(&of->lock);
+
+    free(plain);
+    return ret;
+}
+
+/* Whether of, or the mount, holds as many dirty blocks as it may; called
+ * with of->lock held */
+static int dirty_full(const struct open_file* of){
+    return of->ndirty >= OPENFILE_DIRTY_FILE_MAX ||
+	__atomic_load_n(&dirty_total, __ATOMIC_RELAXED) >= OPENFILE_DIRTY_TOTAL_MAX;
+}
+
+extern ssize_t openfile_write(struct open_file* of, const struct blockfile_key* key,
+			      const char* buf, size_t size, off_t offset){
+    int sync;
+    size_t done = 0;
+    int ret = 0;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+
+    pthread_rwlock_wrlock(&of->lock);
+    /* Without the writeback thread, or after it failed to write this file,
+     * a file or mount with too much dirty data is written out here. If that
+     * fails the write fails, instead of taking more blocks that cannot be
+     * written. */
+    sync = !writeback.started || of->writeback_failed;
+    if(sync && dirty_full(of) && !of->writing){
+	ret = flush_locked(of, key);
+	if(ret){
+	    pthread_rwlock_unlock(&of->lock);
+	    return ret;
+	}
+    }
+    while(done < size){
+	uint64_t n = (offset + done) / BLOCKFILE_BLOCK_SIZE;
+	size_t in = (offset + done) % BLOCKFILE_BLOCK_SIZE;
+	size_t len = BLOCKFILE_BLOCK_SIZE - in;
+	struct dirty_block* d;
+
+	if(len > size - done){
+	    len = size - done;
+	}
+
+	d = dirty_find(of, n);
+	if(!d){
+	    struct dirty_block* old = of->ninflight ? inflight_find(of, n) : NULL;
+
+	    d = malloc(sizeof(*d));
+	    if(!d){
+		ret = -ENOMEM;
+		break;
+	    }
+	    d->n = n;
+	    /* a block the write only partly covers keeps the rest of its bytes,
+	     * from the copy being written back if there is one */
+	    if(len < BLOCKFILE_BLOCK_SIZE && old){
+		memcpy(d->data, old->data, BLOCKFILE_BLOCK_SIZE);
+	    }
+	    else if(len < BLOCKFILE_BLOCK_SIZE && n < block_count(of->header.size)){
+		if(!blockcache_get(&of->cache_key, n, d->data)){
+		    ret = blockfile_read_blocks(of->fd, &of->header, key, n, 1, d->data);
+		}
+		if(ret){
+		    free(d);
+		    break;
+		}
+	    }
+	    else if(len < BLOCKFILE_BLOCK_SIZE){
+		memset(d->data, 0, BLOCKFILE_BLOCK_SIZE);
+	    }
+	    dirty_insert(of, d);
+	    /* the dirty block is the only current copy until it is flushed */
+	    blockcache_invalidate(&of->cache_key, n);
+	}
+	memcpy(d->data + in, buf + done, len);
+	done += len;
+
+	if(offset + done > of->header.size){
+	    of->header.size = offset + done;
+	    of->size_dirty = 1;
+	    __atomic_store_n(&of->size, of->header.size, __ATOMIC_RELAXED);
+	}
+    }
+
+    /* a failure here with some of the data taken is returned by the next
+     * write, which finds the blocks still dirty */
+    if(sync){
+	if(ret == 0 && dirty_full(of) && !of->writing){
+	    ret = flush_locked(of, key);
+	}
+	pthread_rwlock_unlock(&of->lock);
+    }
+    else{
+	long total = __atomic_load_n(&dirty_total, __ATOMIC_RELAXED);
+	int start = of->ndirty >= OPENFILE_WRITEBACK_BLOCKS;
+	int file_full = of->ndirty + of->ninflight >= OPENFILE_DIRTY_FILE_MAX;
+
+	pthread_rwlock_unlock(&of->lock);
+	if(start || total >= OPENFILE_DIRTY_TOTAL_MAX / 2){
+	    writeback_queue(of);
+	}
+	if(file_full || total >= OPENFILE_DIRTY_TOTAL_MAX){
+	    throttle(of, file_full);
+	}
+    }
+
+    if(done > 0){
+	return done;
+    }
+    return ret;
+}
+
+extern int openfile_truncate(struct open_file* of, const struct blockfile_key* key,
+			     off_t size){
+    int ret;
+
+    lock_idle(of);
+    ret = flush_locked(of, key);
+    if(ret == 0 && size >= 0){
+	/* the block the file now ends in loses its tail too */
+	blockcache_invalidate_from(&of->cache_key, size / BLOCKFILE_BLOCK_SIZE);
+	ret = blockfile_truncate(of->fd, &of->header, key, size);
+	__atomic_store_n(&of->size, of->header.size, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&of->lock);
+    return ret;
+}
+
+extern int openfile_flush(struct open_file* of, const struct blockfile_key* key){
+    int ret;
+
+    lock_idle(of);
+    ret = flush_locked(of, key);
+    pthread_rwlock_unlock(&of->lock);
+    return ret;
+}
+
+extern int openfile_fsync(struct open_file* of, const struct blockfile_key* key,
+			  int datasync){
+    int ret;
+
+    lock_idle(of);
+    ret = flush_locked(of, key);
+    if(ret == 0 && (datasync ? fdatasync(of->fd) : fsync(of->fd)) == -1){
+	ret = -errno;
+    }
+    pthread_rwlock_unlock(&of->lock);
+    return ret;
+}
+
+extern int openfile_size(const struct stat* st, uint64_t* size){
+    struct open_file* of;
+
+    /* not of->lock: waiting on it under table_lock would hold up every
+     * open and release behind one file's long flush */
+    pthread_mutex_lock(&table_lock);
+    of = table_find(st);
+    if(of){
+	*size = __atomic_load_n(&of->size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&table_lock);
+    return of != NULL;
+}
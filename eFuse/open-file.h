@@ -0,0 +1,111 @@
+/* open-file.h
+ * Shared state of an open encrypted file for eFUSE
+ *
+ * All handles open on one mirror inode share an open_file, so they see the
+ * same plaintext size and each other's unflushed writes. Writes land in
+ * plaintext dirty blocks in memory, and once a file has
+ * OPENFILE_WRITEBACK_BLOCKS of them, or the mount half its limit, a
+ * writeback thread encrypts and writes them to the mirror in block order, so
+ * a write costs little more than copying its data. A writer that finds its
+ * file or the mount at its limit waits for writeback to make room.
+ * openfile_flush(), openfile_fsync() and the last openfile_put() wait for
+ * writeback of their own file only, then write what is left themselves.
+ * Without the thread, or while it fails to write a file, a write over the
+ * limits flushes the file itself. Blocks read from the mirror are kept in
+ * the block cache (block-cache.h); writes and truncates drop the cached
+ * copies of the blocks they change.
+ *
+ * Any number of threads may use an open_file at once. Reads of one file run
+ * side by side, while a write, truncate or flush waits for them and has the
+ * file to itself.
+ *
+ * Unless noted otherwise functions return 0 or a negative errno.
+ *
+ */
+
+#ifndef OPEN_FILE_H
+#define OPEN_FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "block-file.h"
+
+#define OPENFILE_DIRTY_FILE_MAX 2048	/* dirty blocks (8M) one file may hold */
+#define OPENFILE_DIRTY_TOTAL_MAX 16384	/* dirty blocks (64M) for the mount */
+#define OPENFILE_WRITEBACK_BLOCKS 256	/* dirty blocks (1M) that start writeback */
+
+struct open_file;
+
+struct openfile_stats{
+    uint64_t passes;		/* files written back */
+    uint64_t blocks;		/* blocks they wrote */
+    uint64_t errors;		/* passes that failed */
+    uint64_t throttled;		/* writes that waited for writeback */
+    uint64_t dirty;		/* blocks dirty or being written now */
+};
+
+/* int openfile_writeback_init(const struct blockfile_key* key)
+ * Purpose: Start the writeback thread. Start it after the process has
+ *          daemonized.
+ * Return: 0, or a negative errno
+ */
+extern int openfile_writeback_init(const struct blockfile_key* key);
+
+/* Stop and join the thread; files still open are flushed as they close */
+extern void openfile_writeback_destroy(void);
+
+/* struct open_file* openfile_get(int fd, const struct stat* st,
+ *                                const struct blockfile_key* key)
+ * Purpose: Find the open_file of the mirror inode in st, or make one from
+ *          the header of fd, checked against key, and take a reference to
+ *          it. The open_file keeps a dup() of fd, or of a later one if that
+ *          one is writable and fd is not.
+ * Return: The open_file, or NULL with errno set
+ */
+extern struct open_file* openfile_get(int fd, const struct stat* st,
+				      const struct blockfile_key* key);
+
+/* int openfile_put(struct open_file* of, const struct blockfile_key* key)
+ * Purpose: Drop a reference, flushing and freeing of with the last one
+ */
+extern int openfile_put(struct open_file* of, const struct blockfile_key* key);
+
+/* Read up to size bytes at offset; returns the bytes read or a negative errno */
+extern ssize_t openfile_read(struct open_file* of, const struct blockfile_key* key,
+			     char* buf, size_t size, off_t offset);
+
+/* int openfile_prefetch(struct open_file* of, const struct blockfile_key* key,
+ *                       uint64_t first, size_t count)
+ * Purpose: Read and decrypt into the block cache the blocks from first to
+ *          first + count that are in the file but neither dirty nor cached
+ * Return: The blocks read, or a negative errno
+ */
+extern int openfile_prefetch(struct open_file* of, const struct blockfile_key* key,
+			     uint64_t first, size_t count);
+
+/* Buffer size bytes at offset; returns size or a negative errno */
+extern ssize_t openfile_write(struct open_file* of, const struct blockfile_key* key,
+			      const char* buf, size_t size, off_t offset);
+
+extern int openfile_truncate(struct open_file* of, const struct blockfile_key* key,
+			     off_t size);
+
+/* Encrypt and write every dirty block, then the header */
+extern int openfile_flush(struct open_file* of, const struct blockfile_key* key);
+
+/* openfile_flush(), then fsync() or fdatasync() the mirror file */
+extern int openfile_fsync(struct open_file* of, const struct blockfile_key* key,
+			  int datasync);
+
+/* int openfile_size(const struct stat* st, uint64_t* size)
+ * Purpose: Get the plaintext size, unflushed writes included, of the mirror
+ *          inode in st if it is open
+ * Return: 1 if it is open, 0 if not
+ */
+extern int openfile_size(const struct stat* st, uint64_t* size);
+
+extern void openfile_get_stats(struct openfile_stats* stats);
+
+#endif
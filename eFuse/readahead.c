@@ -0,0 +1,200 @@
+/* readahead.c
+ * Sequential readahead of encrypted files for eFUSE
+ *
+ * See readahead.h. Windows wait in a ring under queue.lock for the one
+ * readahead thread. A handle that ends takes its windows out of the ring
+ * and waits for the one running, so the thread never uses an open_file
+ * after its handle is gone.
+ *
+ */
+
+#include "readahead.h"
+
+struct request{
+    struct readahead* ra;	/* NULL once its handle ended */
+    uint64_t first;
+    size_t count;
+};
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;	/* running changed */
+    struct request ring[READAHEAD_QUEUE];
+    size_t head;
+    size_t count;
+    struct readahead* running;
+    const struct blockfile_key* key;
+    size_t max_bytes;		/* 0 when readahead is off */
+    pthread_t thread;
+    int stop;
+    struct readahead_stats stats;
+} queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+#define MIN_WINDOW ((size_t)READAHEAD_MIN_KB << 10)
+
+static void* worker(void* arg){
+    (void)arg;
+
+    pthread_mutex_lock(&queue.lock);
+    while(!queue.stop){
+	struct request r;
+	int ret;
+
+	if(queue.count == 0){
+	    pthread_cond_wait(&queue.work, &queue.lock);
+	    continue;
+	}
+	r = queue.ring[queue.head];
+	queue.head = (queue.head + 1) % READAHEAD_QUEUE;
+	queue.count--;
+	if(!r.ra){
+	    continue;
+	}
+
+	queue.running = r.ra;
+	pthread_mutex_unlock(&queue.lock);
+	ret = openfile_prefetch(r.ra->of, queue.key, r.first, r.count);
+	pthread_mutex_lock(&queue.lock);
+	queue.running = NULL;
+	pthread_cond_broadcast(&queue.idle);
+
+	queue.stats.requests++;
+	if(ret > 0){
+	    queue.stats.blocks += ret;
+	}
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return NULL;
+}
+
+extern int readahead_init(size_t max_bytes, const struct blockfile_key* key){
+    int ret;
+
+    queue.key = key;
+    queue.stop = 0;
+    if(max_bytes == 0){
+	return 0;
+    }
+    ret = pthread_create(&queue.thread, NULL, worker, NULL);
+    if(ret){
+	return -ret;
+    }
+    queue.max_bytes = max_bytes < MIN_WINDOW ? MIN_WINDOW : max_bytes;
+    return 0;
+}
+
+extern void readahead_destroy(void){
+    if(queue.max_bytes == 0){
+	return;
+    }
+    pthread_mutex_lock(&queue.lock);
+    queue.stop = 1;
+    pthread_cond_broadcast(&queue.work);
+    pthread_mutex_unlock(&queue.lock);
+
+    pthread_join(queue.thread, NULL);
+    queue.max_bytes = 0;
+}
+
+extern void readahead_start(struct readahead* ra, struct open_file* of){
+    pthread_mutex_init(&ra->lock, NULL);
+    ra->of = of;
+    ra->next = 0;
+    ra->ahead = 0;
+    ra->window = 0;
+}
+
+extern void readahead_end(struct readahead* ra){
+    pthread_mutex_lock(&queue.lock);
+    for(size_t i = 0; i < queue.count; i++){
+	struct request* r = &queue.ring[(queue.head + i) % READAHEAD_QUEUE];
+	if(r->ra == ra){
+	    r->ra = NULL;
+	}
+    }
+    while(queue.running == ra){
+	pthread_cond_wait(&queue.idle, &queue.lock);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    pthread_mutex_destroy(&ra->lock);
+}
+
+/* Queue blocks from first to first + count for ra
+ * Return: 1 if queued, 0 if the queue is full or readahead is off
+ */
+static int enqueue(struct readahead* ra, uint64_t first, size_t count){
+    int queued = 0;
+
+    pthread_mutex_lock(&queue.lock);
+    if(queue.max_bytes && queue.count < READAHEAD_QUEUE){
+	struct request* r = &queue.ring[(queue.head + queue.count) % READAHEAD_QUEUE];
+
+	r->ra = ra;
+	r->first = first;
+	r->count = count;
+	queue.count++;
+	queued = 1;
+	pthread_cond_signal(&queue.work);
+    }
+    else{
+	queue.stats.dropped++;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return queued;
+}
+
+extern void readahead_note(struct readahead* ra, off_t offset, size_t size){
+    off_t end = offset + size;
+    uint64_t first;
+    uint64_t last;
+
+    if(queue.max_bytes == 0 || size == 0){
+	return;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    /* requests of a sequential reader can arrive a little out of order */
+    if(offset + (off_t)MIN_WINDOW < ra->next || offset > ra->next + (off_t)MIN_WINDOW){
+	ra->window = 0;
+	ra->ahead = 0;
+	ra->next = end;
+	pthread_mutex_unlock(&ra->lock);
+	return;
+    }
+    if(ra->window == 0){
+	ra->window = MIN_WINDOW;
+    }
+    if(end > ra->next){
+	ra->next = end;
+    }
+    /* the reader caught up with what was read ahead */
+    if(ra->ahead < ra->next){
+	ra->ahead = ra->next;
+    }
+    if((size_t)(ra->ahead - ra->next) >= ra->window / 2){
+	pthread_mutex_unlock(&ra->lock);
+	return;
+    }
+
+    first = ra->ahead / BLOCKFILE_BLOCK_SIZE;
+    last = (ra->next + ra->window - 1) / BLOCKFILE_BLOCK_SIZE;
+    if(enqueue(ra, first, last - first + 1)){
+	ra->ahead = (off_t)(last + 1) * BLOCKFILE_BLOCK_SIZE;
+	ra->window = ra->window * 2 < queue.max_bytes ? ra->window * 2 : queue.max_bytes;
+    }
+    else if(ra->window > MIN_WINDOW){
+	ra->window /= 2;
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+extern void readahead_get_stats(struct readahead_stats* stats){
+    pthread_mutex_lock(&queue.lock);
+    *stats = queue.stats;
+    pthread_mutex_unlock(&queue.lock);
+}
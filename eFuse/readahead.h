@@ -0,0 +1,69 @@
+/* readahead.h
+ * Sequential readahead of encrypted files for eFUSE
+ *
+ * Each handle on an encrypted file keeps a struct readahead that follows its
+ * reads. Once they are sequential, a background thread decrypts the blocks
+ * ahead of the reader into the block cache (block-cache.h), so the reads that
+ * follow find them there instead of waiting on pread() and AES. The window
+ * starts at READAHEAD_MIN_KB and doubles each time the reader uses up half of
+ * it, so a fast reader reaches the maximum within a few requests while a
+ * slow one does not fill the cache with blocks it will take long to need;
+ * it halves when the thread falls behind and a request has to be dropped,
+ * and a read that is not sequential stops readahead until reads are again.
+ *
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "block-file.h"
+#include "open-file.h"
+
+#define READAHEAD_DEFAULT_KB 2048	/* largest window */
+#define READAHEAD_MIN_KB 128		/* first window */
+#define READAHEAD_QUEUE 64		/* requests waiting for the thread */
+
+struct readahead{
+    pthread_mutex_t lock;
+    struct open_file* of;
+    off_t next;			/* end of the reads so far */
+    off_t ahead;		/* end of what was read ahead */
+    size_t window;		/* bytes to keep read ahead; 0 if not sequential */
+};
+
+struct readahead_stats{
+    uint64_t requests;		/* windows read ahead */
+    uint64_t blocks;		/* blocks they decrypted */
+    uint64_t dropped;		/* windows dropped with the queue full */
+};
+
+/* int readahead_init(size_t max_bytes, const struct blockfile_key* key)
+ * Purpose: Start the readahead thread, with windows of up to max_bytes;
+ *          0 turns readahead off. Start it after the process has daemonized.
+ * Return: 0, or a negative errno
+ */
+extern int readahead_init(size_t max_bytes, const struct blockfile_key* key);
+
+/* Stop and join the thread */
+extern void readahead_destroy(void);
+
+/* Start following the reads of a handle on of */
+extern void readahead_start(struct readahead* ra, struct open_file* of);
+
+/* Stop following them, waiting for readahead of ra that is running */
+extern void readahead_end(struct readahead* ra);
+
+/* void readahead_note(struct readahead* ra, off_t offset, size_t size)
+ * Purpose: Record a read of size bytes at offset, and queue the next window
+ *          if reads are sequential and the reader has used up half the last
+ */
+extern void readahead_note(struct readahead* ra, off_t offset, size_t size);
+
+extern void readahead_get_stats(struct readahead_stats* stats);
+
+#endif